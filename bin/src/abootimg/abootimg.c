@@ -24,6 +24,7 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 
@@ -108,6 +109,59 @@ void abort_printf(char *fmt, ...)
 }
 
 
+/*
+ * When TRACE_DIR is set, each step is written to TRACE_DIR/abootimg.<pid>.json
+ * as a Chrome trace event, which the unpack and repack scripts merge with
+ * the events of the other tools into one timeline.
+ */
+FILE* trace_file;
+
+double trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void trace_close(void)
+{
+  fputs("]\n", trace_file);
+  fclose(trace_file);
+}
+
+void trace_open(void)
+{
+  char* dir = getenv("TRACE_DIR");
+  char path[4096];
+
+  if (!dir || !*dir)
+    return;
+
+  snprintf(path, sizeof(path), "%s/abootimg.%d.json", dir, (int)getpid());
+  trace_file = fopen(path, "w");
+  if (!trace_file)
+    return;
+
+  fprintf(trace_file, "[\n{\"name\":\"process_labels\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"labels\":\"abootimg\"}}\n", (int)getpid());
+  atexit(trace_close);
+}
+
+void trace_span(const char* name, double start, unsigned bytes)
+{
+  if (!trace_file)
+    return;
+
+  fprintf(trace_file, ",{\"name\":\"%s\",\"cat\":\"abootimg\",\"ph\":\"X\",\"ts\":%.3f,"
+          "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"bytes\":%u}}\n",
+          name, start, trace_now() - start, (int)getpid(), (int)getpid(), bytes);
+}
+
+#define TRACE(name, bytes, step) \
+  do { double _start = trace_now(); step; trace_span(name, _start, bytes); } while (0)
+
+
 int blkgetsize(int fd, unsigned long long *pbsize)
 {
 # if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -897,6 +951,8 @@ int main(int argc, char** argv)
 {
   t_abootimg* bootimg = new_bootimg();
 
+  trace_open();
+
   switch(parse_args(argc, argv, bootimg))
   {
     case none:
@@ -916,19 +972,20 @@ int main(int argc, char** argv)
 
     case extract:
       open_bootimg(bootimg, "r");
-      read_header(bootimg);
+      TRACE("read header", sizeof(boot_img_hdr), read_header(bootimg));
       write_bootimg_config(bootimg);
-      extract_kernel(bootimg);
-      extract_ramdisk(bootimg);
-      extract_second(bootimg);
+      TRACE("extract kernel", bootimg->header.kernel_size, extract_kernel(bootimg));
+      TRACE("extract ramdisk", bootimg->header.ramdisk_size, extract_ramdisk(bootimg));
+      TRACE("extract second", bootimg->header.second_size, extract_second(bootimg));
       break;
     
     case update:
       open_bootimg(bootimg, "r+");
-      read_header(bootimg);
+      TRACE("read header", sizeof(boot_img_hdr), read_header(bootimg));
       update_header(bootimg);
-      update_images(bootimg);
-      write_bootimg(bootimg);
+      TRACE("read images", bootimg->header.kernel_size + bootimg->header.ramdisk_size,
+            update_images(bootimg));
+      TRACE("write", bootimg->size, write_bootimg(bootimg));
       break;
 
     case create:
@@ -939,10 +996,11 @@ int main(int argc, char** argv)
       check_if_block_device(bootimg);
       open_bootimg(bootimg, "w");
       update_header(bootimg);
-      update_images(bootimg);
+      TRACE("read images", bootimg->header.kernel_size + bootimg->header.ramdisk_size,
+            update_images(bootimg));
       if (check_boot_img_header(bootimg))
         abort_printf("%s: Sanity cheks failed", bootimg->fname);
-      write_bootimg(bootimg);
+      TRACE("write", bootimg->size, write_bootimg(bootimg));
       break;
   }
 
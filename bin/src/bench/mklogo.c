@@ -0,0 +1,179 @@
+/*
+ * mklogo - writes a logo partition in the AMLogic resource image format
+ *
+ * Usage: mklogo <output> <file> [...]
+ *
+ * Each file becomes an item named after the file, without its directory
+ * and extension, the way logo_img_packer -r packs a directory.  The image
+ * is a version 2 resource image: the image header, then the header of every
+ * item, then the data of every item, each aligned to 16 bytes.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RES_IMG_MAGIC "AML_RES!"
+#define RES_IMG_VERSION 2
+#define RES_IMG_ALIGN 16
+#define RES_ITEM_MAGIC 0x27051956
+#define RES_ITEM_NAME_LEN 32
+
+/* Both headers are 64 bytes, with little endian fields */
+struct res_img_head {
+    uint32_t crc;               /* of the whole image after this field */
+    int32_t version;
+    uint8_t magic[8];
+    uint32_t img_sz;
+    uint32_t item_num;
+    uint32_t align_sz;
+    uint8_t reserved[36];
+};
+
+struct res_item_head {
+    uint32_t magic;
+    uint32_t hcrc;
+    uint32_t size;
+    uint32_t start;             /* offset of the data in the image */
+    uint32_t end;
+    uint32_t next;              /* offset of the next item header, or 0 */
+    uint32_t dcrc;
+    uint8_t index;
+    uint8_t nums;
+    uint8_t type;
+    uint8_t comp;
+    char name[RES_ITEM_NAME_LEN];
+};
+
+static uint32_t crc_table[256];
+
+/* The CRC of logo_img_packer: CRC-32 seeded with ~0, without the final xor */
+static uint32_t res_crc32(const uint8_t *buf, size_t size)
+{
+    uint32_t crc = 0xffffffff;
+    uint32_t c;
+    size_t i;
+    int k;
+
+    if (!crc_table[1]) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+            }
+            crc_table[i] = c;
+        }
+    }
+
+    for (i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+static void item_name(char *name, const char *path)
+{
+    const char *base = strrchr(path, '/');
+    char *ext;
+
+    strncpy(name, base ? base + 1 : path, RES_ITEM_NAME_LEN - 1);
+    name[RES_ITEM_NAME_LEN - 1] = '\0';
+
+    ext = strrchr(name, '.');
+    if (ext && ext != name) {
+        memset(ext, 0, name + RES_ITEM_NAME_LEN - ext);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct res_img_head *head;
+    struct res_item_head *item;
+    uint8_t *img;
+    size_t img_sz;
+    size_t pos;
+    long *sizes;
+    long size;
+    FILE *f;
+    int nums;
+    int i;
+
+    if (argc < 3 || argc - 2 > 255) {
+        fprintf(stderr, "Usage: mklogo <output> <file> [...]\n");
+        exit(-1);
+    }
+    nums = argc - 2;
+
+    sizes = calloc(nums, sizeof(*sizes));
+    if (!sizes) {
+        fprintf(stderr, "Cannot allocate sizes\n");
+        exit(-1);
+    }
+
+    /* Size the image first, from the sizes of the files, which are read at these sizes */
+    img_sz = sizeof(*head) + nums * sizeof(*item);
+    for (i = 0; i < nums; i++) {
+        f = fopen(argv[i + 2], "rb");
+        if (!f || fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0) {
+            fprintf(stderr, "Cannot open %s: %s\n", argv[i + 2], strerror(errno));
+            exit(-1);
+        }
+        fclose(f);
+        sizes[i] = size;
+        img_sz += (size + RES_IMG_ALIGN - 1) & ~(RES_IMG_ALIGN - 1);
+    }
+
+    img = calloc(1, img_sz);
+    if (!img) {
+        fprintf(stderr, "Cannot allocate 0x%zx bytes\n", img_sz);
+        exit(-1);
+    }
+    head = (struct res_img_head *)img;
+    item = (struct res_item_head *)(head + 1);
+
+    pos = sizeof(*head) + nums * sizeof(*item);
+    for (i = 0; i < nums; i++) {
+        f = fopen(argv[i + 2], "rb");
+        if (!f) {
+            fprintf(stderr, "Cannot open %s: %s\n", argv[i + 2], strerror(errno));
+            exit(-1);
+        }
+        size = sizes[i];
+        if (fread(img + pos, 1, size, f) != (size_t)size) {
+            fprintf(stderr, "Cannot read %s\n", argv[i + 2]);
+            exit(-1);
+        }
+        fclose(f);
+
+        item[i].magic = RES_ITEM_MAGIC;
+        item[i].size = size;
+        item[i].start = pos;
+        item[i].next = i + 1 < nums ? sizeof(*head) + (i + 1) * sizeof(*item) : 0;
+        item[i].index = i;
+        item[i].nums = nums;
+        item_name(item[i].name, argv[i + 2]);
+
+        pos += (size + RES_IMG_ALIGN - 1) & ~(RES_IMG_ALIGN - 1);
+    }
+
+    memcpy(head->magic, RES_IMG_MAGIC, sizeof(head->magic));
+    head->version = RES_IMG_VERSION;
+    head->img_sz = img_sz;
+    head->item_num = nums;
+    head->align_sz = RES_IMG_ALIGN;
+    head->crc = res_crc32(img + 4, img_sz - 4);
+
+    f = fopen(argv[1], "wb");
+    if (!f || fwrite(img, 1, img_sz, f) != img_sz || fclose(f) != 0) {
+        fprintf(stderr, "Cannot write %s\n", argv[1]);
+        exit(-1);
+    }
+
+    free(img);
+    free(sizes);
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * stagerun - runs one stage of the unpack/repack pipeline and records it
+ *
+ * Usage: stagerun <stats_file> <stage> <command> [args...]
+ *
+ * Runs the command, then appends a tab separated line to stats_file:
+ *
+ *   stage  wall_s  read_bytes  write_bytes  max_rss_kb  status
+ *
+ * read_bytes and write_bytes count what the command and the children it
+ * waited for passed to read and write calls.  max_rss_kb is the peak RSS of
+ * the largest of them.  Exits with the status of the command.  A stats_file
+ * of - records nothing.
+ *
+ * When TRACE_DIR is set, the stage is also written there as a Chrome trace
+ * event spanning the command, in stage.<pid>.json with the pid of the
+ * command, so that it frames the events the command traces itself.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Writes s as a JSON string, the stages and commands need no more escaping */
+static void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+        }
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void write_trace(const char *dir, const char *stage, char **cmd, pid_t pid,
+                        double start, double wall, uint64_t rchar, uint64_t wchar,
+                        long max_rss, int code)
+{
+    char path[4096];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/stage.%d.json", dir, (int)pid);
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write trace %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":",
+            (int)pid);
+    json_string(f, stage);
+    fprintf(f, "}}\n,{\"name\":");
+    json_string(f, stage);
+    fprintf(f, ",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"command\":", start * 1e6, wall * 1e6, (int)pid, (int)pid);
+    json_string(f, cmd[0]);
+    fprintf(f, ",\"read_bytes\":%" PRIu64 ",\"write_bytes\":%" PRIu64
+            ",\"max_rss_kb\":%ld,\"status\":%d}}\n]\n", rchar, wchar, max_rss, code);
+
+    fclose(f);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Reads the I/O counters of an exited child that hasn't been reaped yet.
+ * They stay zero where /proc/<pid>/io doesn't exist.
+ */
+static void read_io(pid_t pid, uint64_t *rchar, uint64_t *wchar)
+{
+    char path[64];
+    char line[128];
+    FILE *f;
+
+    *rchar = 0;
+    *wchar = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    f = fopen(path, "r");
+    if (!f) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "rchar: %" SCNu64, rchar);
+        sscanf(line, "wchar: %" SCNu64, wchar);
+    }
+
+    fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+    struct rusage ru;
+    siginfo_t info;
+    uint64_t rchar;
+    uint64_t wchar;
+    double start;
+    double wall;
+    char line[512];
+    int status;
+    int code;
+    pid_t pid;
+    int fd;
+    int len;
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: stagerun <stats_file> <stage> <command> [args...]\n");
+        exit(-1);
+    }
+
+    start = now();
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+
+    if (pid == 0) {
+        execvp(argv[3], argv + 3);
+        fprintf(stderr, "Cannot run %s: %s\n", argv[3], strerror(errno));
+        _exit(127);
+    }
+
+    /* Leave the child a zombie until its counters are read */
+    memset(&info, 0, sizeof(info));
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) ;
+    wall = now() - start;
+    read_io(pid, &rchar, &wchar);
+
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        exit(-1);
+    }
+    code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    if (getenv("TRACE_DIR") && *getenv("TRACE_DIR")) {
+        write_trace(getenv("TRACE_DIR"), argv[2], argv + 3, pid, start, wall, rchar, wchar,
+                    ru.ru_maxrss, code);
+    }
+
+    if (strcmp(argv[1], "-") == 0) {
+        exit(code);
+    }
+
+    len = snprintf(line, sizeof(line), "%s\t%.3f\t%" PRIu64 "\t%" PRIu64 "\t%ld\t%d\n",
+                   argv[2], wall, rchar, wchar, ru.ru_maxrss, code);
+
+    fd = open(argv[1], O_WRONLY | O_CREAT | O_APPEND, 0664);
+    if (fd < 0 || write(fd, line, len) != len) {
+        fprintf(stderr, "Cannot write stats file %s\n", argv[1]);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    exit(code);
+}
@@ -27,12 +27,15 @@
 
 #include <sparse/sparse.h>
 #include "sparse_file.h"
+#include "sparse_format.h"
 #include "backed_block.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
+#define PROGRESS_INTERVAL_MS 500
+
 #if defined(__APPLE__) && defined(__MACH__)
 #define lseek64 lseek
 #endif
@@ -43,7 +46,45 @@
 
 void usage()
 {
-    fprintf(stderr, "Usage: append2simg <output> <input>\n");
+    fprintf(stderr, "Usage: append2simg [--stats] [--progress] <output> <input>\n");
+    fprintf(stderr, "  --stats     print statistics of the append to stderr as JSON\n");
+    fprintf(stderr, "  --progress  print the progress of the append to stderr\n");
+}
+
+/* Appends input to the sparse image in output without rewriting it */
+static void append_in_place(int output, unsigned int block_size, int input, off64_t input_len,
+                            bool progress)
+{
+    struct sparse_file *s;
+    int ret;
+
+    if (input_len % block_size) {
+        fprintf(stderr, "Input file is not a multiple of the output file's block size");
+        exit(-1);
+    }
+
+    s = sparse_file_new(block_size, input_len);
+    if (!s) {
+        fprintf(stderr, "Couldn't allocate sparse file\n");
+        exit(-1);
+    }
+
+    if (sparse_file_add_fd(s, input, 0, input_len, 0) < 0) {
+        fprintf(stderr, "Couldn't add input file\n");
+        exit(-1);
+    }
+
+    if (progress) {
+        sparse_file_progress(s, PROGRESS_INTERVAL_MS, sparse_progress_print, "append");
+    }
+
+    ret = sparse_file_append(s, output);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to append to sparse file (%s)\n", strerror(-ret));
+        exit(-1);
+    }
+
+    sparse_file_destroy(s);
 }
 
 int main(int argc, char *argv[])
@@ -52,6 +93,7 @@ int main(int argc, char *argv[])
     int output_block;
     char *output_path;
     struct sparse_file *sparse_output;
+    sparse_header_t sparse_header;
 
     int input;
     char *input_path;
@@ -62,6 +104,26 @@ int main(int argc, char *argv[])
 
     int ret;
 
+    bool show_stats = false;
+    bool progress = false;
+    static struct sparse_stats stats;
+
+    if (sparse_trace_open(getenv("TRACE_DIR"), "append2simg") < 0) {
+        fprintf(stderr, "Cannot write trace to %s\n", getenv("TRACE_DIR"));
+    }
+
+    for (; argc > 1; argv++, argc--) {
+        if (strcmp(argv[1], "--stats") == 0) {
+            show_stats = true;
+            sparse_stats_default(&stats);
+        } else if (strcmp(argv[1], "--progress") == 0) {
+            progress = true;
+            sparse_progress_default(PROGRESS_INTERVAL_MS, sparse_progress_print, "read");
+        } else {
+            break;
+        }
+    }
+
     if (argc == 3) {
         output_path = argv[1];
         input_path = argv[2];
@@ -70,24 +132,12 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    ret = asprintf(&tmp_path, "%s.append2simg", output_path);
-    if (ret < 0) {
-        fprintf(stderr, "Couldn't allocate filename\n");
-        exit(-1);
-    }
-
     output = open(output_path, O_RDWR | O_BINARY);
     if (output < 0) {
         fprintf(stderr, "Couldn't open output file (%s)\n", strerror(errno));
         exit(-1);
     }
 
-    sparse_output = sparse_file_import_auto(output, false, true);
-    if (!sparse_output) {
-        fprintf(stderr, "Couldn't import output file\n");
-        exit(-1);
-    }
-
     input = open(input_path, O_RDONLY | O_BINARY);
     if (input < 0) {
         fprintf(stderr, "Couldn't open input file (%s)\n", strerror(errno));
@@ -98,11 +148,38 @@ int main(int argc, char *argv[])
     if (input_len < 0) {
         fprintf(stderr, "Couldn't get input file length (%s)\n", strerror(errno));
         exit(-1);
-    } else if (input_len % sparse_output->block_size) {
+    }
+    lseek64(input, 0, SEEK_SET);
+
+    /* Sparse images are appended to in place, anything else is rewritten */
+    if (read(output, &sparse_header, sizeof(sparse_header)) == sizeof(sparse_header) &&
+        sparse_header.magic == SPARSE_HEADER_MAGIC) {
+        append_in_place(output, sparse_header.blk_sz, input, input_len, progress);
+        close(output);
+        close(input);
+        if (show_stats) {
+            sparse_stats_print(stderr, &stats);
+        }
+        exit(0);
+    }
+    lseek64(output, 0, SEEK_SET);
+
+    ret = asprintf(&tmp_path, "%s.append2simg", output_path);
+    if (ret < 0) {
+        fprintf(stderr, "Couldn't allocate filename\n");
+        exit(-1);
+    }
+
+    sparse_output = sparse_file_import_auto(output, false, true);
+    if (!sparse_output) {
+        fprintf(stderr, "Couldn't import output file\n");
+        exit(-1);
+    }
+
+    if (input_len % sparse_output->block_size) {
         fprintf(stderr, "Input file is not a multiple of the output file's block size");
         exit(-1);
     }
-    lseek64(input, 0, SEEK_SET);
 
     output_block = sparse_output->len / sparse_output->block_size;
     if (sparse_file_add_fd(sparse_output, input, 0, input_len, output_block) < 0) {
@@ -117,6 +194,10 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    if (progress) {
+        sparse_file_progress(sparse_output, PROGRESS_INTERVAL_MS, sparse_progress_print, "write");
+    }
+
     lseek64(output, 0, SEEK_SET);
     if (sparse_file_write(sparse_output, tmp_fd, false, true, false) < 0) {
         fprintf(stderr, "Failed to write sparse file\n");
@@ -136,5 +217,9 @@ int main(int argc, char *argv[])
 
     free(tmp_path);
 
+    if (show_stats) {
+        sparse_stats_print(stderr, &stats);
+    }
+
     exit(0);
 }
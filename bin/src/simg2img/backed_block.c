@@ -16,6 +16,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,9 +31,10 @@ struct backed_block {
     union {
         struct {
             void *data;
+            struct backed_block_sg *sg;
         } data;
         struct {
-            char *filename;
+            const char *filename;
             int64_t offset;
         } file;
         struct {
@@ -46,15 +48,369 @@ struct backed_block {
     struct backed_block *next;
 };
 
+/*
+ * Adjacent data blocks are merged into a single block whose buffers are kept
+ * as a scatter-gather list, so that they can be written out as one chunk.
+ * A data block with a single buffer has no list and only uses data.data.
+ */
+struct backed_block_sg {
+    unsigned int count;
+    unsigned int size;
+    struct iovec iov[];
+};
+
+/*
+ * The blocks of a list are chained through their next pointers in block
+ * order, which is what the iterators walk.  On top of that the list keeps a
+ * sorted vector of the same blocks so that a position can be looked up by
+ * binary search.  The vector is a gap buffer: entries [0, gap_start) and
+ * [gap_end, index_size) are in use, and the gap between them follows the
+ * last insertion, so the common case of queueing blocks in order or right
+ * after the previous one costs no memmove at all.
+ */
 struct backed_block_list {
-    struct backed_block *data_blocks;
-    struct backed_block *last_used;
+    struct backed_block **index;
+    unsigned int index_size;
+    unsigned int gap_start;
+    unsigned int gap_end;
     unsigned int block_size;
+    struct backed_block_arena *arena;
+};
+
+#define INDEX_MIN_SIZE 64
+
+/*
+ * Blocks are carved out of slabs owned by an arena instead of being
+ * allocated one by one.  Blocks released by merges go onto a free list and
+ * are reused, and destroying the last list using an arena releases all of
+ * its slabs at once.  Lists that exchange blocks through
+ * backed_block_list_move share their arena, which is reference counted.
+ *
+ * The arena also interns the filenames of file blocks, so that blocks from
+ * the same file share one copy of the name and can be compared by pointer.
+ */
+#define SLAB_BLOCKS 1024
+
+struct backed_block_slab {
+    struct backed_block_slab *next;
+    unsigned int used;
+    struct backed_block blocks[SLAB_BLOCKS];
+};
+
+#define NAMES_MIN_SIZE 16
+
+struct backed_block_arena {
+    struct backed_block_slab *slabs;
+    struct backed_block *free_blocks;
+    char **names;
+    unsigned int names_size;
+    unsigned int names_count;
+    unsigned int refs;
 };
 
+static struct backed_block_arena *arena_get(struct backed_block_list *bbl)
+{
+    if (bbl->arena == NULL) {
+        bbl->arena = calloc(1, sizeof(struct backed_block_arena));
+        if (bbl->arena) {
+            bbl->arena->refs = 1;
+        }
+    }
+
+    return bbl->arena;
+}
+
+static struct backed_block *arena_alloc(struct backed_block_list *bbl)
+{
+    struct backed_block_arena *arena = arena_get(bbl);
+    struct backed_block_slab *slab;
+    struct backed_block *bb;
+
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    if (arena->free_blocks) {
+        bb = arena->free_blocks;
+        arena->free_blocks = bb->next;
+    } else {
+        slab = arena->slabs;
+        if (slab == NULL || slab->used == SLAB_BLOCKS) {
+            slab = malloc(sizeof(struct backed_block_slab));
+            if (slab == NULL) {
+                return NULL;
+            }
+            slab->next = arena->slabs;
+            slab->used = 0;
+            arena->slabs = slab;
+        }
+        bb = &slab->blocks[slab->used++];
+    }
+
+    memset(bb, 0, sizeof(*bb));
+    return bb;
+}
+
+static void arena_free(struct backed_block_list *bbl, struct backed_block *bb)
+{
+    bb->next = bbl->arena->free_blocks;
+    bbl->arena->free_blocks = bb;
+}
+
+static unsigned int name_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+
+    return hash;
+}
+
+/* Returns the slot of name in the open addressed names table */
+static char **names_slot(char **names, unsigned int size, const char *name)
+{
+    unsigned int i = name_hash(name) & (size - 1);
+
+    while (names[i] && strcmp(names[i], name)) {
+        i = (i + 1) & (size - 1);
+    }
+
+    return &names[i];
+}
+
+/* Returns the arena's copy of filename, adding it if needed */
+static const char *arena_intern(struct backed_block_list *bbl, const char *filename)
+{
+    struct backed_block_arena *arena = arena_get(bbl);
+    char **names;
+    char **slot;
+    unsigned int size;
+    unsigned int i;
+
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    /* Keep the table at most half full */
+    if (2 * (arena->names_count + 1) > arena->names_size) {
+        size = arena->names_size ? 2 * arena->names_size : NAMES_MIN_SIZE;
+        names = calloc(size, sizeof(*names));
+        if (names == NULL) {
+            return NULL;
+        }
+        for (i = 0; i < arena->names_size; i++) {
+            if (arena->names[i]) {
+                *names_slot(names, size, arena->names[i]) = arena->names[i];
+            }
+        }
+        free(arena->names);
+        arena->names = names;
+        arena->names_size = size;
+    }
+
+    slot = names_slot(arena->names, arena->names_size, filename);
+    if (*slot == NULL) {
+        *slot = strdup(filename);
+        if (*slot == NULL) {
+            return NULL;
+        }
+        arena->names_count++;
+    }
+
+    return *slot;
+}
+
+static void arena_put(struct backed_block_arena *arena)
+{
+    struct backed_block_slab *slab;
+    unsigned int i;
+
+    if (arena == NULL || --arena->refs > 0) {
+        return;
+    }
+
+    while (arena->slabs) {
+        slab = arena->slabs;
+        arena->slabs = slab->next;
+        free(slab);
+    }
+
+    for (i = 0; i < arena->names_size; i++) {
+        free(arena->names[i]);
+    }
+    free(arena->names);
+    free(arena);
+}
+
+static unsigned int index_count(struct backed_block_list *bbl)
+{
+    return bbl->index_size - (bbl->gap_end - bbl->gap_start);
+}
+
+static struct backed_block *index_get(struct backed_block_list *bbl, unsigned int i)
+{
+    if (i >= bbl->gap_start) {
+        i += bbl->gap_end - bbl->gap_start;
+    }
+    return bbl->index[i];
+}
+
+/* Moves the gap so that it starts at logical position pos */
+static void index_move_gap(struct backed_block_list *bbl, unsigned int pos)
+{
+    unsigned int n;
+
+    if (pos < bbl->gap_start) {
+        n = bbl->gap_start - pos;
+        memmove(bbl->index + bbl->gap_end - n, bbl->index + pos, n * sizeof(*bbl->index));
+        bbl->gap_start -= n;
+        bbl->gap_end -= n;
+    } else if (pos > bbl->gap_start) {
+        n = pos - bbl->gap_start;
+        memmove(bbl->index + bbl->gap_start, bbl->index + bbl->gap_end, n * sizeof(*bbl->index));
+        bbl->gap_start += n;
+        bbl->gap_end += n;
+    }
+}
+
+/* Makes sure the gap can take at least count more entries */
+static int index_reserve(struct backed_block_list *bbl, unsigned int count)
+{
+    struct backed_block **index;
+    unsigned int size;
+    unsigned int tail;
+
+    if (bbl->gap_end - bbl->gap_start >= count) {
+        return 0;
+    }
+
+    size = bbl->index_size ? bbl->index_size : INDEX_MIN_SIZE;
+    while (size - index_count(bbl) < count) {
+        if (size > UINT_MAX / 2) {
+            return -ENOMEM;
+        }
+        size *= 2;
+    }
+
+    index = realloc(bbl->index, size * sizeof(*bbl->index));
+    if (index == NULL) {
+        return -ENOMEM;
+    }
+
+    tail = bbl->index_size - bbl->gap_end;
+    memmove(index + size - tail, index + bbl->gap_end, tail * sizeof(*index));
+    bbl->index = index;
+    bbl->gap_end = size - tail;
+    bbl->index_size = size;
+
+    return 0;
+}
+
+/* Returns the position of the first block that does not start before block */
+static unsigned int index_lower_bound(struct backed_block_list *bbl, unsigned int block)
+{
+    unsigned int lo = 0;
+    unsigned int hi = index_count(bbl);
+    unsigned int mid;
+
+    /* Try the gap first, that is where the last insertion happened */
+    if ((lo == bbl->gap_start || bbl->index[bbl->gap_start - 1]->block < block) &&
+        (bbl->gap_end == bbl->index_size || bbl->index[bbl->gap_end]->block >= block)) {
+        return bbl->gap_start;
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index_get(bbl, mid)->block < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static unsigned int index_find(struct backed_block_list *bbl, struct backed_block *bb)
+{
+    unsigned int i = index_lower_bound(bbl, bb->block);
+
+    while (index_get(bbl, i) != bb) {
+        i++;
+    }
+
+    return i;
+}
+
+/*
+ * Inserts the count blocks chained from first at position pos, relinking the
+ * neighbours.  The chain must fit between the blocks around pos.
+ */
+static int index_insert(struct backed_block_list *bbl, unsigned int pos,
+                        struct backed_block *first, unsigned int count)
+{
+    struct backed_block *bb;
+    struct backed_block *last = NULL;
+    int ret;
+
+    ret = index_reserve(bbl, count);
+    if (ret < 0) {
+        return ret;
+    }
+
+    index_move_gap(bbl, pos);
+    for (bb = first; count--; bb = bb->next) {
+        bbl->index[bbl->gap_start++] = bb;
+        last = bb;
+    }
+
+    last->next = bbl->gap_end < bbl->index_size ? bbl->index[bbl->gap_end] : NULL;
+    if (pos > 0) {
+        index_get(bbl, pos - 1)->next = first;
+    }
+
+    return 0;
+}
+
+/* Removes count blocks starting at position pos and unlinks them */
+static void index_remove(struct backed_block_list *bbl, unsigned int pos, unsigned int count)
+{
+    struct backed_block *next;
+
+    next = index_get(bbl, pos + count - 1)->next;
+    if (pos > 0) {
+        index_get(bbl, pos - 1)->next = next;
+    }
+
+    index_move_gap(bbl, pos);
+    bbl->gap_end += count;
+}
+
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl)
 {
-    return bbl->data_blocks;
+    if (index_count(bbl) == 0) {
+        return NULL;
+    }
+
+    return index_get(bbl, 0);
+}
+
+/* Returns the first block of the list that ends past block, or NULL */
+struct backed_block *backed_block_find(struct backed_block_list *bbl, unsigned int block)
+{
+    unsigned int pos = index_lower_bound(bbl, block);
+    struct backed_block *bb;
+
+    if (pos > 0) {
+        bb = index_get(bbl, pos - 1);
+        if (bb->block + DIV_ROUND_UP(bb->len, bbl->block_size) > block) {
+            return bb;
+        }
+    }
+
+    return pos < index_count(bbl) ? index_get(bbl, pos) : NULL;
 }
 
 struct backed_block *backed_block_iter_next(struct backed_block *bb)
@@ -78,6 +434,22 @@ void *backed_block_data(struct backed_block *bb)
     return bb->data.data;
 }
 
+/*
+ * Returns the number of buffers of a merged data block and points iov at
+ * them, or returns 0 if the block is a single buffer from backed_block_data.
+ */
+unsigned int backed_block_data_iov(struct backed_block *bb, const struct iovec **iov)
+{
+    assert(bb->type == BACKED_BLOCK_DATA);
+    if (bb->data.sg == NULL) {
+        *iov = NULL;
+        return 0;
+    }
+
+    *iov = bb->data.sg->iov;
+    return bb->data.sg->count;
+}
+
 const char *backed_block_filename(struct backed_block *bb)
 {
     assert(bb->type == BACKED_BLOCK_FILE);
@@ -111,13 +483,17 @@ enum backed_block_type backed_block_type(struct backed_block *bb)
     return bb->type;
 }
 
-void backed_block_destroy(struct backed_block *bb)
+static void backed_block_release(struct backed_block *bb)
 {
-    if (bb->type == BACKED_BLOCK_FILE) {
-        free(bb->file.filename);
+    if (bb->type == BACKED_BLOCK_DATA) {
+        free(bb->data.sg);
     }
+}
 
-    free(bb);
+static void backed_block_destroy(struct backed_block_list *bbl, struct backed_block *bb)
+{
+    backed_block_release(bb);
+    arena_free(bbl, bb);
 }
 
 struct backed_block_list *backed_block_list_new(unsigned int block_size)
@@ -129,61 +505,164 @@ struct backed_block_list *backed_block_list_new(unsigned int block_size)
 
 void backed_block_list_destroy(struct backed_block_list *bbl)
 {
-    if (bbl->data_blocks) {
-        struct backed_block *bb = bbl->data_blocks;
-        while (bb) {
-            struct backed_block *next = bb->next;
-            backed_block_destroy(bb);
-            bb = next;
+    struct backed_block *bb;
+    unsigned int i;
+
+    for (i = 0; i < index_count(bbl); i++) {
+        bb = index_get(bbl, i);
+        if (bb->type == BACKED_BLOCK_DATA) {
+            backed_block_release(bb);
         }
     }
 
+    /* Blocks still go back to an arena that other lists are using */
+    if (bbl->arena && bbl->arena->refs > 1) {
+        for (i = 0; i < index_count(bbl); i++) {
+            arena_free(bbl, index_get(bbl, i));
+        }
+    }
+
+    arena_put(bbl->arena);
+    free(bbl->index);
     free(bbl);
 }
 
+/*
+ * Copies count blocks chained from start into the arena of to.  Returns the
+ * first copy, or NULL on allocation failure.
+ */
+static struct backed_block *backed_block_list_copy(struct backed_block_list *to,
+                                                   struct backed_block *start,
+                                                   unsigned int count)
+{
+    struct backed_block *first = NULL;
+    struct backed_block *last = NULL;
+    struct backed_block *bb;
+    struct backed_block *copy;
+
+    for (bb = start; count--; bb = bb->next) {
+        copy = arena_alloc(to);
+        if (copy) {
+            *copy = *bb;
+            copy->next = NULL;
+            /* Filenames belong to the arena of from */
+            if (bb->type == BACKED_BLOCK_FILE) {
+                copy->file.filename = arena_intern(to, bb->file.filename);
+                if (copy->file.filename == NULL) {
+                    arena_free(to, copy);
+                    copy = NULL;
+                }
+            }
+        }
+        if (copy == NULL) {
+            while (first) {
+                copy = first->next;
+                arena_free(to, first);
+                first = copy;
+            }
+            return NULL;
+        }
+        if (last) {
+            last->next = copy;
+        } else {
+            first = copy;
+        }
+        last = copy;
+    }
+
+    return first;
+}
+
 void backed_block_list_move(struct backed_block_list *from,
                             struct backed_block_list *to, struct backed_block *start,
                             struct backed_block *end)
 {
-    struct backed_block *bb;
+    unsigned int first;
+    unsigned int last;
+    unsigned int count;
 
-    if (start == NULL) {
-        start = from->data_blocks;
+    if (index_count(from) == 0) {
+        return;
     }
 
-    if (!end) {
-        for (end = start; end && end->next; end = end->next) ;
-    }
+    first = start ? index_find(from, start) : 0;
+    last = end ? index_find(from, end) : index_count(from) - 1;
+    start = index_get(from, first);
+    count = last - first + 1;
 
-    if (start == NULL || end == NULL) {
+    /* Make room in the destination first so that a failure leaves from intact */
+    if (index_reserve(to, count) < 0) {
         return;
     }
 
-    from->last_used = NULL;
-    to->last_used = NULL;
-    if (from->data_blocks == start) {
-        from->data_blocks = end->next;
+    /*
+     * An empty destination simply starts sharing the arena of the source,
+     * which is what sparse_file_resparse relies on.  Otherwise the blocks
+     * are copied over so that each list only references its own arena.
+     */
+    if (to->arena != from->arena && index_count(to) == 0) {
+        arena_put(to->arena);
+        to->arena = from->arena;
+        to->arena->refs++;
+    }
+
+    if (to->arena != from->arena) {
+        struct backed_block *copy = backed_block_list_copy(to, start, count);
+        struct backed_block *next;
+        unsigned int i;
+
+        if (copy == NULL) {
+            return;
+        }
+        index_remove(from, first, count);
+        for (i = 0; i < count; i++) {
+            next = start->next;
+            arena_free(from, start);
+            start = next;
+        }
+        start = copy;
     } else {
-        for (bb = from->data_blocks; bb; bb = bb->next) {
-            if (bb->next == start) {
-                bb->next = end->next;
-                break;
-            }
+        index_remove(from, first, count);
+    }
+
+    index_insert(to, index_lower_bound(to, start->block), start, count);
+}
+
+/* Appends the buffers of b to the scatter-gather list of a */
+static int merge_data(struct backed_block *a, struct backed_block *b)
+{
+    struct backed_block_sg *sg = a->data.sg;
+    unsigned int count = a->data.sg ? a->data.sg->count : 1;
+    unsigned int b_count = b->data.sg ? b->data.sg->count : 1;
+    unsigned int size = sg ? sg->size : 0;
+
+    if (count + b_count > size) {
+        size = size ? size * 2 : 8;
+        while (size < count + b_count) {
+            size *= 2;
+        }
+        sg = realloc(sg, sizeof(*sg) + size * sizeof(struct iovec));
+        if (sg == NULL) {
+            return -ENOMEM;
+        }
+        if (a->data.sg == NULL) {
+            sg->count = 1;
+            sg->iov[0].iov_base = a->data.data;
+            sg->iov[0].iov_len = a->len;
         }
+        sg->size = size;
+        a->data.sg = sg;
     }
 
-    if (!to->data_blocks) {
-        to->data_blocks = start;
-        end->next = NULL;
+    if (b->data.sg) {
+        memcpy(&sg->iov[sg->count], b->data.sg->iov, b_count * sizeof(struct iovec));
     } else {
-        for (bb = to->data_blocks; bb; bb = bb->next) {
-            if (!bb->next || bb->next->block > start->block) {
-                end->next = bb->next;
-                bb->next = start;
-                break;
-            }
-        }
+        sg->iov[sg->count].iov_base = b->data.data;
+        sg->iov[sg->count].iov_len = b->len;
     }
+    sg->count += b_count;
+
+    return 0;
 }
 
 /* may free b */
@@ -211,8 +690,11 @@ static int merge_bb(struct backed_block_list *bbl, struct backed_block *a, struc
 
     switch (a->type) {
     case BACKED_BLOCK_DATA:
-        /* Don't support merging data for now */
-        return -EINVAL;
+        /* A partial last block of a would be padded, so b can't follow it */
+        if (a->len % bbl->block_size || merge_data(a, b) < 0) {
+            return -EINVAL;
+        }
+        break;
     case BACKED_BLOCK_FILL:
         if (a->fill.val != b->fill.val) {
             return -EINVAL;
@@ -220,7 +702,7 @@ static int merge_bb(struct backed_block_list *bbl, struct backed_block *a, struc
         break;
     case BACKED_BLOCK_FILE:
         /* Already make sure b->type is BACKED_BLOCK_FILE */
-        if (strcmp(a->file.filename, b->file.filename) || a->file.offset + a->len != b->file.offset) {
+        if (a->file.filename != b->file.filename || a->file.offset + a->len != b->file.offset) {
             return -EINVAL;
         }
         break;
@@ -234,51 +716,29 @@ static int merge_bb(struct backed_block_list *bbl, struct backed_block *a, struc
     /* Blocks are compatible and adjacent, with a before b.  Merge b into a,
      * and free b */
     a->len += b->len;
-    a->next = b->next;
+    index_remove(bbl, index_find(bbl, b), 1);
 
-    backed_block_destroy(b);
+    backed_block_destroy(bbl, b);
 
     return 0;
 }
 
 static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 {
-    struct backed_block *bb;
-
-    if (bbl->data_blocks == NULL) {
-        bbl->data_blocks = new_bb;
-        return 0;
-    }
-
-    if (bbl->data_blocks->block > new_bb->block) {
-        new_bb->next = bbl->data_blocks;
-        bbl->data_blocks = new_bb;
-        return 0;
-    }
-
-    /* Optimization: blocks are mostly queued in sequence, so save the
-       pointer to the last bb that was added, and start searching from
-       there if the next block number is higher */
-    if (bbl->last_used && new_bb->block > bbl->last_used->block)
-        bb = bbl->last_used;
-    else
-        bb = bbl->data_blocks;
-    bbl->last_used = new_bb;
-
-    for (; bb->next && bb->next->block < new_bb->block; bb = bb->next) ;
-
-    if (bb->next == NULL) {
-        bb->next = new_bb;
-    } else {
-        new_bb->next = bb->next;
-        bb->next = new_bb;
+    struct backed_block *prev;
+    unsigned int pos;
+    int ret;
+
+    pos = index_lower_bound(bbl, new_bb->block);
+    ret = index_insert(bbl, pos, new_bb, 1);
+    if (ret < 0) {
+        backed_block_destroy(bbl, new_bb);
+        return ret;
     }
 
+    prev = pos > 0 ? index_get(bbl, pos - 1) : NULL;
     merge_bb(bbl, new_bb, new_bb->next);
-    if (!merge_bb(bbl, bb, new_bb)) {
-        /* new_bb destroyed, point to retained as last_used */
-        bbl->last_used = bb;
-    }
+    merge_bb(bbl, prev, new_bb);
 
     return 0;
 }
@@ -287,7 +747,7 @@ static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
                           unsigned int len, unsigned int block)
 {
-    struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+    struct backed_block *bb = arena_alloc(bbl);
     if (bb == NULL) {
         return -ENOMEM;
     }
@@ -305,7 +765,7 @@ int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 int backed_block_add_data(struct backed_block_list *bbl, void *data,
                           unsigned int len, unsigned int block)
 {
-    struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+    struct backed_block *bb = arena_alloc(bbl);
     if (bb == NULL) {
         return -ENOMEM;
     }
@@ -323,7 +783,7 @@ int backed_block_add_data(struct backed_block_list *bbl, void *data,
 int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
                           int64_t offset, unsigned int len, unsigned int block)
 {
-    struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+    struct backed_block *bb = arena_alloc(bbl);
     if (bb == NULL) {
         return -ENOMEM;
     }
@@ -331,7 +791,11 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
     bb->block = block;
     bb->len = len;
     bb->type = BACKED_BLOCK_FILE;
-    bb->file.filename = strdup(filename);
+    bb->file.filename = arena_intern(bbl, filename);
+    if (bb->file.filename == NULL) {
+        arena_free(bbl, bb);
+        return -ENOMEM;
+    }
     bb->file.offset = offset;
     bb->next = NULL;
 
@@ -342,7 +806,7 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
                         unsigned int len, unsigned int block)
 {
-    struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+    struct backed_block *bb = arena_alloc(bbl);
     if (bb == NULL) {
         return -ENOMEM;
     }
@@ -357,6 +821,55 @@ int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
     return queue_bb(bbl, bb);
 }
 
+/*
+ * Moves the buffers of a merged data block past its first len bytes to
+ * new_bb, cutting the buffer that straddles len in two.
+ */
+static int split_data(struct backed_block *bb, struct backed_block *new_bb, unsigned int len)
+{
+    struct backed_block_sg *sg = bb->data.sg;
+    struct backed_block_sg *new_sg;
+    unsigned int i;
+    unsigned int off = 0;
+    unsigned int cut;
+    unsigned int count;
+
+    for (i = 0; off + sg->iov[i].iov_len <= len; i++) {
+        off += sg->iov[i].iov_len;
+    }
+    cut = len - off;
+
+    /* Buffers [i, count) go to new_bb, with buffer i starting at cut */
+    count = sg->count - i;
+    new_sg = malloc(sizeof(*new_sg) + count * sizeof(struct iovec));
+    if (new_sg == NULL) {
+        return -ENOMEM;
+    }
+    new_sg->count = count;
+    new_sg->size = count;
+    memcpy(new_sg->iov, &sg->iov[i], count * sizeof(struct iovec));
+    new_sg->iov[0].iov_base = (char *)new_sg->iov[0].iov_base + cut;
+    new_sg->iov[0].iov_len -= cut;
+
+    sg->iov[i].iov_len = cut;
+    sg->count = cut ? i + 1 : i;
+
+    new_bb->data.data = new_sg->iov[0].iov_base;
+    new_bb->data.sg = new_sg;
+    if (new_sg->count == 1) {
+        new_bb->data.sg = NULL;
+        free(new_sg);
+    }
+
+    bb->data.data = sg->iov[0].iov_base;
+    if (sg->count == 1) {
+        bb->data.sg = NULL;
+        free(sg);
+    }
+
+    return 0;
+}
+
 int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb, unsigned int max_len)
 {
     struct backed_block *new_bb;
@@ -367,7 +880,12 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb, u
         return 0;
     }
 
-    new_bb = malloc(sizeof(struct backed_block));
+    /* Reserve the index slot first so that only split_data can fail below */
+    if (index_reserve(bbl, 1) < 0) {
+        return -ENOMEM;
+    }
+
+    new_bb = arena_alloc(bbl);
     if (new_bb == NULL) {
         return -ENOMEM;
     }
@@ -376,13 +894,17 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb, u
 
     new_bb->len = bb->len - max_len;
     new_bb->block = bb->block + max_len / bbl->block_size;
-    new_bb->next = bb->next;
-    bb->next = new_bb;
-    bb->len = max_len;
 
     switch (bb->type) {
     case BACKED_BLOCK_DATA:
-        new_bb->data.data = (char *)bb->data.data + max_len;
+        if (bb->data.sg) {
+            if (split_data(bb, new_bb, max_len) < 0) {
+                arena_free(bbl, new_bb);
+                return -ENOMEM;
+            }
+        } else {
+            new_bb->data.data = (char *)bb->data.data + max_len;
+        }
         break;
     case BACKED_BLOCK_FILE:
         new_bb->file.offset += max_len;
@@ -394,5 +916,55 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb, u
         break;
     }
 
+    index_insert(bbl, index_find(bbl, bb) + 1, new_bb, 1);
+    bb->len = max_len;
+
+    return 0;
+}
+
+/*
+ * Drops what the list holds for blocks [block, block + count), splitting
+ * the blocks that straddle either end of the range.
+ */
+int backed_block_clear(struct backed_block_list *bbl, unsigned int block, unsigned int count)
+{
+    struct backed_block *bb;
+    unsigned int end = block + count;
+    unsigned int pos;
+    unsigned int bb_end;
+    int ret;
+
+    pos = index_lower_bound(bbl, block);
+
+    /* Keep the part of the previous block before the range */
+    if (pos > 0) {
+        bb = index_get(bbl, pos - 1);
+        if (bb->block + DIV_ROUND_UP(bb->len, bbl->block_size) > block) {
+            ret = backed_block_split(bbl, bb, (block - bb->block) * bbl->block_size);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    while (pos < index_count(bbl)) {
+        bb = index_get(bbl, pos);
+        if (bb->block >= end) {
+            break;
+        }
+
+        /* Keep the part of the last block after the range */
+        bb_end = bb->block + DIV_ROUND_UP(bb->len, bbl->block_size);
+        if (bb_end > end) {
+            ret = backed_block_split(bbl, bb, (end - bb->block) * bbl->block_size);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        index_remove(bbl, pos, 1);
+        backed_block_destroy(bbl, bb);
+    }
+
     return 0;
 }
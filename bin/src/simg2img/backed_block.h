@@ -19,6 +19,8 @@
 
 #include <stdint.h>
 
+#include "defs.h"
+
 struct backed_block_list;
 struct backed_block;
 
@@ -40,9 +42,11 @@ int backed_block_add_fd(struct backed_block_list *bbl, int fd,
 
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl);
 struct backed_block *backed_block_iter_next(struct backed_block *bb);
+struct backed_block *backed_block_find(struct backed_block_list *bbl, unsigned int block);
 unsigned int backed_block_len(struct backed_block *bb);
 unsigned int backed_block_block(struct backed_block *bb);
 void *backed_block_data(struct backed_block *bb);
+unsigned int backed_block_data_iov(struct backed_block *bb, const struct iovec **iov);
 const char *backed_block_filename(struct backed_block *bb);
 int backed_block_fd(struct backed_block *bb);
 int64_t backed_block_file_offset(struct backed_block *bb);
@@ -50,6 +54,7 @@ uint32_t backed_block_fill_val(struct backed_block *bb);
 enum backed_block_type backed_block_type(struct backed_block *bb);
 int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
                        unsigned int max_len);
+int backed_block_clear(struct backed_block_list *bbl, unsigned int block, unsigned int count);
 
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl);
 struct backed_block *backed_block_iter_next(struct backed_block *bb);
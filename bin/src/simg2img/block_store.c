@@ -0,0 +1,845 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef USE_MINGW
+#include <sys/file.h>
+#endif
+
+#include <sparse/sparse.h>
+
+#include "block_store.h"
+#include "output_file.h"
+#include "sparse_file.h"
+#include "sparse_format.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define lseek64 lseek
+#define ftruncate64 ftruncate
+#define pread64 pread
+#endif
+
+#ifdef USE_MINGW
+#define mkdir(path, mode) mkdir(path)
+#define fdatasync(fd) 0
+#endif
+
+#define BLOCK_STORE_MAJOR_VER 1
+#define BLOCK_STORE_MINOR_VER 0
+
+/* New blocks are collected and appended to the store this many at a time */
+#define STORE_BUF_SIZE (1024 * 1024)
+
+/* Longest run, so that its length in bytes fits a backed block */
+#define MAX_RUN_LEN (1U << 30)
+
+struct block_hash {
+    uint64_t lo;
+    uint64_t hi;
+};
+
+struct hash_entry {
+    struct block_hash hash;
+    uint64_t block;             /* block in the store plus 1, 0 if unused */
+};
+
+struct block_store {
+    int blocks_fd;
+    int index_fd;
+    unsigned int block_size;
+
+    /* Hashes of the blocks in the store, by block */
+    struct block_hash *hashes;
+    uint64_t nr_blocks;
+    uint64_t hashes_size;
+    uint64_t indexed;           /* blocks whose hashes are in the index file */
+
+    /* Blocks by hash, open addressing with linear probing */
+    struct hash_entry *table;
+    uint64_t table_size;
+
+    /* New blocks not yet appended to the blocks file */
+    char *buf;
+    unsigned int buf_len;
+    uint64_t written;           /* blocks in the blocks file */
+
+    /* A stored block read back to compare with a new one */
+    char *cmp;
+};
+
+/*
+ * xxHash64 of a block.  Two seeds give the 128 bits of a block hash, which
+ * is cheap to compute but not collision resistant, so blocks with the same
+ * hash are compared byte for byte before one is reused for the other.
+ */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t read64(const char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t xxh64(const char *p, size_t len, uint64_t seed)
+{
+    const char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (uint8_t) * p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static void block_hash(const char *data, unsigned int len, struct block_hash *hash)
+{
+    hash->lo = xxh64(data, len, 0);
+    hash->hi = xxh64(data, len, PRIME64_1);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *ptr = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, ptr, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int table_grow(struct block_store *bs);
+
+/* Returns 1 if block of the store holds data, 0 if not */
+static int store_equal(struct block_store *bs, uint64_t block, const char *data)
+{
+    const char *stored;
+    ssize_t ret;
+
+    if (block >= bs->written) {
+        stored = bs->buf + (block - bs->written) * bs->block_size;
+    } else {
+        ret = pread64(bs->blocks_fd, bs->cmp, bs->block_size, (int64_t) block * bs->block_size);
+        if (ret != (ssize_t) bs->block_size)
+            return ret < 0 ? -errno : -EIO;
+        stored = bs->cmp;
+    }
+
+    return !memcmp(stored, data, bs->block_size);
+}
+
+/* Returns the block in the store holding data, which has the given hash, or -ENOENT */
+static int64_t table_find(struct block_store *bs, const struct block_hash *hash, const char *data)
+{
+    uint64_t mask = bs->table_size - 1;
+    uint64_t i;
+    int ret;
+
+    if (!bs->table_size)
+        return -ENOENT;
+
+    for (i = hash->lo & mask; bs->table[i].block; i = (i + 1) & mask) {
+        if (bs->table[i].hash.lo != hash->lo || bs->table[i].hash.hi != hash->hi)
+            continue;
+
+        ret = store_equal(bs, bs->table[i].block - 1, data);
+        if (ret < 0)
+            return ret;
+        if (ret)
+            return bs->table[i].block - 1;
+    }
+
+    return -ENOENT;
+}
+
+static int table_insert(struct block_store *bs, const struct block_hash *hash, uint64_t block)
+{
+    uint64_t mask;
+    uint64_t i;
+
+    /* Kept at most half full */
+    if ((bs->nr_blocks + 1) * 2 > bs->table_size && table_grow(bs) < 0)
+        return -ENOMEM;
+
+    mask = bs->table_size - 1;
+    for (i = hash->lo & mask; bs->table[i].block; i = (i + 1) & mask) ;
+
+    bs->table[i].hash = *hash;
+    bs->table[i].block = block + 1;
+
+    return 0;
+}
+
+static int table_grow(struct block_store *bs)
+{
+    struct hash_entry *old = bs->table;
+    uint64_t old_size = bs->table_size;
+    uint64_t nr_blocks = bs->nr_blocks;
+    uint64_t i;
+
+    bs->table_size = old_size ? old_size * 2 : 4096;
+    bs->table = calloc(bs->table_size, sizeof(*bs->table));
+    if (!bs->table) {
+        bs->table = old;
+        bs->table_size = old_size;
+        return -ENOMEM;
+    }
+
+    /* Reinserting never grows the table again */
+    bs->nr_blocks = 0;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].block)
+            table_insert(bs, &old[i].hash, old[i].block - 1);
+    }
+    bs->nr_blocks = nr_blocks;
+
+    free(old);
+
+    return 0;
+}
+
+/* Records the hash of the next block of the store */
+static int store_hash(struct block_store *bs, const struct block_hash *hash)
+{
+    struct block_hash *tmp;
+    int ret;
+
+    if (bs->nr_blocks == bs->hashes_size) {
+        bs->hashes_size = bs->hashes_size ? bs->hashes_size * 2 : 4096;
+        tmp = realloc(bs->hashes, bs->hashes_size * sizeof(*bs->hashes));
+        if (!tmp)
+            return -ENOMEM;
+        bs->hashes = tmp;
+    }
+
+    ret = table_insert(bs, hash, bs->nr_blocks);
+    if (ret < 0)
+        return ret;
+
+    bs->hashes[bs->nr_blocks++] = *hash;
+
+    return 0;
+}
+
+static int store_flush(struct block_store *bs)
+{
+    int ret;
+
+    if (!bs->buf_len)
+        return 0;
+
+    ret = write_all(bs->blocks_fd, bs->buf, bs->buf_len);
+    if (ret < 0)
+        return ret;
+
+    bs->written += bs->buf_len / bs->block_size;
+    bs->buf_len = 0;
+
+    return 0;
+}
+
+/* Returns the block in the store holding data, adding it if needed */
+static int64_t store_block(struct block_store *bs, const char *data, bool *added)
+{
+    struct block_hash hash;
+    int64_t block;
+    int ret;
+
+    block_hash(data, bs->block_size, &hash);
+    block = table_find(bs, &hash, data);
+    if (block >= 0) {
+        *added = false;
+        return block;
+    }
+    if (block != -ENOENT)
+        return block;
+
+    if (bs->buf_len + bs->block_size > STORE_BUF_SIZE) {
+        ret = store_flush(bs);
+        if (ret < 0)
+            return ret;
+    }
+    memcpy(bs->buf + bs->buf_len, data, bs->block_size);
+    bs->buf_len += bs->block_size;
+
+    ret = store_hash(bs, &hash);
+    if (ret < 0)
+        return ret;
+
+    *added = true;
+    return bs->nr_blocks - 1;
+}
+
+/*
+ * Loads the index, and brings it in line with the blocks file after a store
+ * that wasn't closed: hashes of blocks that were never written are dropped,
+ * and blocks that are missing from the index are hashed again.
+ */
+static int store_load(struct block_store *bs)
+{
+    block_store_index_header_t header;
+    struct block_hash hash;
+    int64_t blocks_len;
+    int64_t index_len;
+    uint64_t nr_blocks;
+    uint64_t nr_hashes;
+    uint64_t i;
+    int ret;
+
+    index_len = lseek64(bs->index_fd, 0, SEEK_END);
+    blocks_len = lseek64(bs->blocks_fd, 0, SEEK_END);
+    if (index_len < 0 || blocks_len < 0)
+        return -errno;
+
+    if (index_len == 0) {
+        header.magic = BLOCK_STORE_INDEX_MAGIC;
+        header.major_version = BLOCK_STORE_MAJOR_VER;
+        header.minor_version = BLOCK_STORE_MINOR_VER;
+        header.blk_sz = bs->block_size ? bs->block_size : 4096;
+        header.reserved = 0;
+        ret = write_all(bs->index_fd, &header, sizeof(header));
+        if (ret < 0)
+            return ret;
+        index_len = sizeof(header);
+    } else {
+        if (lseek64(bs->index_fd, 0, SEEK_SET) < 0)
+            return -errno;
+        ret = read_all(bs->index_fd, &header, sizeof(header));
+        if (ret < 0)
+            return ret;
+        if (header.magic != BLOCK_STORE_INDEX_MAGIC ||
+            header.major_version != BLOCK_STORE_MAJOR_VER)
+            return -EINVAL;
+        if (bs->block_size && bs->block_size != header.blk_sz)
+            return -EINVAL;
+    }
+
+    if (header.blk_sz == 0 || header.blk_sz % 4 || header.blk_sz > STORE_BUF_SIZE)
+        return -EINVAL;
+    bs->block_size = header.blk_sz;
+
+    nr_blocks = blocks_len / bs->block_size;
+    nr_hashes = (index_len - sizeof(header)) / sizeof(struct block_hash);
+    if (nr_hashes > nr_blocks)
+        nr_hashes = nr_blocks;
+
+    bs->buf = malloc(STORE_BUF_SIZE);
+    bs->cmp = malloc(bs->block_size);
+    if (!bs->buf || !bs->cmp)
+        return -ENOMEM;
+
+    if (lseek64(bs->index_fd, sizeof(header), SEEK_SET) < 0)
+        return -errno;
+    for (i = 0; i < nr_hashes; i++) {
+        ret = read_all(bs->index_fd, &hash, sizeof(hash));
+        if (ret < 0)
+            return ret;
+        ret = store_hash(bs, &hash);
+        if (ret < 0)
+            return ret;
+    }
+
+    for (; i < nr_blocks; i++) {
+        ret = pread64(bs->blocks_fd, bs->buf, bs->block_size, (int64_t) i * bs->block_size);
+        if (ret != (int)bs->block_size)
+            return ret < 0 ? -errno : -EIO;
+        block_hash(bs->buf, bs->block_size, &hash);
+        ret = store_hash(bs, &hash);
+        if (ret < 0)
+            return ret;
+    }
+
+    bs->indexed = nr_hashes;
+    bs->written = nr_blocks;
+
+    /* Drop a partly written block, and index entries past the blocks */
+    if (ftruncate64(bs->blocks_fd, (int64_t) nr_blocks * bs->block_size) < 0 ||
+        ftruncate64(bs->index_fd, sizeof(header) + nr_hashes * sizeof(struct block_hash)) < 0)
+        return -errno;
+
+    if (lseek64(bs->blocks_fd, 0, SEEK_END) < 0 || lseek64(bs->index_fd, 0, SEEK_END) < 0)
+        return -errno;
+
+    return 0;
+}
+
+static void store_free(struct block_store *bs)
+{
+    if (bs->blocks_fd >= 0)
+        close(bs->blocks_fd);
+    if (bs->index_fd >= 0)
+        close(bs->index_fd);
+    free(bs->hashes);
+    free(bs->table);
+    free(bs->buf);
+    free(bs->cmp);
+    free(bs);
+}
+
+static int open_in(const char *dir, const char *name)
+{
+    char *path;
+    int fd;
+
+    if (asprintf(&path, "%s/%s", dir, name) < 0)
+        return -1;
+
+    fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0664);
+    free(path);
+
+    return fd;
+}
+
+struct block_store *block_store_open(const char *dir, unsigned int block_size)
+{
+    struct block_store *bs;
+    int ret;
+
+    if (mkdir(dir, 0775) < 0 && errno != EEXIST) {
+        error_errno("mkdir %s", dir);
+        return NULL;
+    }
+
+    bs = calloc(1, sizeof(struct block_store));
+    if (!bs)
+        return NULL;
+
+    bs->block_size = block_size;
+    bs->blocks_fd = bs->index_fd = -1;
+
+    bs->index_fd = open_in(dir, "index");
+    if (bs->index_fd < 0) {
+        error_errno("open %s/index", dir);
+        store_free(bs);
+        return NULL;
+    }
+
+#ifndef USE_MINGW
+    if (flock(bs->index_fd, LOCK_EX) < 0) {
+        error_errno("flock %s/index", dir);
+        store_free(bs);
+        return NULL;
+    }
+#endif
+
+    bs->blocks_fd = open_in(dir, "blocks");
+    if (bs->blocks_fd < 0) {
+        error_errno("open %s/blocks", dir);
+        store_free(bs);
+        return NULL;
+    }
+
+    ret = store_load(bs);
+    if (ret < 0) {
+        error("failed to load block store %s: %s", dir, strerror(-ret));
+        store_free(bs);
+        return NULL;
+    }
+
+    return bs;
+}
+
+unsigned int block_store_block_size(struct block_store *bs)
+{
+    return bs->block_size;
+}
+
+/* Makes new blocks durable, then appends their hashes to the index */
+static int store_sync(struct block_store *bs)
+{
+    int ret;
+
+    ret = store_flush(bs);
+    if (ret < 0)
+        return ret;
+
+    if (bs->indexed == bs->nr_blocks)
+        return 0;
+
+    if (fdatasync(bs->blocks_fd) < 0)
+        return -errno;
+
+    ret = write_all(bs->index_fd, bs->hashes + bs->indexed,
+                    (bs->nr_blocks - bs->indexed) * sizeof(struct block_hash));
+    if (ret < 0)
+        return ret;
+    bs->indexed = bs->nr_blocks;
+
+    if (fdatasync(bs->index_fd) < 0)
+        return -errno;
+
+    return 0;
+}
+
+int block_store_close(struct block_store *bs)
+{
+    int ret;
+
+    ret = store_sync(bs);
+    store_free(bs);
+
+    return ret;
+}
+
+struct store_add {
+    struct block_store *bs;
+    struct block_store_stats *stats;
+    char *block;                /* a partial block, collected across writes */
+    unsigned int block_len;
+    unsigned int chunk;         /* first block of the current chunk */
+    unsigned int next;          /* next block of the image */
+    bool started;
+
+    block_store_run_t *runs;
+    unsigned int nr_runs;
+    unsigned int runs_size;
+};
+
+/* Extends the last run with a block, or starts a new one */
+static int add_run(struct store_add *sa, uint16_t type, uint32_t fill_val, uint64_t store_block)
+{
+    block_store_run_t *run = sa->nr_runs ? &sa->runs[sa->nr_runs - 1] : NULL;
+    block_store_run_t *tmp;
+
+    if (run && run->run_type == type && run->block + run->run_sz == sa->next &&
+        (uint64_t) (run->run_sz + 1) * sa->bs->block_size <= MAX_RUN_LEN &&
+        (type == CHUNK_TYPE_FILL ? run->fill_val == fill_val :
+         run->store_block + run->run_sz == store_block)) {
+        run->run_sz++;
+        return 0;
+    }
+
+    if (sa->nr_runs == sa->runs_size) {
+        sa->runs_size = sa->runs_size ? sa->runs_size * 2 : 256;
+        tmp = realloc(sa->runs, sa->runs_size * sizeof(*sa->runs));
+        if (!tmp)
+            return -ENOMEM;
+        sa->runs = tmp;
+    }
+
+    run = &sa->runs[sa->nr_runs++];
+    run->run_type = type;
+    run->reserved1 = 0;
+    run->block = sa->next;
+    run->run_sz = 1;
+    run->fill_val = type == CHUNK_TYPE_FILL ? fill_val : 0;
+    run->store_block = type == CHUNK_TYPE_RAW ? store_block : 0;
+
+    return 0;
+}
+
+/* Blocks of a single repeated 32 bit value are kept as fill runs */
+static int add_block(struct store_add *sa, const char *data)
+{
+    unsigned int block_size = sa->bs->block_size;
+    uint32_t val = read32(data);
+    int64_t block;
+    bool added;
+    unsigned int i;
+    int ret;
+
+    for (i = 4; i < block_size; i += 4) {
+        if (read32(data + i) != val)
+            break;
+    }
+
+    if (i == block_size) {
+        ret = add_run(sa, CHUNK_TYPE_FILL, val, 0);
+        sa->stats->fill_blocks++;
+    } else {
+        block = store_block(sa->bs, data, &added);
+        if (block < 0)
+            return block;
+        ret = add_run(sa, CHUNK_TYPE_RAW, 0, block);
+        if (added)
+            sa->stats->new_blocks++;
+    }
+
+    sa->stats->blocks++;
+    sa->next++;
+
+    return ret;
+}
+
+/* Adds a partial last block of a chunk, padded with zeros */
+static int add_partial(struct store_add *sa)
+{
+    int ret;
+
+    if (!sa->block_len)
+        return 0;
+
+    memset(sa->block + sa->block_len, 0, sa->bs->block_size - sa->block_len);
+    ret = add_block(sa, sa->block);
+    sa->block_len = 0;
+
+    return ret;
+}
+
+static int add_chunk_data(void *priv, const void *data, int len, unsigned int block,
+                          unsigned int nr_blocks __unused)
+{
+    struct store_add *sa = priv;
+    unsigned int block_size = sa->bs->block_size;
+    const char *ptr = data;
+    unsigned int n;
+    int ret;
+
+    if (!sa->started || block != sa->chunk) {
+        ret = add_partial(sa);
+        if (ret < 0)
+            return ret;
+        sa->started = true;
+        sa->chunk = sa->next = block;
+    }
+
+    while (len > 0) {
+        if (sa->block_len || (unsigned int)len < block_size) {
+            n = block_size - sa->block_len;
+            if (n > (unsigned int)len)
+                n = len;
+            if (ptr)
+                memcpy(sa->block + sa->block_len, ptr, n);
+            else
+                memset(sa->block + sa->block_len, 0, n);
+            sa->block_len += n;
+            if (sa->block_len == block_size) {
+                sa->block_len = 0;
+                ret = add_block(sa, sa->block);
+                if (ret < 0)
+                    return ret;
+            }
+        } else if (!ptr) {
+            n = block_size;
+            memset(sa->block, 0, block_size);
+            ret = add_block(sa, sa->block);
+            if (ret < 0)
+                return ret;
+        } else {
+            n = block_size;
+            ret = add_block(sa, ptr);
+            if (ret < 0)
+                return ret;
+        }
+
+        if (ptr)
+            ptr += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int block_store_add(struct block_store *bs, struct sparse_file *s, int manifest_fd,
+                    struct block_store_stats *stats)
+{
+    block_store_manifest_header_t header;
+    struct block_store_stats dummy;
+    struct store_add sa;
+    int ret;
+
+    if (sparse_file_block_size(s) != bs->block_size)
+        return -EINVAL;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.bs = bs;
+    sa.stats = stats ? stats : &dummy;
+    memset(sa.stats, 0, sizeof(*sa.stats));
+    sa.block = malloc(bs->block_size);
+    if (!sa.block)
+        return -ENOMEM;
+
+    ret = sparse_file_foreach_chunk(s, false, false, add_chunk_data, &sa);
+    if (ret >= 0)
+        ret = add_partial(&sa);
+
+    /* The blocks are in the store before any manifest points at them */
+    if (ret >= 0)
+        ret = store_sync(bs);
+
+    if (ret >= 0) {
+        header.magic = BLOCK_STORE_MANIFEST_MAGIC;
+        header.major_version = BLOCK_STORE_MAJOR_VER;
+        header.minor_version = BLOCK_STORE_MINOR_VER;
+        header.blk_sz = bs->block_size;
+        header.total_runs = sa.nr_runs;
+        header.len = s->len;
+        ret = write_all(manifest_fd, &header, sizeof(header));
+    }
+    if (ret >= 0)
+        ret = write_all(manifest_fd, sa.runs, sa.nr_runs * sizeof(*sa.runs));
+
+    free(sa.runs);
+    free(sa.block);
+
+    return ret < 0 ? ret : 0;
+}
+
+struct sparse_file *block_store_get(struct block_store *bs, int manifest_fd)
+{
+    block_store_manifest_header_t header;
+    block_store_run_t run;
+    struct sparse_file *s;
+    int64_t start;
+    int64_t len;
+    unsigned int i;
+    int ret;
+
+    ret = read_all(manifest_fd, &header, sizeof(header));
+    if (ret < 0) {
+        error("failed to read manifest");
+        return NULL;
+    }
+
+    if (header.magic != BLOCK_STORE_MANIFEST_MAGIC ||
+        header.major_version != BLOCK_STORE_MAJOR_VER || header.blk_sz != bs->block_size) {
+        error("manifest doesn't match the block store");
+        return NULL;
+    }
+
+    s = sparse_file_new(bs->block_size, header.len);
+    if (!s)
+        return NULL;
+
+    for (i = 0; i < header.total_runs; i++) {
+        ret = read_all(manifest_fd, &run, sizeof(run));
+        if (ret < 0) {
+            error("failed to read manifest");
+            goto err;
+        }
+
+        /* A partial last block only counts up to the end of the image */
+        start = (int64_t) run.block * bs->block_size;
+        len = (int64_t) run.run_sz * bs->block_size;
+        if (run.run_sz == 0 || len > MAX_RUN_LEN || start >= (int64_t) header.len) {
+            error("bad run in manifest");
+            goto err;
+        }
+        if (start + len > (int64_t) header.len)
+            len = header.len - start;
+
+        if (run.run_type == CHUNK_TYPE_FILL) {
+            ret = sparse_file_add_fill(s, run.fill_val, len, run.block);
+        } else if (run.run_type == CHUNK_TYPE_RAW && run.store_block + run.run_sz <= bs->nr_blocks) {
+            ret = sparse_file_add_fd(s, bs->blocks_fd,
+                                     (int64_t) run.store_block * bs->block_size, len, run.block);
+        } else {
+            error("bad run in manifest");
+            goto err;
+        }
+        if (ret < 0)
+            goto err;
+    }
+
+    return s;
+
+ err:
+    sparse_file_destroy(s);
+    return NULL;
+}
@@ -0,0 +1,103 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_BLOCK_STORE_H_
+#define _LIBSPARSE_BLOCK_STORE_H_
+
+#include <stdint.h>
+
+#include <sparse/sparse.h>
+
+#include "sparse_defs.h"
+
+/*
+ * A block store keeps each distinct block of the images added to it once.
+ * A store is a directory holding two files:
+ *
+ *   blocks - the distinct blocks, one after another, numbered from 0
+ *   index  - a header followed by the 128 bit hash of each block in blocks
+ *
+ * An image added to the store is described by a manifest, which lists the
+ * runs of blocks of the image.  A run of data blocks points at a run of
+ * consecutive blocks in the store, a run of fill blocks keeps the fill
+ * value.  Blocks an image doesn't have are in no run.
+ */
+
+typedef struct block_store_index_header {
+    __le32 magic;               /* 0x58444953 */
+    __le16 major_version;       /* (0x1) */
+    __le16 minor_version;       /* (0x0) */
+    __le32 blk_sz;              /* block size of the store */
+    __le32 reserved;
+} block_store_index_header_t;
+
+#define BLOCK_STORE_INDEX_MAGIC 0x58444953
+
+typedef struct block_store_manifest_header {
+    __le32 magic;               /* 0x464e414d */
+    __le16 major_version;       /* (0x1) */
+    __le16 minor_version;       /* (0x0) */
+    __le32 blk_sz;              /* block size of the store */
+    __le32 total_runs;          /* runs following the header */
+    __le64 len;                 /* length of the image in bytes */
+} block_store_manifest_header_t;
+
+#define BLOCK_STORE_MANIFEST_MAGIC 0x464e414d
+
+typedef struct block_store_run {
+    __le16 run_type;            /* CHUNK_TYPE_RAW or CHUNK_TYPE_FILL */
+    __le16 reserved1;
+    __le32 block;               /* first block of the run in the image */
+    __le32 run_sz;              /* in blocks */
+    __le32 fill_val;            /* fill value of a fill run */
+    __le64 store_block;         /* first block of a raw run in the store */
+} block_store_run_t;
+
+struct block_store;
+
+struct block_store_stats {
+    uint64_t blocks;            /* blocks of the image */
+    uint64_t fill_blocks;       /* blocks kept as fill runs */
+    uint64_t new_blocks;        /* blocks added to the store */
+};
+
+/*
+ * Opens the store in directory dir, creating it with the given block size
+ * if it doesn't exist.  A block size of 0 uses 4096 for a new store.  The
+ * store is locked until it is closed.  Returns NULL on error.
+ */
+struct block_store *block_store_open(const char *dir, unsigned int block_size);
+
+/* Returns the block size of the store */
+unsigned int block_store_block_size(struct block_store *bs);
+
+/*
+ * Adds the blocks of s to the store, and writes the manifest of s to
+ * manifest_fd.  The block size of s must match the store.  Returns 0 on
+ * success, negative errno on error.
+ */
+int block_store_add(struct block_store *bs, struct sparse_file *s, int manifest_fd,
+                    struct block_store_stats *stats);
+
+/*
+ * Returns a sparse file holding the image described by the manifest in
+ * manifest_fd, backed by the blocks of the store, or NULL on error.  It
+ * must be destroyed before the store is closed.
+ */
+struct sparse_file *block_store_get(struct block_store *bs, int manifest_fd);
+
+/* Writes out what is pending, and closes the store.  Returns 0 on success. */
+int block_store_close(struct block_store *bs);
+
+#endif
@@ -15,9 +15,21 @@
  */
 
 #ifndef _LIBSPARSE_DEFS_H_
+#define _LIBSPARSE_DEFS_H_
+
+#include <stddef.h>
 
 #ifndef __unused
 #define __unused        __attribute__((__unused__))
 #endif
 
+#ifndef USE_MINGW
+#include <sys/uio.h>
+#else
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
 #endif                          /* _LIBSPARSE_DEFS_H_ */
@@ -18,6 +18,7 @@
 #define _LARGEFILE64_SOURCE 1
 
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +34,15 @@
 #define O_BINARY 0
 #endif
 
+#define PROGRESS_INTERVAL_MS 500
+
+/* Block sizes tried by --auto, each a multiple of the first */
+static const unsigned int auto_block_sizes[] = {
+    1024, 2048, 4096, 8192, 16384, 32768, 65536,
+};
+
+#define AUTO_BLOCK_SIZES (sizeof(auto_block_sizes) / sizeof(auto_block_sizes[0]))
+
 #if defined(__APPLE__) && defined(__MACH__)
 #define lseek64 lseek
 #define off64_t off_t
@@ -40,7 +50,49 @@
 
 void usage()
 {
-    fprintf(stderr, "Usage: img2simg <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "Usage: img2simg [--stats] [--progress] [--auto] <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "  --stats     print statistics of the conversion to stderr as JSON\n");
+    fprintf(stderr, "  --progress  print the progress of the read and the write to stderr\n");
+    fprintf(stderr, "  --auto      compare block sizes in a first read, and use the one giving\n"
+                    "              the smallest sparse image\n");
+}
+
+/*
+ * Reads the input once to estimate the sparse image of each block size in
+ * auto_block_sizes, and returns the block size of the smallest, with fewer
+ * chunks and then the larger block size breaking ties.  Returns 0 on error.
+ */
+static unsigned int choose_block_size(int in, off64_t len)
+{
+    struct sparse_estimate est[AUTO_BLOCK_SIZES];
+    unsigned int best = 0;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < AUTO_BLOCK_SIZES; i++) {
+        est[i].block_size = auto_block_sizes[i];
+    }
+
+    ret = sparse_estimate_block_sizes(in, len, est, AUTO_BLOCK_SIZES);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to read file: %s\n", strerror(-ret));
+        return 0;
+    }
+
+    for (i = 1; i < AUTO_BLOCK_SIZES; i++) {
+        if (est[i].len < est[best].len ||
+            (est[i].len == est[best].len && est[i].chunks <= est[best].chunks)) {
+            best = i;
+        }
+    }
+
+    fprintf(stderr, "block size  sparse size       chunks\n");
+    for (i = 0; i < AUTO_BLOCK_SIZES; i++) {
+        fprintf(stderr, "%10u %12" PRId64 " %12u%s\n", est[i].block_size, est[i].len,
+                est[i].chunks, i == best ? "  *" : "");
+    }
+
+    return est[best].block_size;
 }
 
 int main(int argc, char *argv[])
@@ -50,14 +102,40 @@ int main(int argc, char *argv[])
     int ret;
     struct sparse_file *s;
     unsigned int block_size = 4096;
+    bool show_stats = false;
+    bool progress = false;
+    bool choose = false;
+    static struct sparse_stats stats;
     off64_t len;
 
+    if (sparse_trace_open(getenv("TRACE_DIR"), "img2simg") < 0) {
+        fprintf(stderr, "Cannot write trace to %s\n", getenv("TRACE_DIR"));
+    }
+
+    for (; argc > 1; argv++, argc--) {
+        if (strcmp(argv[1], "--stats") == 0) {
+            show_stats = true;
+            sparse_stats_default(&stats);
+        } else if (strcmp(argv[1], "--auto") == 0) {
+            choose = true;
+        } else if (strcmp(argv[1], "--progress") == 0) {
+            progress = true;
+            sparse_progress_default(PROGRESS_INTERVAL_MS, sparse_progress_print, "read");
+        } else {
+            break;
+        }
+    }
+
     if (argc < 3 || argc > 4) {
         usage();
         exit(-1);
     }
 
     if (argc == 4) {
+        if (choose) {
+            usage();
+            exit(-1);
+        }
         block_size = atoi(argv[3]);
     }
 
@@ -89,6 +167,24 @@ int main(int argc, char *argv[])
     len = lseek64(in, 0, SEEK_END);
     lseek64(in, 0, SEEK_SET);
 
+    if (choose) {
+        if (len < 0) {
+            fprintf(stderr, "Cannot read the input twice for --auto\n");
+            exit(-1);
+        }
+        if (progress) {
+            sparse_progress_default(PROGRESS_INTERVAL_MS, sparse_progress_print, "estimate");
+        }
+        block_size = choose_block_size(in, len);
+        if (!block_size) {
+            exit(-1);
+        }
+        if (progress) {
+            sparse_progress_default(PROGRESS_INTERVAL_MS, sparse_progress_print, "read");
+        }
+        lseek64(in, 0, SEEK_SET);
+    }
+
     s = sparse_file_new(block_size, len);
     if (!s) {
         fprintf(stderr, "Failed to create sparse file\n");
@@ -102,6 +198,10 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    if (progress) {
+        sparse_file_progress(s, PROGRESS_INTERVAL_MS, sparse_progress_print, "write");
+    }
+
     ret = sparse_file_write(s, out, false, true, false);
     if (ret) {
         fprintf(stderr, "Failed to write sparse file\n");
@@ -111,5 +211,9 @@ int main(int argc, char *argv[])
     close(in);
     close(out);
 
+    if (show_stats) {
+        sparse_stats_print(stderr, &stats);
+    }
+
     exit(0);
 }
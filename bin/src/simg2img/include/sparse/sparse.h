@@ -18,7 +18,9 @@
 #define _LIBSPARSE_SPARSE_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -67,6 +69,9 @@ void sparse_file_destroy(struct sparse_file *s);
  * The data pointer must remain valid until the sparse file is closed or the
  * data block is removed from the sparse file.
  *
+ * Data chunks that are adjacent in the sparse file are merged and written
+ * out as a single chunk, gathering the data from each of their buffers.
+ *
  * Returns 0 on success, negative errno on error.
  */
 int sparse_file_add_data(struct sparse_file *s,
@@ -156,11 +161,74 @@ int sparse_file_add_fd(struct sparse_file *s,
  * sparse files.  If crc is true, the crc of the expanded data will be
  * calculated and appended in a crc chunk.
  *
+ * If fd was opened with O_DIRECT, data is written through aligned buffers.
+ * Partial 4096 byte blocks at unaligned edges of the written data are read
+ * back from fd first, so fd must also be open for reading unless the block
+ * size is a multiple of 4096 and the write starts at an aligned offset.
+ *
  * Returns 0 on success, negative errno on error.
  */
 int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
 		bool crc);
 
+/**
+ * sparse_file_append - append a sparse file to a sparse image in place
+ *
+ * @s - sparse file cookie holding the blocks to append
+ * @fd - file descriptor of a sparse image, open for reading and writing
+ *
+ * Appends the chunks of s after the last chunk of the sparse image in fd,
+ * so that block 0 of s follows the last block of the image, and updates the
+ * total block and chunk counts in its header.  Only the chunk headers of the
+ * image are read, the rest of it is left in place.  If the image ends in a
+ * crc chunk, it is kept, and a crc chunk over the whole image is written
+ * after the new chunks.
+ * The block size of s must match the image, and its length must be a
+ * multiple of the block size.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_append(struct sparse_file *s, int fd);
+
+/**
+ * sparse_file_patch - overwrite blocks of a sparse image in place
+ *
+ * @fd - file descriptor of a sparse image, open for reading and writing
+ * @patch - sparse file cookie holding the blocks to write
+ *
+ * Writes the blocks of patch over the same blocks of the sparse image in
+ * fd, in the data of the raw chunks that hold them.  Only the chunk headers
+ * of the image and the patched blocks are touched.  A crc chunk at the end
+ * of the image is dropped, as it no longer matches.  The block size of patch
+ * must match the image, and each of its blocks must be a whole number of
+ * blocks inside the image.
+ *
+ * Returns 0 on success, -EAGAIN without writing anything if a patched block
+ * is not held in a raw chunk or a crc chunk comes before the last chunk, or
+ * negative errno on error.  sparse_file_patch_copy() handles both cases.
+ */
+int sparse_file_patch(int fd, struct sparse_file *patch);
+
+/**
+ * sparse_file_patch_copy - write a sparse image with some of its blocks replaced
+ *
+ * @in - file descriptor of a sparse image
+ * @out - file descriptor to write the patched image to, empty and seekable
+ * @patch - sparse file cookie holding the blocks to write
+ *
+ * Writes the chunks of the image in in to out, with the blocks of patch in
+ * place of the same blocks of the image.  Chunks without a patched block are
+ * copied as they are, in the kernel where it can be done.  Raw, fill and
+ * don't care chunks with patched blocks are split into a head, a raw chunk
+ * of the patched blocks and a tail.  Only the patched blocks are read from
+ * patch, and crc chunks are dropped.  The block size of patch must match
+ * the image, and each of its blocks must be a whole number of blocks inside
+ * the image.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_patch_copy(int in, int out, struct sparse_file *patch);
+
 /**
  * sparse_file_len - return the length of a sparse file if written to disk
  *
@@ -171,7 +239,8 @@ int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
  * Returns the size a sparse file would be on disk if it were written in the
  * specified format.  If sparse is true, this is the size of the data in the
  * sparse format.  If sparse is false, this is the size of the normal
- * non-sparse file.
+ * non-sparse file.  The size is worked out from the chunk layout alone, no
+ * data is read.
  */
 int64_t sparse_file_len(struct sparse_file *s, bool sparse, bool crc);
 
@@ -221,6 +290,24 @@ int sparse_file_foreach_chunk(struct sparse_file *s, bool sparse, bool crc,
 	int (*write)(void *priv, const void *data, int len, unsigned int block,
 		     unsigned int nr_blocks),
 	void *priv);
+
+/**
+ * sparse_file_pread - read the expanded contents of a sparse file
+ *
+ * @s - sparse file cookie
+ * @buf - buffer to read into
+ * @len - number of bytes to read
+ * @offset - offset into the expanded file
+ *
+ * Copies [offset, offset + len) of the file that sparse_file_write would
+ * write without sparse to buf, looking the blocks up instead of walking
+ * them all.  Regions not covered by any block read as zeros.
+ *
+ * Returns 0 on success, -EINVAL past the end of the file, or negative errno
+ * on error.
+ */
+int sparse_file_pread(struct sparse_file *s, void *buf, size_t len, int64_t offset);
+
 /**
  * sparse_file_read - read a file into a sparse file cookie
  *
@@ -271,6 +358,62 @@ struct sparse_file *sparse_file_import(int fd, bool verbose, bool crc);
  */
 struct sparse_file *sparse_file_import_auto(int fd, bool crc, bool verbose);
 
+/**
+ * sparse_file_convert - convert a sparse file in bounded memory
+ *
+ * @in - file descriptor of a file in the Android sparse file format
+ * @out - file descriptor to write to
+ * @sparse - write a sparse file instead of a raw file
+ * @crc - verify the crc of the input
+ * @verbose - print verbose errors while reading the sparse file
+ * @window - number of chunks read before they are written out
+ *
+ * Does what sparse_file_import followed by sparse_file_write would, without
+ * a crc in the output, but writes out and forgets the chunks read every
+ * window chunks.  The memory used depends on window and not on the number
+ * of chunks in the input.  A raw output is written from scratch, with the
+ * regions not covered by any chunk discarded as with sparse_file_discard.
+ * A sparse output gets its header written again at the end, and must be
+ * seekable when chunks were merged.  After an error the output is left
+ * incomplete, a bad crc is only found once everything else was written.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_convert(int in, int out, bool sparse, bool crc, bool verbose,
+		unsigned int window);
+
+/**
+ * struct sparse_estimate - the sparse image a block size would give
+ *
+ * @block_size - block size to estimate for, set by the caller
+ * @len - size of the sparse image in bytes
+ * @chunks - number of chunks in the sparse image
+ */
+struct sparse_estimate {
+	unsigned int block_size;
+	int64_t len;
+	unsigned int chunks;
+};
+
+/**
+ * sparse_estimate_block_sizes - compare block sizes for a normal file
+ *
+ * @fd - file descriptor to read from
+ * @len - length of the file
+ * @est - block sizes to estimate for, filled in with the estimates
+ * @count - size of est array
+ *
+ * Reads len bytes from fd once and works out the size and chunk count of
+ * the sparse image sparse_file_read and sparse_file_write would make of
+ * them, without checksums, for each block size in est.  Every block size
+ * must be a multiple of 4 and of the smallest of them.  The file offset
+ * of fd is left past the data read.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_estimate_block_sizes(int fd, int64_t len, struct sparse_estimate *est,
+		unsigned int count);
+
 /** sparse_file_resparse - rechunk an existing sparse file into smaller files
  *
  * @in_s - sparse file cookie of the existing sparse file
@@ -285,6 +428,37 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc, bool verbose);
 int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 		struct sparse_file **out_s, int out_s_count);
 
+/**
+ * sparse_file_resparse_all - split a sparse file into files of a max size
+ *
+ * @in_s - sparse file cookie of the input sparse file
+ * @max_len - max file size of the output sparse files
+ * @out_s - set to a newly allocated array of sparse file cookies
+ *
+ * Like sparse_file_resparse, but splits the whole input in a single pass.
+ * All of the blocks of in_s are moved into the output sparse files.  Each
+ * of them must be destroyed with sparse_file_destroy, and the array freed
+ * with free.  Returns the number of sparse files in out_s, or negative
+ * errno on error.
+ */
+int sparse_file_resparse_all(struct sparse_file *in_s, unsigned int max_len,
+		struct sparse_file ***out_s);
+
+/**
+ * sparse_file_overlay - lay the blocks of one sparse file over another
+ *
+ * @s - sparse file cookie
+ * @patch - sparse file cookie holding the blocks to lay over s
+ *
+ * Moves all of the blocks of patch into s.  Blocks of s under them are
+ * split around them or dropped, so the blocks of patch win.  The length of
+ * s grows to the length of patch if that is longer.  The block sizes must
+ * match.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_overlay(struct sparse_file *s, struct sparse_file *patch);
+
 /**
  * sparse_file_verbose - set a sparse file cookie to print verbose errors
  *
@@ -294,6 +468,186 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
  */
 void sparse_file_verbose(struct sparse_file *s);
 
+/**
+ * sparse_file_discard - discard don't care regions of a block device
+ *
+ * @s - sparse file cookie
+ *
+ * When sparse_file_write expands the sparse file onto a block device, the
+ * regions not covered by any chunk are discarded with BLKDISCARD instead
+ * of being left as they were.  Zero fills are always cleared with
+ * BLKZEROOUT where the device supports it, this only affects the regions
+ * whose contents don't matter.  Don't use it when several sparse files are
+ * written over each other.
+ */
+void sparse_file_discard(struct sparse_file *s);
+
+/* Chunk types counted in struct sparse_stats */
+enum {
+	SPARSE_STATS_RAW,
+	SPARSE_STATS_FILL,
+	SPARSE_STATS_DONT_CARE,
+	SPARSE_STATS_CRC32,
+	SPARSE_STATS_TYPES
+};
+
+/* System calls counted in struct sparse_stats */
+enum {
+	SPARSE_STATS_SYS_READ,
+	SPARSE_STATS_SYS_WRITE,
+	SPARSE_STATS_SYS_LSEEK,
+	SPARSE_STATS_SYS_MMAP,
+	SPARSE_STATS_SYS_COPY,		/* copy_file_range */
+	SPARSE_STATS_SYSCALLS
+};
+
+/* Phases timed in struct sparse_stats */
+enum {
+	SPARSE_STATS_PARSE,		/* reading the chunks of a sparse image */
+	SPARSE_STATS_INPUT,		/* waiting for the data of a raw image */
+	SPARSE_STATS_CLASSIFY,		/* finding the fill blocks of a raw image */
+	SPARSE_STATS_CRC,		/* computing checksums */
+	SPARSE_STATS_OUTPUT,		/* writing chunks out */
+	SPARSE_STATS_PHASES
+};
+
+/**
+ * struct sparse_stats - counters of the work done on sparse files
+ *
+ * in_chunks and in_bytes count the chunks read from sparse images by type,
+ * and the bytes they expand to.  For raw images they count the runs of data
+ * and fill blocks found.  out_chunks and out_bytes count the chunks written
+ * the same way.  calls and call_bytes count the system calls made on the
+ * inputs and outputs, and the bytes they moved, io_uring reads and writes
+ * included.  Writes of gzip outputs happen inside zlib and are not counted.
+ * ns holds the nanoseconds spent in each phase, the time spent computing
+ * checksums is only counted in SPARSE_STATS_CRC.
+ */
+struct sparse_stats {
+	uint64_t in_chunks[SPARSE_STATS_TYPES];
+	uint64_t in_bytes[SPARSE_STATS_TYPES];
+	uint64_t out_chunks[SPARSE_STATS_TYPES];
+	uint64_t out_bytes[SPARSE_STATS_TYPES];
+	uint64_t calls[SPARSE_STATS_SYSCALLS];
+	uint64_t call_bytes[SPARSE_STATS_SYSCALLS];
+	uint64_t ns[SPARSE_STATS_PHASES];
+};
+
+/**
+ * sparse_file_stats - count the work done on a sparse file
+ *
+ * @s - sparse file cookie
+ * @stats - statistics to add to, or NULL to stop counting
+ *
+ * Reads into s and writes of s add to stats, which must stay valid for as
+ * long as it is attached.  The counters are only added to, several sparse
+ * files can share the same stats, also across threads.  Nothing is
+ * counted or timed for a sparse file without stats.
+ */
+void sparse_file_stats(struct sparse_file *s, struct sparse_stats *stats);
+
+/**
+ * sparse_stats_default - count the work done on new sparse files
+ *
+ * @stats - statistics new sparse files start with, or NULL for none
+ *
+ * Sparse files created after the call, including those created by
+ * sparse_file_import and sparse_file_resparse, have stats attached as if
+ * by sparse_file_stats.
+ */
+void sparse_stats_default(struct sparse_stats *stats);
+
+/**
+ * sparse_stats_json - format statistics as JSON
+ *
+ * @stats - statistics to format
+ * @buf - buffer for the JSON object, terminated by a newline
+ * @len - size of buf
+ *
+ * Returns the length of the JSON object like snprintf, which is larger
+ * than len - 1 if it was truncated.
+ */
+int sparse_stats_json(const struct sparse_stats *stats, char *buf, size_t len);
+
+/**
+ * sparse_stats_print - print statistics as JSON
+ *
+ * @f - file to print to
+ * @stats - statistics to print
+ *
+ * Prints the JSON object of sparse_stats_json, whatever its length.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_stats_print(FILE *f, const struct sparse_stats *stats);
+
+/**
+ * sparse_file_progress - report the progress of reads and writes
+ *
+ * @s - sparse file cookie
+ * @interval_ms - minimum time between two reports, 0 to report every chunk
+ * @progress - function called with the progress, or NULL to stop reporting
+ * @priv - value passed to progress
+ *
+ * Reads into s, including the one of sparse_file_import, and writes of s
+ * call progress with the bytes of the expanded file processed so far, the
+ * size of the expanded file and the rate in bytes per second since the
+ * previous report.  Each read or write ends with a report where done is
+ * total, whatever the interval, and the rate is the average over the
+ * whole read or write.  progress is called from the thread doing the read
+ * or write.
+ */
+void sparse_file_progress(struct sparse_file *s, unsigned int interval_ms,
+		void (*progress)(void *priv, int64_t done, int64_t total, double rate),
+		void *priv);
+
+/**
+ * sparse_progress_default - report the progress of new sparse files
+ *
+ * @interval_ms - minimum time between two reports
+ * @progress - function called with the progress, or NULL for none
+ * @priv - value passed to progress
+ *
+ * Sparse files created after the call, including those created by
+ * sparse_file_import and sparse_file_resparse, report their progress as
+ * if set up by sparse_file_progress.
+ */
+void sparse_progress_default(unsigned int interval_ms,
+		void (*progress)(void *priv, int64_t done, int64_t total, double rate),
+		void *priv);
+
+/**
+ * sparse_progress_print - print progress to standard error
+ *
+ * A progress function that keeps one line of standard error up to date
+ * with the percentage done, the rate and the time left, and ends it once
+ * done.  priv is a label printed in front of it, or NULL.
+ */
+void sparse_progress_print(void *priv, int64_t done, int64_t total, double rate);
+
+/**
+ * sparse_trace_open - record a timeline of the work done by libsparse
+ *
+ * @dir - directory to write the trace to, or NULL
+ * @name - name of the program, used in the trace and in its file name
+ *
+ * Writes Chrome trace events to dir/name.pid.json for the rest of the
+ * process: a span for each read and write of a sparse file, and for the
+ * phases within them, on the thread doing it, with the bytes it covered,
+ * and counters of the bytes read and written so far.  Times are
+ * CLOCK_MONOTONIC microseconds, so that the traces of several processes
+ * line up.  The file is a JSON array with one event per line, which is
+ * completed by sparse_trace_close or at exit.
+ *
+ * Returns 0 on success, or if dir is NULL or empty, negative errno on error.
+ */
+int sparse_trace_open(const char *dir, const char *name);
+
+/**
+ * sparse_trace_close - complete and close the trace
+ */
+void sparse_trace_close(void);
+
 /**
  * sparse_print_verbose - function called to print verbose errors
  *
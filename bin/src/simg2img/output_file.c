@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #define _LARGEFILE64_SOURCE 1
 
@@ -33,6 +34,14 @@
 #include "output_file.h"
 #include "sparse_crc32.h"
 #include "sparse_format.h"
+#include "sparse_stats.h"
+#include "sparse_trace.h"
+#include "uring.h"
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 #ifndef USE_MINGW
 #include <sys/mman.h>
@@ -51,6 +60,9 @@
 #define min(a, b) \
 	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
 
+#define max(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a > _b) ? _a : _b; })
+
 #define SPARSE_HEADER_MAJOR_VER 1
 #define SPARSE_HEADER_MINOR_VER 0
 #define SPARSE_HEADER_LEN       (sizeof(sparse_header_t))
@@ -64,16 +76,57 @@ struct output_file_ops {
     int (*skip) (struct output_file *, int64_t);
     int (*pad) (struct output_file *, int64_t);
     int (*write) (struct output_file *, void *, size_t);
-    void (*close) (struct output_file *);
+    int (*writev) (struct output_file *, const struct iovec *, int);
+    /* Optional, returns -EOPNOTSUPP to have the zeros written instead */
+    int (*zero) (struct output_file *, int64_t);
+    /* Optional, skips a range whose contents don't matter */
+    int (*discard) (struct output_file *, int64_t);
+    /*
+     * Optional, writes a header and then copies a range of an input fd.
+     * Returns -EOPNOTSUPP before writing anything if it can't copy.
+     */
+    int (*copy) (struct output_file *, void *, size_t, int, int64_t, size_t);
+    int (*close) (struct output_file *);
 };
 
 struct sparse_file_ops {
-    int (*write_data_chunk) (struct output_file * out, unsigned int len, void *data);
+    int (*write_data_chunk) (struct output_file * out, unsigned int len,
+                             const struct iovec * iov, int iovcnt);
     int (*write_fill_chunk) (struct output_file * out, unsigned int len, uint32_t fill_val);
     int (*write_skip_chunk) (struct output_file * out, int64_t len);
     int (*write_end_chunk) (struct output_file * out);
 };
 
+/*
+ * Inputs of file and fd chunks are kept open and mapped across chunks.
+ * Files are opened on first use and kept in a small LRU cache together with
+ * the fds passed in by the caller, and each input keeps its last mapping
+ * window so that consecutive chunks from the same region of an input share
+ * one mmap instead of mapping and unmapping each chunk.
+ *
+ * Regular files that fit in the address space are mapped whole, others get
+ * windows of INPUT_MAP_WINDOW bytes.  Mappings are read front to back, so
+ * the kernel is told so, and the next INPUT_READAHEAD bytes past the last
+ * chunk written are requested ahead of time.  A streaming output also gives
+ * back the pages it is done with, so that they don't add up in its RSS.
+ */
+#define INPUT_CACHE_SIZE 16
+#define INPUT_MAP_WINDOW (64 * 1024 * 1024)
+#define INPUT_MAP_WHOLE_MAX (sizeof(void *) > 4 ? (1ULL << 40) : INPUT_MAP_WINDOW)
+#define INPUT_READAHEAD (8 * 1024 * 1024)
+
+struct input_file {
+    const char *filename;       /* NULL for fds owned by the caller */
+    int fd;                     /* -1 if the slot is unused */
+    int64_t size;               /* size of a regular file, or -1 */
+    char *map;
+    int64_t map_offset;
+    uint64_t map_len;
+    int64_t advised;            /* end of the range requested with WILLNEED */
+    int64_t released;           /* end of the range given back with DONTNEED */
+    unsigned int last_used;
+};
+
 struct output_file {
     int64_t cur_out_ptr;
     unsigned int chunk_cnt;
@@ -83,9 +136,20 @@ struct output_file {
     int use_crc;
     unsigned int block_size;
     int64_t len;
+    bool discard;
+    bool no_copy;
+    bool stream;
     char *zero_buf;
     uint32_t *fill_buf;
+    unsigned int fill_buf_len;
+    uint32_t fill_buf_val;
     char *buf;
+    struct iovec *iov;
+    int iov_size;
+    struct input_file inputs[INPUT_CACHE_SIZE];
+    unsigned int input_clock;
+    struct sparse_stats *stats;
+    uint64_t crc_ns;            /* checksum time, left out of the output time */
 };
 
 struct output_file_gz {
@@ -96,14 +160,76 @@ struct output_file_gz {
 #define to_output_file_gz(_o) \
 	container_of((_o), struct output_file_gz, out)
 
+/*
+ * Plain file outputs collect small writes, such as chunk headers, fill
+ * values and single blocks, in a buffer of OUT_BUF_SIZE bytes.  Larger
+ * writes go out with writev together with whatever is buffered, so that a
+ * chunk costs at most one system call however it is split up.
+ */
+#define OUT_BUF_SIZE (1024 * 1024)
+#define OUT_BUF_COPY_MAX (64 * 1024)
+
 struct output_file_normal {
     struct output_file out;
     int fd;
+    int64_t size;               /* size of the output when opened, or -1 */
+    unsigned int sector;        /* sector size of a block device, else 0 */
+    char *buf;
+    size_t buf_len;
 };
 
 #define to_output_file_normal(_o) \
 	container_of((_o), struct output_file_normal, out)
 
+#ifndef USE_MINGW
+/*
+ * Regular files and block devices are written through io_uring when the
+ * kernel supports it.  Data is copied into AIO_BUFS registered buffers,
+ * and a full buffer is submitted at its offset in the output while the
+ * next one is being filled, so that up to AIO_BUFS writes are in flight.
+ *
+ * The same buffers serve outputs opened with O_DIRECT, which are written
+ * synchronously with pwrite64() when io_uring is not available.  Buffers
+ * then start and end on DIRECT_ALIGN boundaries in the output: partial
+ * blocks at their edges are read back from the output, or zero filled
+ * past its original end, before they are written.
+ */
+#define AIO_BUFS 8
+#define AIO_BUF_SIZE (1024 * 1024)
+#define DIRECT_ALIGN 4096
+
+struct aio_buf {
+    int64_t offset;
+    size_t lo;                  /* start of the data in the buffer */
+    size_t len;
+};
+
+struct output_file_aio {
+    struct output_file out;
+    int fd;
+    struct uring *ring;
+    char *bufs;
+    char *edge;                 /* DIRECT_ALIGN bytes for reading back partial blocks */
+    struct aio_buf slots[AIO_BUFS];
+    int free_bufs[AIO_BUFS];
+    int nr_free;
+    int cur;                    /* buffer being filled, or -1 */
+    int64_t cur_start;          /* output offset of the start of cur */
+    size_t cur_lo;              /* cur holds data in [cur_lo, cur_len) */
+    size_t cur_len;
+    int64_t pos;                /* output offset of the next byte */
+    unsigned int align;         /* DIRECT_ALIGN with O_DIRECT, else 1 */
+    unsigned int sector;        /* sector size of a block device, else 0 */
+    int64_t size;               /* size of the output when opened */
+    int64_t data_end;           /* end of the data written */
+    int64_t written_end;        /* end of what was actually written */
+    int error;
+};
+
+#define to_output_file_aio(_o) \
+	container_of((_o), struct output_file_aio, out)
+#endif
+
 struct output_file_callback {
     struct output_file out;
     void *priv;
@@ -113,32 +239,269 @@ struct output_file_callback {
 #define to_output_file_callback(_o) \
 	container_of((_o), struct output_file_callback, out)
 
+/* Returns the logical sector size of block device fd, or 0 if unknown */
+static unsigned int device_sector_size(int fd __unused)
+{
+#ifdef BLKSSZGET
+    int sector;
+
+    if (ioctl(fd, BLKSSZGET, &sector) == 0 && sector > 0) {
+        return sector;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Zeroes [offset, offset + len) of fd without writing to it, with
+ * BLKZEROOUT on a block device of the given sector size, to which the
+ * range must be aligned.  Returns -EOPNOTSUPP if that can't be done.
+ */
+static int punch_zero(int fd __unused, unsigned int sector __unused,
+                      int64_t offset __unused, int64_t len __unused)
+{
+#ifdef BLKZEROOUT
+    if (sector) {
+        uint64_t range[2] = { offset, len };
+
+        return ioctl(fd, BLKZEROOUT, range) == 0 ? 0 : -EOPNOTSUPP;
+    }
+#endif
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_ZERO_RANGE)
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
+    }
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
+    }
+#endif
+    return -EOPNOTSUPP;
+}
+
+/*
+ * Discards the whole sectors in [offset, offset + len) of a block device.
+ * Discarding is only a hint, devices that can't are left alone.
+ */
+static void device_discard(int fd __unused, unsigned int sector __unused,
+                           int64_t offset __unused, int64_t len __unused)
+{
+#ifdef BLKDISCARD
+    uint64_t range[2];
+    int64_t end = ALIGN_DOWN(offset + len, (int64_t) sector);
+
+    range[0] = ALIGN(offset, (int64_t) sector);
+    if (end > (int64_t) range[0]) {
+        range[1] = end - range[0];
+        ioctl(fd, BLKDISCARD, range);
+    }
+#endif
+}
+
+/*
+ * Copies [in_offset, in_offset + len) of in_fd to out_offset of out_fd in
+ * the kernel, which shares the extents instead where the filesystem and
+ * the alignment of the offsets allow.  Returns -EOPNOTSUPP if the fds
+ * can't be copied between, before anything is copied.
+ */
+int copy_range(int in_fd __unused, int64_t in_offset __unused, int out_fd __unused,
+               int64_t out_offset __unused, size_t len __unused)
+{
+#ifdef __linux__
+    loff_t in_off = in_offset;
+    loff_t out_off = out_offset;
+    bool copied = false;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!copied && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                            errno == EOPNOTSUPP || errno == EBADF)) {
+                return -EOPNOTSUPP;
+            }
+            return -errno;
+        }
+        /* The input ends before the chunk does */
+        if (ret == 0) {
+            return -EINVAL;
+        }
+        copied = true;
+        len -= ret;
+    }
+
+    return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
 static int file_open(struct output_file *out, int fd)
 {
     struct output_file_normal *outn = to_output_file_normal(out);
+    struct stat st;
 
     outn->fd = fd;
+    outn->size = -1;
+    if (fstat(fd, &st) == 0) {
+        if (S_ISREG(st.st_mode)) {
+            outn->size = st.st_size;
+        } else if (S_ISBLK(st.st_mode)) {
+            outn->size = INT64_MAX;
+            outn->sector = device_sector_size(fd);
+        }
+    }
+
     return 0;
 }
 
+#ifndef USE_MINGW
+#define WRITEV_BATCH 64
+#define sys_writev writev
+#else
+#define WRITEV_BATCH 1
+/* Partial writes are handled by the caller, so one buffer at a time will do */
+static ssize_t sys_writev(int fd, const struct iovec *iov, int iovcnt __unused)
+{
+    return write(fd, iov[0].iov_base, iov[0].iov_len);
+}
+#endif
+
+/* Writes the buffered data followed by iov, handling short writes */
+static int file_flush_iov(struct output_file_normal *outn, const struct iovec *iov, int iovcnt)
+{
+    struct iovec vec[WRITEV_BATCH];
+    ssize_t ret;
+    size_t done = 0;            /* bytes of the current buffer already written */
+    int i = outn->buf_len ? -1 : 0;     /* -1 is the output buffer */
+    int cnt;
+
+#define iov_at(_i) ((_i) < 0 ? (struct iovec){ outn->buf, outn->buf_len } : iov[(_i)])
+
+    while (i < iovcnt) {
+        for (cnt = 0; cnt < WRITEV_BATCH && i + cnt < iovcnt; cnt++) {
+            vec[cnt] = iov_at(i + cnt);
+        }
+        vec[0].iov_base = (char *)vec[0].iov_base + done;
+        vec[0].iov_len -= done;
+
+        ret = sys_writev(outn->fd, vec, cnt);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_errno("writev");
+            return -1;
+        }
+        stats_call(outn->out.stats, SPARSE_STATS_SYS_WRITE, ret);
+
+        done += ret;
+        while (i < iovcnt && done >= iov_at(i).iov_len) {
+            done -= iov_at(i).iov_len;
+            i++;
+        }
+    }
+
+#undef iov_at
+
+    outn->buf_len = 0;
+    return 0;
+}
+
+static int file_flush(struct output_file_normal *outn)
+{
+    if (!outn->buf_len) {
+        return 0;
+    }
+
+    return file_flush_iov(outn, NULL, 0);
+}
+
 static int file_skip(struct output_file *out, int64_t cnt)
 {
     off64_t ret;
     struct output_file_normal *outn = to_output_file_normal(out);
 
+    if (file_flush(outn) < 0) {
+        return -1;
+    }
+
     ret = lseek64(outn->fd, cnt, SEEK_CUR);
     if (ret < 0) {
         error_errno("lseek64");
         return -1;
     }
+    stats_call(out->stats, SPARSE_STATS_SYS_LSEEK, 0);
     return 0;
 }
 
+/*
+ * Output past the original end of the file reads as zeros once skipped,
+ * anything before it is punched out.
+ */
+static int file_zero(struct output_file *out, int64_t cnt)
+{
+    off64_t pos;
+    int ret;
+    struct output_file_normal *outn = to_output_file_normal(out);
+
+    if (outn->size < 0) {
+        return -EOPNOTSUPP;
+    }
+
+    pos = lseek64(outn->fd, 0, SEEK_CUR);
+    stats_call(out->stats, SPARSE_STATS_SYS_LSEEK, 0);
+    if (pos < 0) {
+        return -EOPNOTSUPP;
+    }
+    pos += outn->buf_len;
+
+    if (outn->sector && (pos % outn->sector || cnt % outn->sector)) {
+        return -EOPNOTSUPP;
+    }
+
+    if (pos < outn->size) {
+        ret = punch_zero(outn->fd, outn->sector, pos, min(cnt, outn->size - pos));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return file_skip(out, cnt);
+}
+
+static int file_discard(struct output_file *out, int64_t cnt)
+{
+    off64_t pos;
+    struct output_file_normal *outn = to_output_file_normal(out);
+
+    if (outn->sector) {
+        pos = lseek64(outn->fd, 0, SEEK_CUR);
+        stats_call(out->stats, SPARSE_STATS_SYS_LSEEK, 0);
+        if (pos >= 0) {
+            device_discard(outn->fd, outn->sector, pos + outn->buf_len, cnt);
+        }
+    }
+
+    return file_skip(out, cnt);
+}
+
 static int file_pad(struct output_file *out, int64_t len)
 {
     int ret;
     struct output_file_normal *outn = to_output_file_normal(out);
 
+    if (file_flush(outn) < 0) {
+        return -1;
+    }
+
+    /* A block device is as large as it is */
+    if (outn->sector) {
+        return 0;
+    }
+
     ret = ftruncate64(outn->fd, len);
     if (ret < 0) {
         return -errno;
@@ -147,33 +510,98 @@ static int file_pad(struct output_file *out, int64_t len)
     return 0;
 }
 
-static int file_write(struct output_file *out, void *data, size_t len)
+static int file_writev(struct output_file *out, const struct iovec *iov, int iovcnt)
 {
-    ssize_t ret;
+    size_t len = 0;
+    int i;
     struct output_file_normal *outn = to_output_file_normal(out);
 
-    while (len > 0) {
-        ret = write(outn->fd, data, len);
-        if (ret < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            error_errno("write");
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    if (len > OUT_BUF_COPY_MAX) {
+        return file_flush_iov(outn, iov, iovcnt);
+    }
+
+    if (!outn->buf) {
+        outn->buf = malloc(OUT_BUF_SIZE);
+        if (!outn->buf) {
+            error_errno("malloc out buf");
             return -1;
         }
+    }
 
-        data = (char *)data + ret;
-        len -= ret;
+    if (outn->buf_len + len > OUT_BUF_SIZE && file_flush(outn) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(outn->buf + outn->buf_len, iov[i].iov_base, iov[i].iov_len);
+        outn->buf_len += iov[i].iov_len;
     }
 
     return 0;
 }
 
-static void file_close(struct output_file *out)
+static int file_write(struct output_file *out, void *data, size_t len)
+{
+    struct iovec iov = {
+        .iov_base = data,
+        .iov_len = len,
+    };
+
+    return file_writev(out, &iov, 1);
+}
+
+static int file_copy(struct output_file *out, void *hdr, size_t hdr_len,
+                     int fd, int64_t offset, size_t len)
 {
+    off64_t pos;
+    int ret;
+    struct output_file_normal *outn = to_output_file_normal(out);
+
+    if (outn->sector) {
+        return -EOPNOTSUPP;
+    }
+
+    if (file_flush(outn) < 0) {
+        return -1;
+    }
+
+    pos = lseek64(outn->fd, 0, SEEK_CUR);
+    if (pos < 0) {
+        return -errno;
+    }
+    stats_call(out->stats, SPARSE_STATS_SYS_LSEEK, 0);
+
+    ret = copy_range(fd, offset, outn->fd, pos + hdr_len, len);
+    if (ret < 0) {
+        return ret;
+    }
+    stats_call(out->stats, SPARSE_STATS_SYS_COPY, len);
+
+    if (hdr_len) {
+        ret = file_write(out, hdr, hdr_len);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return file_skip(out, len);
+}
+
+static int file_close(struct output_file *out)
+{
+    int ret;
     struct output_file_normal *outn = to_output_file_normal(out);
 
+    ret = file_flush(outn);
+
+    free(outn->buf);
     free(outn);
+
+    return ret;
 }
 
 static struct output_file_ops file_ops = {
@@ -181,9 +609,432 @@ static struct output_file_ops file_ops = {
     .skip = file_skip,
     .pad = file_pad,
     .write = file_write,
+    .writev = file_writev,
+    .zero = file_zero,
+    .discard = file_discard,
+    .copy = file_copy,
     .close = file_close,
 };
 
+#ifndef USE_MINGW
+static int aio_file_open(struct output_file *out, int fd)
+{
+    struct output_file_aio *outa = to_output_file_aio(out);
+
+    outa->fd = fd;
+    return 0;
+}
+
+/* Writes what io_uring didn't, and puts the buffer back on the free list */
+static void aio_file_complete(struct output_file_aio *outa, int buf, int res)
+{
+    struct aio_buf *slot = &outa->slots[buf];
+    size_t done = res < 0 ? 0 : res;
+    ssize_t ret;
+
+    if (res < 0) {
+        errno = -res;
+        error_errno("io_uring write");
+        outa->error = -1;
+    }
+
+    while (res >= 0 && done < slot->len) {
+        ret = pwrite64(outa->fd, outa->bufs + buf * AIO_BUF_SIZE + slot->lo + done,
+                       slot->len - done, slot->offset + done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_errno("pwrite64");
+            outa->error = -1;
+            break;
+        }
+        stats_call(outa->out.stats, SPARSE_STATS_SYS_WRITE, ret);
+        done += ret;
+    }
+
+    outa->free_bufs[outa->nr_free++] = buf;
+}
+
+/* Waits for one write to complete */
+static int aio_file_reap(struct output_file_aio *outa)
+{
+#ifdef HAVE_IO_URING
+    uint64_t tag;
+    int res;
+    int ret;
+
+    ret = uring_wait(outa->ring, &tag, &res);
+    if (ret < 0) {
+        return ret;
+    }
+
+    aio_file_complete(outa, tag, res);
+#endif
+
+    return 0;
+}
+
+/* Waits for every submitted write to complete */
+static int aio_file_wait(struct output_file_aio *outa)
+{
+    while (outa->nr_free + (outa->cur >= 0) < AIO_BUFS) {
+        if (aio_file_reap(outa) < 0) {
+            return -1;
+        }
+    }
+
+    return outa->error;
+}
+
+/* Fills [from, to) of the current buffer with what the output holds there */
+static int aio_file_fill_edge(struct output_file_aio *outa, size_t from, size_t to)
+{
+    char *buf = outa->bufs + outa->cur * AIO_BUF_SIZE;
+    int64_t block = ALIGN_DOWN(outa->cur_start + from, outa->align);
+    size_t done = 0;
+    ssize_t ret;
+
+    if (outa->cur_start + (int64_t) from >= outa->size) {
+        memset(buf + from, 0, to - from);
+        return 0;
+    }
+
+    /* Earlier writes may cover the block, read it once they are done */
+    if (aio_file_wait(outa) < 0) {
+        return -1;
+    }
+
+    while (done < outa->align) {
+        ret = pread64(outa->fd, outa->edge + done, outa->align - done, block + done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_errno("pread64");
+            return -1;
+        }
+        stats_call(outa->out.stats, SPARSE_STATS_SYS_READ, ret);
+        if (ret == 0) {
+            memset(outa->edge + done, 0, outa->align - done);
+            break;
+        }
+        done += ret;
+    }
+
+    memcpy(buf + from, outa->edge + (outa->cur_start + from - block), to - from);
+
+    return 0;
+}
+
+static int aio_file_submit(struct output_file_aio *outa)
+{
+    struct aio_buf *slot;
+    size_t lo, hi;
+    int ret;
+
+    if (outa->cur < 0) {
+        return 0;
+    }
+
+    lo = ALIGN_DOWN(outa->cur_lo, outa->align);
+    hi = ALIGN(outa->cur_len, outa->align);
+    if (lo < outa->cur_lo && aio_file_fill_edge(outa, lo, outa->cur_lo) < 0) {
+        return -1;
+    }
+    if (hi > outa->cur_len && aio_file_fill_edge(outa, outa->cur_len, hi) < 0) {
+        return -1;
+    }
+
+    slot = &outa->slots[outa->cur];
+    slot->offset = outa->cur_start + lo;
+    slot->lo = lo;
+    slot->len = hi - lo;
+    outa->written_end = max(outa->written_end, slot->offset + (int64_t) slot->len);
+
+    if (!outa->ring) {
+        aio_file_complete(outa, outa->cur, 0);
+        outa->cur = -1;
+        return outa->error;
+    }
+
+    ret = -ENOSYS;
+#ifdef HAVE_IO_URING
+    ret = uring_write(outa->ring, outa->fd, outa->cur, outa->bufs + outa->cur * AIO_BUF_SIZE + lo,
+                      slot->len, slot->offset, outa->cur);
+#endif
+    if (ret < 0) {
+        errno = -ret;
+        error_errno("io_uring submit");
+        return -1;
+    }
+    stats_call(outa->out.stats, SPARSE_STATS_SYS_WRITE, slot->len);
+    outa->cur = -1;
+
+    return 0;
+}
+
+static int aio_file_drain(struct output_file_aio *outa)
+{
+    if (aio_file_submit(outa) < 0) {
+        return -1;
+    }
+
+    return aio_file_wait(outa);
+}
+
+static int aio_file_skip(struct output_file *out, int64_t cnt)
+{
+    struct output_file_aio *outa = to_output_file_aio(out);
+    int64_t end = outa->pos + cnt;
+
+    /*
+     * Skipping within the current buffer from an unaligned offset past the
+     * original end of the output fills the gap with zeros, rather than
+     * writing out the buffer and reading its partial blocks back.
+     */
+    if (outa->cur >= 0 && outa->pos >= outa->size &&
+        (outa->pos % outa->align || end % outa->align) &&
+        end <= outa->cur_start + AIO_BUF_SIZE) {
+        memset(outa->bufs + outa->cur * AIO_BUF_SIZE + outa->cur_len, 0, cnt);
+        outa->cur_len += cnt;
+        outa->pos = end;
+        if (outa->cur_len == AIO_BUF_SIZE && aio_file_submit(outa) < 0) {
+            return -1;
+        }
+        return outa->error;
+    }
+
+    if (aio_file_submit(outa) < 0) {
+        return -1;
+    }
+
+    outa->pos = end;
+    return outa->error;
+}
+
+static int aio_file_pad(struct output_file *out, int64_t len)
+{
+    int ret;
+    struct output_file_aio *outa = to_output_file_aio(out);
+
+    if (aio_file_drain(outa) < 0) {
+        return -1;
+    }
+
+    if (outa->sector) {
+        return 0;
+    }
+
+    ret = ftruncate64(outa->fd, len);
+    if (ret < 0) {
+        return -errno;
+    }
+    outa->data_end = outa->written_end = len;
+
+    return 0;
+}
+
+static int aio_file_write(struct output_file *out, void *data, size_t len)
+{
+    size_t n;
+    struct output_file_aio *outa = to_output_file_aio(out);
+
+    while (len > 0) {
+        if (outa->cur < 0) {
+            if (outa->nr_free == 0 && aio_file_reap(outa) < 0) {
+                return -1;
+            }
+            outa->cur = outa->free_bufs[--outa->nr_free];
+            outa->cur_start = ALIGN_DOWN(outa->pos, outa->align);
+            outa->cur_lo = outa->cur_len = outa->pos - outa->cur_start;
+        }
+
+        n = min(len, AIO_BUF_SIZE - outa->cur_len);
+        memcpy(outa->bufs + outa->cur * AIO_BUF_SIZE + outa->cur_len, data, n);
+        outa->cur_len += n;
+        outa->pos += n;
+        data = (char *)data + n;
+        len -= n;
+
+        if (outa->cur_len == AIO_BUF_SIZE && aio_file_submit(outa) < 0) {
+            return -1;
+        }
+    }
+    outa->data_end = outa->pos;
+
+    return outa->error;
+}
+
+static int aio_file_writev(struct output_file *out, const struct iovec *iov, int iovcnt)
+{
+    int ret;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = aio_file_write(out, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int aio_file_write_zeros(struct output_file *out, int64_t cnt)
+{
+    int ret;
+    int64_t n;
+
+    while (cnt > 0) {
+        n = min(cnt, (int64_t) out->block_size);
+        ret = aio_file_write(out, out->zero_buf, n);
+        if (ret < 0) {
+            return ret;
+        }
+        cnt -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Output past the original end reads as zeros once skipped.  Before it the
+ * aligned part of the range is punched out and the edges written as zeros.
+ */
+static int aio_file_zero(struct output_file *out, int64_t cnt)
+{
+    struct output_file_aio *outa = to_output_file_aio(out);
+    int64_t align = max(outa->align, outa->sector);
+    int64_t end = outa->pos + cnt;
+    int64_t lo = ALIGN(outa->pos, align);
+    int64_t hi = ALIGN_DOWN(end, align);
+    int ret;
+
+    if (outa->pos >= outa->size) {
+        ret = aio_file_skip(out, cnt);
+        outa->data_end = max(outa->data_end, end);
+        return ret;
+    }
+
+    if (hi <= lo) {
+        return -EOPNOTSUPP;
+    }
+
+    /* Nothing is in flight beyond lo, the hole can be punched right away */
+    if (lo < outa->size) {
+        ret = punch_zero(outa->fd, outa->sector, lo, min(hi, outa->size) - lo);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = aio_file_write_zeros(out, lo - outa->pos);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = aio_file_skip(out, hi - lo);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = aio_file_write_zeros(out, end - hi);
+    outa->data_end = max(outa->data_end, end);
+
+    return ret;
+}
+
+static int aio_file_discard(struct output_file *out, int64_t cnt)
+{
+    struct output_file_aio *outa = to_output_file_aio(out);
+
+    if (outa->sector) {
+        device_discard(outa->fd, outa->sector, outa->pos, cnt);
+    }
+
+    return aio_file_skip(out, cnt);
+}
+
+/* The copy goes straight to the output, after the buffered writes before it */
+static int aio_file_copy(struct output_file *out, void *hdr, size_t hdr_len,
+                         int fd, int64_t offset, size_t len)
+{
+    int ret;
+    struct output_file_aio *outa = to_output_file_aio(out);
+
+    if (outa->align > 1 || outa->sector) {
+        return -EOPNOTSUPP;
+    }
+
+    if (aio_file_submit(outa) < 0) {
+        return -1;
+    }
+
+    ret = copy_range(fd, offset, outa->fd, outa->pos + hdr_len, len);
+    if (ret < 0) {
+        return ret;
+    }
+    stats_call(out->stats, SPARSE_STATS_SYS_COPY, len);
+
+    if (hdr_len) {
+        ret = aio_file_write(out, hdr, hdr_len);
+        if (ret < 0 || aio_file_submit(outa) < 0) {
+            return -1;
+        }
+    }
+
+    outa->pos += len;
+    outa->data_end = outa->pos;
+    outa->written_end = max(outa->written_end, outa->pos);
+
+    return outa->error;
+}
+
+static int aio_file_close(struct output_file *out)
+{
+    int ret;
+    int64_t end;
+    struct output_file_aio *outa = to_output_file_aio(out);
+
+    ret = aio_file_drain(outa);
+
+    /* Cut off the padding of a partial last block written past the data */
+    end = max(outa->data_end, outa->size);
+    if (outa->written_end > end && ftruncate64(outa->fd, end) < 0) {
+        ret = -1;
+    }
+
+    /* Leave the file offset where plain writes would have left it */
+    if (lseek64(outa->fd, outa->pos, SEEK_SET) < 0) {
+        ret = -1;
+    }
+    stats_call(out->stats, SPARSE_STATS_SYS_LSEEK, 0);
+
+#ifdef HAVE_IO_URING
+    if (outa->ring) {
+        uring_free(outa->ring);
+    }
+#endif
+    free(outa->bufs);
+    free(outa);
+
+    return ret;
+}
+
+static struct output_file_ops aio_file_ops = {
+    .open = aio_file_open,
+    .skip = aio_file_skip,
+    .pad = aio_file_pad,
+    .write = aio_file_write,
+    .writev = aio_file_writev,
+    .zero = aio_file_zero,
+    .discard = aio_file_discard,
+    .copy = aio_file_copy,
+    .close = aio_file_close,
+};
+#endif
+
 static int gz_file_open(struct output_file *out, int fd)
 {
     struct output_file_gz *outgz = to_output_file_gz(out);
@@ -253,12 +1104,15 @@ static int gz_file_write(struct output_file *out, void *data, size_t len)
     return 0;
 }
 
-static void gz_file_close(struct output_file *out)
+static int gz_file_close(struct output_file *out)
 {
+    int ret;
     struct output_file_gz *outgz = to_output_file_gz(out);
 
-    gzclose(outgz->gz_fd);
+    ret = gzclose(outgz->gz_fd);
     free(outgz);
+
+    return ret == Z_OK ? 0 : -1;
 }
 
 static struct output_file_ops gz_file_ops = {
@@ -304,11 +1158,13 @@ static int callback_file_write(struct output_file *out, void *data, size_t len)
     return outc->write(outc->priv, data, len);
 }
 
-static void callback_file_close(struct output_file *out)
+static int callback_file_close(struct output_file *out)
 {
     struct output_file_callback *outc = to_output_file_callback(out);
 
     free(outc);
+
+    return 0;
 }
 
 static struct output_file_ops callback_file_ops = {
@@ -341,6 +1197,47 @@ int read_all(int fd, void *buf, size_t len)
     return 0;
 }
 
+/* Writes a list of buffers, falling back to one write per buffer */
+static int output_writev(struct output_file *out, const struct iovec *iov, int iovcnt)
+{
+    int ret;
+    int i;
+
+    if (out->ops->writev) {
+        return out->ops->writev(out, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = out->ops->write(out, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Makes sure out->iov can hold count entries */
+static int output_reserve_iov(struct output_file *out, int count)
+{
+    struct iovec *iov;
+
+    if (count <= out->iov_size) {
+        return 0;
+    }
+
+    iov = realloc(out->iov, count * sizeof(struct iovec));
+    if (!iov) {
+        error_errno("malloc iov");
+        return -ENOMEM;
+    }
+
+    out->iov = iov;
+    out->iov_size = count;
+
+    return 0;
+}
+
 static int write_sparse_skip_chunk(struct output_file *out, int64_t skip_len)
 {
     chunk_header_t chunk_header;
@@ -381,18 +1278,23 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len, ui
     chunk_header.reserved1 = 0;
     chunk_header.chunk_sz = rnd_up_len / out->block_size;
     chunk_header.total_sz = CHUNK_HEADER_LEN + sizeof(fill_val);
-    ret = out->ops->write(out, &chunk_header, sizeof(chunk_header));
 
-    if (ret < 0)
-        return -1;
-    ret = out->ops->write(out, &fill_val, sizeof(fill_val));
+    struct iovec iov[] = {
+        { &chunk_header, sizeof(chunk_header) },
+        { &fill_val, sizeof(fill_val) },
+    };
+
+    ret = output_writev(out, iov, 2);
     if (ret < 0)
         return -1;
 
     if (out->use_crc) {
+        uint64_t start = stats_start(out->stats);
+
         count = out->block_size / sizeof(uint32_t);
         while (count--)
             out->crc32 = sparse_crc32(out->crc32, &fill_val, sizeof(uint32_t));
+        stats_crc_end(out->stats, &out->crc_ns, start);
     }
 
     out->cur_out_ptr += rnd_up_len;
@@ -401,38 +1303,46 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len, ui
     return 0;
 }
 
-static int write_sparse_data_chunk(struct output_file *out, unsigned int len, void *data)
+static int write_sparse_data_chunk(struct output_file *out, unsigned int len,
+                                   const struct iovec *iov, int iovcnt)
 {
     chunk_header_t chunk_header;
     int rnd_up_len, zero_len;
     int ret;
+    int i;
 
     /* Round up the data length to a multiple of the block size */
     rnd_up_len = ALIGN(len, out->block_size);
     zero_len = rnd_up_len - len;
 
+    ret = output_reserve_iov(out, iovcnt + 2);
+    if (ret < 0)
+        return -1;
+
     /* Finally we can safely emit a chunk of data */
     chunk_header.chunk_type = CHUNK_TYPE_RAW;
     chunk_header.reserved1 = 0;
     chunk_header.chunk_sz = rnd_up_len / out->block_size;
     chunk_header.total_sz = CHUNK_HEADER_LEN + rnd_up_len;
-    ret = out->ops->write(out, &chunk_header, sizeof(chunk_header));
 
+    /* Header, data and padding go out in a single vectored write */
+    out->iov[0].iov_base = &chunk_header;
+    out->iov[0].iov_len = sizeof(chunk_header);
+    memcpy(&out->iov[1], iov, iovcnt * sizeof(struct iovec));
+    out->iov[iovcnt + 1].iov_base = out->zero_buf;
+    out->iov[iovcnt + 1].iov_len = zero_len;
+    ret = output_writev(out, out->iov, zero_len ? iovcnt + 2 : iovcnt + 1);
     if (ret < 0)
         return -1;
-    ret = out->ops->write(out, data, len);
-    if (ret < 0)
-        return -1;
-    if (zero_len) {
-        ret = out->ops->write(out, out->zero_buf, zero_len);
-        if (ret < 0)
-            return -1;
-    }
 
     if (out->use_crc) {
-        out->crc32 = sparse_crc32(out->crc32, data, len);
+        uint64_t start = stats_start(out->stats);
+
+        for (i = 0; i < iovcnt; i++)
+            out->crc32 = sparse_crc32(out->crc32, iov[i].iov_base, iov[i].iov_len);
         if (zero_len)
             out->crc32 = sparse_crc32(out->crc32, out->zero_buf, zero_len);
+        stats_crc_end(out->stats, &out->crc_ns, start);
     }
 
     out->cur_out_ptr += rnd_up_len;
@@ -452,15 +1362,17 @@ int write_sparse_end_chunk(struct output_file *out)
         chunk_header.chunk_sz = 0;
         chunk_header.total_sz = CHUNK_HEADER_LEN + 4;
 
-        ret = out->ops->write(out, &chunk_header, sizeof(chunk_header));
-        if (ret < 0) {
-            return ret;
-        }
-        out->ops->write(out, &out->crc32, 4);
+        struct iovec iov[] = {
+            { &chunk_header, sizeof(chunk_header) },
+            { &out->crc32, 4 },
+        };
+
+        ret = output_writev(out, iov, 2);
         if (ret < 0) {
             return ret;
         }
 
+        stats_chunk_out(out->stats, SPARSE_STATS_CRC32, 0);
         out->chunk_cnt++;
     }
 
@@ -474,12 +1386,13 @@ static struct sparse_file_ops sparse_file_ops = {
     .write_end_chunk = write_sparse_end_chunk,
 };
 
-static int write_normal_data_chunk(struct output_file *out, unsigned int len, void *data)
+static int write_normal_data_chunk(struct output_file *out, unsigned int len,
+                                   const struct iovec *iov, int iovcnt)
 {
     int ret;
     unsigned int rnd_up_len = ALIGN(len, out->block_size);
 
-    ret = out->ops->write(out, data, len);
+    ret = output_writev(out, iov, iovcnt);
     if (ret < 0) {
         return ret;
     }
@@ -491,19 +1404,46 @@ static int write_normal_data_chunk(struct output_file *out, unsigned int len, vo
     return ret;
 }
 
+/*
+ * Fills are written from a buffer of up to FILL_BUF_SIZE bytes that keeps
+ * the last fill value, so that runs of fill chunks cost one write each.
+ */
+#define FILL_BUF_SIZE (1024 * 1024)
+
 static int write_normal_fill_chunk(struct output_file *out, unsigned int len, uint32_t fill_val)
 {
     int ret;
     unsigned int i;
     unsigned int write_len;
 
+    /* Zero fills become holes where the output supports it */
+    if (fill_val == 0 && out->ops->zero) {
+        ret = out->ops->zero(out, len);
+        if (ret != -EOPNOTSUPP) {
+            return ret;
+        }
+    }
+
+    if (!out->fill_buf) {
+        out->fill_buf_len = max(ALIGN_DOWN(FILL_BUF_SIZE, out->block_size), out->block_size);
+        out->fill_buf = malloc(out->fill_buf_len);
+        if (!out->fill_buf) {
+            error_errno("malloc fill_buf");
+            return -ENOMEM;
+        }
+        out->fill_buf_val = ~fill_val;
+    }
+
     /* Initialize fill_buf with the fill_val */
-    for (i = 0; i < out->block_size / sizeof(uint32_t); i++) {
-        out->fill_buf[i] = fill_val;
+    if (out->fill_buf_val != fill_val) {
+        for (i = 0; i < out->fill_buf_len / sizeof(uint32_t); i++) {
+            out->fill_buf[i] = fill_val;
+        }
+        out->fill_buf_val = fill_val;
     }
 
     while (len) {
-        write_len = min(len, out->block_size);
+        write_len = min(len, out->fill_buf_len);
         ret = out->ops->write(out, out->fill_buf, write_len);
         if (ret < 0) {
             return ret;
@@ -517,6 +1457,10 @@ static int write_normal_fill_chunk(struct output_file *out, unsigned int len, ui
 
 static int write_normal_skip_chunk(struct output_file *out, int64_t len)
 {
+    if (out->discard && out->ops->discard) {
+        return out->ops->discard(out, len);
+    }
+
     return out->ops->skip(out, len);
 }
 
@@ -532,16 +1476,67 @@ static struct sparse_file_ops normal_file_ops = {
     .write_end_chunk = write_normal_end_chunk,
 };
 
-void output_file_close(struct output_file *out)
+static void input_release(struct input_file *in)
+{
+#ifndef USE_MINGW
+    if (in->map) {
+        munmap(in->map, in->map_len);
+    }
+#endif
+    if (in->filename) {
+        close(in->fd);
+    }
+
+    in->filename = NULL;
+    in->fd = -1;
+    in->map = NULL;
+}
+
+void output_file_discard(struct output_file *out)
+{
+    out->discard = true;
+}
+
+void output_file_stream(struct output_file *out)
 {
-    out->sparse_ops->write_end_chunk(out);
-    out->ops->close(out);
+    out->stream = true;
+}
+
+void output_file_stats(struct output_file *out, struct sparse_stats *stats)
+{
+    out->stats = stats;
+}
+
+/* Returns negative if the end chunk or data still buffered in the output could not be written */
+int output_file_close(struct output_file *out)
+{
+    struct sparse_stats *stats = out->stats;
+    uint64_t start = stats_start(stats);
+    uint64_t trace = trace_start();
+    int end_ret;
+    int ret;
+    int i;
+
+    end_ret = out->sparse_ops->write_end_chunk(out);
+    for (i = 0; i < INPUT_CACHE_SIZE; i++) {
+        input_release(&out->inputs[i]);
+    }
+    free(out->iov);
+    free(out->zero_buf);
+    free(out->fill_buf);
+
+    ret = out->ops->close(out);
+    stats_end(stats, SPARSE_STATS_OUTPUT, start, 0);
+    trace_span("close", trace, 0);
+
+    return ret < 0 ? ret : end_ret;
 }
 
 static int output_file_init(struct output_file *out, int block_size,
-                            int64_t len, bool sparse, int chunks, bool crc)
+                            int64_t len, bool sparse, int chunks, bool crc, bool header)
 {
     int ret;
+    int i;
 
     out->len = len;
     out->block_size = block_size;
@@ -550,26 +1545,23 @@ static int output_file_init(struct output_file *out, int block_size,
     out->crc32 = 0;
     out->use_crc = crc;
 
+    for (i = 0; i < INPUT_CACHE_SIZE; i++) {
+        out->inputs[i].fd = -1;
+    }
+
     out->zero_buf = calloc(block_size, 1);
     if (!out->zero_buf) {
         error_errno("malloc zero_buf");
         return -ENOMEM;
     }
 
-    out->fill_buf = calloc(block_size, 1);
-    if (!out->fill_buf) {
-        error_errno("malloc fill_buf");
-        ret = -ENOMEM;
-        goto err_fill_buf;
-    }
-
     if (sparse) {
         out->sparse_ops = &sparse_file_ops;
     } else {
         out->sparse_ops = &normal_file_ops;
     }
 
-    if (sparse) {
+    if (sparse && header) {
         sparse_header_t sparse_header = {
             .magic = SPARSE_HEADER_MAGIC,
             .major_version = SPARSE_HEADER_MAJOR_VER,
@@ -577,7 +1569,7 @@ static int output_file_init(struct output_file *out, int block_size,
             .file_hdr_sz = SPARSE_HEADER_LEN,
             .chunk_hdr_sz = CHUNK_HEADER_LEN,
             .blk_sz = out->block_size,
-            .total_blks = out->len / out->block_size,
+            .total_blks = DIV_ROUND_UP(out->len, out->block_size),
             .total_chunks = chunks,
             .image_checksum = 0
         };
@@ -595,8 +1587,6 @@ static int output_file_init(struct output_file *out, int block_size,
     return 0;
 
  err_write:
-    free(out->fill_buf);
- err_fill_buf:
     free(out->zero_buf);
     return ret;
 }
@@ -627,6 +1617,68 @@ static struct output_file *output_file_new_normal(void)
     return &outn->out;
 }
 
+#ifndef USE_MINGW
+/*
+ * Returns NULL if fd is neither written with O_DIRECT nor through io_uring,
+ * in which case the plain file backend is used.
+ */
+static struct output_file *output_file_new_aio(int fd, bool direct)
+{
+    struct output_file_aio *outa;
+    struct stat st;
+    void *bufs;
+    int i;
+
+    if (fstat(fd, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+        return NULL;
+    }
+
+    outa = calloc(1, sizeof(struct output_file_aio));
+    if (!outa) {
+        return NULL;
+    }
+
+    outa->pos = lseek64(fd, 0, SEEK_CUR);
+    if (outa->pos < 0 ||
+        posix_memalign(&bufs, DIRECT_ALIGN, AIO_BUFS * AIO_BUF_SIZE + DIRECT_ALIGN)) {
+        free(outa);
+        return NULL;
+    }
+    outa->bufs = bufs;
+    outa->edge = outa->bufs + AIO_BUFS * AIO_BUF_SIZE;
+
+    for (i = 0; i < AIO_BUFS; i++) {
+        outa->free_bufs[i] = i;
+    }
+    outa->nr_free = AIO_BUFS;
+    outa->cur = -1;
+    outa->align = direct ? DIRECT_ALIGN : 1;
+    /* Nothing on a block device is known to be zero */
+    outa->size = S_ISREG(st.st_mode) ? st.st_size : INT64_MAX;
+    outa->sector = S_ISBLK(st.st_mode) ? device_sector_size(fd) : 0;
+    outa->data_end = outa->written_end = outa->pos;
+
+#ifdef HAVE_IO_URING
+    struct iovec iov[AIO_BUFS];
+
+    for (i = 0; i < AIO_BUFS; i++) {
+        iov[i].iov_base = outa->bufs + i * AIO_BUF_SIZE;
+        iov[i].iov_len = AIO_BUF_SIZE;
+    }
+    outa->ring = uring_new(AIO_BUFS, iov, AIO_BUFS);
+#endif
+    if (!outa->ring && !direct) {
+        free(outa->bufs);
+        free(outa);
+        return NULL;
+    }
+
+    outa->out.ops = &aio_file_ops;
+
+    return &outa->out;
+}
+#endif
+
 struct output_file *output_file_open_callback(int (*write) (void *, const void *, int),
                                               void *priv, unsigned int block_size, int64_t len,
                                               int gz __unused, int sparse, int chunks, int crc)
@@ -644,7 +1696,7 @@ struct output_file *output_file_open_callback(int (*write) (void *, const void *
     outc->priv = priv;
     outc->write = write;
 
-    ret = output_file_init(&outc->out, block_size, len, sparse, chunks, crc);
+    ret = output_file_init(&outc->out, block_size, len, sparse, chunks, crc, true);
     if (ret < 0) {
         free(outc);
         return NULL;
@@ -653,16 +1705,32 @@ struct output_file *output_file_open_callback(int (*write) (void *, const void *
     return &outc->out;
 }
 
-struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
-                                        int gz, int sparse, int chunks, int crc)
+static struct output_file *output_file_new_fd(int fd, bool gz)
 {
-    int ret;
     struct output_file *out;
 
     if (gz) {
         out = output_file_new_gz();
     } else {
-        out = output_file_new_normal();
+        out = NULL;
+#ifndef USE_MINGW
+        bool direct = false;
+#ifdef O_DIRECT
+        int flags = fcntl(fd, F_GETFL);
+
+        direct = flags >= 0 && (flags & O_DIRECT);
+#endif
+        out = output_file_new_aio(fd, direct);
+#ifdef O_DIRECT
+        /* Plain writes can't meet the O_DIRECT alignment rules */
+        if (!out && direct) {
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+        }
+#endif
+#endif
+        if (!out) {
+            out = output_file_new_normal();
+        }
     }
     if (!out) {
         return NULL;
@@ -670,96 +1738,400 @@ struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t
 
     out->ops->open(out, fd);
 
-    ret = output_file_init(out, block_size, len, sparse, chunks, crc);
-    if (ret < 0) {
+    return out;
+}
+
+static void output_file_free(struct output_file *out, bool gz)
+{
+    if (gz) {
         free(out);
+    } else {
+        out->ops->close(out);
+    }
+}
+
+struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
+                                        int gz, int sparse, int chunks, int crc)
+{
+    int ret;
+    struct output_file *out;
+
+    out = output_file_new_fd(fd, gz);
+    if (!out) {
+        return NULL;
+    }
+
+    ret = output_file_init(out, block_size, len, sparse, chunks, crc, true);
+    if (ret < 0) {
+        output_file_free(out, gz);
+        return NULL;
+    }
+
+    return out;
+}
+
+/*
+ * Continues the chunks of a sparse file at the current offset of fd, without
+ * writing a header.  A crc chunk, if requested, continues from crc32.
+ */
+struct output_file *output_file_append_fd(int fd, unsigned int block_size, int64_t len,
+                                          int crc, uint32_t crc32)
+{
+    int ret;
+    struct output_file *out;
+
+    out = output_file_new_fd(fd, false);
+    if (!out) {
         return NULL;
     }
 
+    ret = output_file_init(out, block_size, len, true, 0, crc, false);
+    if (ret < 0) {
+        output_file_free(out, false);
+        return NULL;
+    }
+    out->crc32 = crc32;
+
     return out;
 }
 
+/*
+ * Counts a chunk written since start, when the checksum time of out was
+ * crc_ns, and the time it took without the checksums computed meanwhile.
+ */
+static int output_stats(struct output_file *out, int ret, int type, uint64_t len,
+                        uint64_t start, uint64_t crc_ns)
+{
+    if (out->stats && ret >= 0) {
+        stats_chunk_out(out->stats, type, len);
+        stats_end(out->stats, SPARSE_STATS_OUTPUT, start, out->crc_ns - crc_ns);
+    }
+
+    return ret;
+}
+
 /* Write a contiguous region of data blocks from a memory buffer */
 int write_data_chunk(struct output_file *out, unsigned int len, void *data)
 {
-    return out->sparse_ops->write_data_chunk(out, len, data);
+    uint64_t start = stats_start(out->stats);
+    uint64_t crc_ns = out->crc_ns;
+    struct iovec iov = {
+        .iov_base = data,
+        .iov_len = len,
+    };
+    int ret;
+
+    ret = out->sparse_ops->write_data_chunk(out, len, &iov, 1);
+
+    return output_stats(out, ret, SPARSE_STATS_RAW, len, start, crc_ns);
+}
+
+/* Write a contiguous region of data blocks gathered from several buffers */
+int write_data_iov_chunk(struct output_file *out, unsigned int len,
+                         const struct iovec *iov, int iovcnt)
+{
+    uint64_t start = stats_start(out->stats);
+    uint64_t crc_ns = out->crc_ns;
+    int ret;
+
+    ret = out->sparse_ops->write_data_chunk(out, len, iov, iovcnt);
+
+    return output_stats(out, ret, SPARSE_STATS_RAW, len, start, crc_ns);
 }
 
 /* Write a contiguous region of data blocks with a fill value */
 int write_fill_chunk(struct output_file *out, unsigned int len, uint32_t fill_val)
 {
-    return out->sparse_ops->write_fill_chunk(out, len, fill_val);
+    uint64_t start = stats_start(out->stats);
+    uint64_t crc_ns = out->crc_ns;
+    int ret;
+
+    ret = out->sparse_ops->write_fill_chunk(out, len, fill_val);
+
+    return output_stats(out, ret, SPARSE_STATS_FILL, len, start, crc_ns);
 }
 
-int write_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t offset)
+/*
+ * Looks up an input in the cache, either an fd passed in by the caller or a
+ * file opened by the cache, evicting the least recently used input if
+ * needed.  The filename must stay valid until the output file is closed.
+ */
+static struct input_file *input_get(struct output_file *out, const char *filename, int fd)
 {
-    int ret;
+    struct input_file *in;
+    struct input_file *victim = &out->inputs[0];
+    int i;
+
+    for (i = 0; i < INPUT_CACHE_SIZE; i++) {
+        in = &out->inputs[i];
+        if (in->fd < 0) {
+            if (victim->fd >= 0) {
+                victim = in;
+            }
+            continue;
+        }
+        if (filename ? (in->filename &&
+                        (in->filename == filename || !strcmp(in->filename, filename)))
+                     : (!in->filename && in->fd == fd)) {
+            in->last_used = ++out->input_clock;
+            return in;
+        }
+        if (victim->fd >= 0 && in->last_used < victim->last_used) {
+            victim = in;
+        }
+    }
+
+    input_release(victim);
+
+    if (filename) {
+        fd = open(filename, O_RDONLY | O_BINARY);
+        if (fd < 0) {
+            return NULL;
+        }
+    }
+
+    victim->filename = filename;
+    victim->fd = fd;
+    victim->size = -1;
+    victim->last_used = ++out->input_clock;
+
+#ifndef USE_MINGW
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        victim->size = st.st_size;
+    }
+#endif
+
+    return victim;
+}
+
+#ifndef USE_MINGW
+/* Returns a pointer to [offset, offset + len) of an input, mapping it if needed */
+static char *input_map(struct output_file *out, struct input_file *in, int64_t offset,
+                       unsigned int len)
+{
+    int64_t page_size = sysconf(_SC_PAGESIZE);
     int64_t aligned_offset;
-    int aligned_diff;
-    uint64_t buffer_size;
+    uint64_t map_len;
+    char *map;
+
+    if (in->map && offset >= in->map_offset &&
+        (uint64_t)(offset - in->map_offset) + len <= in->map_len) {
+        return in->map + (offset - in->map_offset);
+    }
+
+    if (in->map) {
+        munmap(in->map, in->map_len);
+        in->map = NULL;
+    }
+
+    if (in->size > 0 && (uint64_t)in->size <= INPUT_MAP_WHOLE_MAX &&
+        offset + len <= in->size) {
+        aligned_offset = 0;
+        map_len = in->size;
+    } else {
+        aligned_offset = offset & ~(page_size - 1);
+        map_len = (uint64_t)len + (uint64_t)(offset - aligned_offset);
+        if (map_len < INPUT_MAP_WINDOW) {
+            map_len = INPUT_MAP_WINDOW;
+        }
+    }
+    if (map_len > SIZE_MAX) {
+        errno = E2BIG;
+        return NULL;
+    }
+
+    map = mmap64(NULL, map_len, PROT_READ, MAP_SHARED, in->fd, aligned_offset);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    stats_call(out->stats, SPARSE_STATS_SYS_MMAP, map_len);
+    madvise(map, map_len, MADV_SEQUENTIAL);
+
+    in->map = map;
+    in->map_offset = aligned_offset;
+    in->map_len = map_len;
+    in->advised = aligned_offset;
+    in->released = aligned_offset;
+
+    return in->map + (offset - in->map_offset);
+}
+
+/*
+ * Requests the part of the mapping following a chunk that ends at end,
+ * once the previous request is half consumed.
+ */
+static void input_readahead(struct input_file *in, int64_t end)
+{
+    int64_t page_size = sysconf(_SC_PAGESIZE);
+    int64_t map_end = in->map_offset + in->map_len;
+    int64_t start;
+    int64_t stop;
+
+    if (end + INPUT_READAHEAD / 2 < in->advised || in->advised >= map_end) {
+        return;
+    }
+
+    start = (end > in->advised ? end : in->advised) & ~(page_size - 1);
+    stop = min(end + INPUT_READAHEAD, map_end);
+    if (in->size > 0) {
+        stop = min(stop, in->size);
+    }
+    if (stop > start) {
+        madvise(in->map + (start - in->map_offset), stop - start, MADV_WILLNEED);
+    }
+    in->advised = end + INPUT_READAHEAD;
+}
+
+/* Gives back the pages of the mapping before start, once there are enough of them */
+static void input_release_before(struct input_file *in, int64_t start)
+{
+    int64_t page_size = sysconf(_SC_PAGESIZE);
+    int64_t end = start & ~(page_size - 1);
+
+    if (end - in->released < INPUT_READAHEAD) {
+        return;
+    }
+
+    madvise(in->map + (in->released - in->map_offset), end - in->released, MADV_DONTNEED);
+    in->released = end;
+}
+#endif
+
+/*
+ * Large data chunks that need no crc are copied from the input in the
+ * kernel, so that they can share extents with it.  The first output that
+ * can't copy turns copying off for the rest of the write.
+ */
+#define COPY_CHUNK_MIN (1024 * 1024)
+
+static int write_copy_chunk(struct output_file *out, struct input_file *in,
+                            unsigned int len, int64_t offset)
+{
+    chunk_header_t chunk_header;
+    bool sparse = out->sparse_ops == &sparse_file_ops;
+    int ret;
+
+    if (!out->ops->copy || out->no_copy || out->use_crc ||
+        len < COPY_CHUNK_MIN || len % out->block_size) {
+        return -EOPNOTSUPP;
+    }
+
+    chunk_header.chunk_type = CHUNK_TYPE_RAW;
+    chunk_header.reserved1 = 0;
+    chunk_header.chunk_sz = len / out->block_size;
+    chunk_header.total_sz = CHUNK_HEADER_LEN + len;
+
+    ret = out->ops->copy(out, &chunk_header, sparse ? sizeof(chunk_header) : 0,
+                         in->fd, offset, len);
+    if (ret == -EOPNOTSUPP) {
+        out->no_copy = true;
+        return ret;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (sparse) {
+        out->cur_out_ptr += len;
+        out->chunk_cnt++;
+    }
+
+    return 0;
+}
+
+static int write_input_chunk(struct output_file *out, struct input_file *in,
+                             unsigned int len, int64_t offset)
+{
+    struct iovec iov;
+    int ret;
     char *ptr;
 
-    aligned_offset = offset & ~(4096 - 1);
-    aligned_diff = offset - aligned_offset;
-    buffer_size = (uint64_t)len + (uint64_t)aligned_diff;
+    ret = write_copy_chunk(out, in, len, offset);
+    if (ret != -EOPNOTSUPP) {
+        return ret;
+    }
 
 #ifndef USE_MINGW
-    if (buffer_size > SIZE_MAX)
-        return -E2BIG;
-    char *data = mmap64(NULL, buffer_size, PROT_READ, MAP_SHARED, fd,
-                        aligned_offset);
-    if (data == MAP_FAILED) {
+    ptr = input_map(out, in, offset, len);
+    if (!ptr) {
         return -errno;
     }
-    ptr = data + aligned_diff;
+    input_readahead(in, offset + len);
+    if (out->stream) {
+        input_release_before(in, offset);
+    }
+
+    iov.iov_base = ptr;
+    iov.iov_len = len;
+    ret = out->sparse_ops->write_data_chunk(out, len, &iov, 1);
 #else
     off64_t pos;
     char *data = malloc(len);
     if (!data) {
         return -errno;
     }
-    pos = lseek64(fd, offset, SEEK_SET);
+    pos = lseek64(in->fd, offset, SEEK_SET);
     if (pos < 0) {
         free(data);
         return -errno;
     }
-    ret = read_all(fd, data, len);
+    stats_call(out->stats, SPARSE_STATS_SYS_LSEEK, 0);
+    ret = read_all(in->fd, data, len);
     if (ret < 0) {
         free(data);
         return ret;
     }
+    stats_call(out->stats, SPARSE_STATS_SYS_READ, len);
     ptr = data;
-#endif
 
-    ret = out->sparse_ops->write_data_chunk(out, len, ptr);
+    iov.iov_base = ptr;
+    iov.iov_len = len;
+    ret = out->sparse_ops->write_data_chunk(out, len, &iov, 1);
 
-#ifndef USE_MINGW
-    munmap(data, buffer_size);
-#else
     free(data);
 #endif
 
     return ret;
 }
 
+/* Write a contiguous region of data blocks from an fd */
+int write_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t offset)
+{
+    uint64_t start = stats_start(out->stats);
+    uint64_t crc_ns = out->crc_ns;
+    struct input_file *in = input_get(out, NULL, fd);
+    int ret;
+
+    ret = write_input_chunk(out, in, len, offset);
+
+    return output_stats(out, ret, SPARSE_STATS_RAW, len, start, crc_ns);
+}
+
 /* Write a contiguous region of data blocks from a file */
 int write_file_chunk(struct output_file *out, unsigned int len, const char *file, int64_t offset)
 {
+    uint64_t start = stats_start(out->stats);
+    uint64_t crc_ns = out->crc_ns;
+    struct input_file *in = input_get(out, file, -1);
     int ret;
 
-    int file_fd = open(file, O_RDONLY | O_BINARY);
-    if (file_fd < 0) {
+    if (!in) {
         return -errno;
     }
 
-    ret = write_fd_chunk(out, len, file_fd, offset);
-
-    close(file_fd);
+    ret = write_input_chunk(out, in, len, offset);
 
-    return ret;
+    return output_stats(out, ret, SPARSE_STATS_RAW, len, start, crc_ns);
 }
 
 int write_skip_chunk(struct output_file *out, int64_t len)
 {
-    return out->sparse_ops->write_skip_chunk(out, len);
+    uint64_t start = stats_start(out->stats);
+    int ret;
+
+    ret = out->sparse_ops->write_skip_chunk(out, len);
+
+    return output_stats(out, ret, SPARSE_STATS_DONT_CARE, len, start, out->crc_ns);
 }
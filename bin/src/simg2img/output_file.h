@@ -19,20 +19,30 @@
 
 #include <sparse/sparse.h>
 
+#include "defs.h"
+
 struct output_file;
 
 struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
                                         int gz, int sparse, int chunks, int crc);
+struct output_file *output_file_append_fd(int fd, unsigned int block_size, int64_t len,
+                                          int crc, uint32_t crc32);
 struct output_file *output_file_open_callback(int (*write) (void *, const void *, int),
                                               void *priv, unsigned int block_size, int64_t len,
                                               int gz, int sparse, int chunks, int crc);
 int write_data_chunk(struct output_file *out, unsigned int len, void *data);
+int write_data_iov_chunk(struct output_file *out, unsigned int len,
+                         const struct iovec *iov, int iovcnt);
 int write_fill_chunk(struct output_file *out, unsigned int len, uint32_t fill_val);
 int write_file_chunk(struct output_file *out, unsigned int len, const char *file, int64_t offset);
 int write_fd_chunk(struct output_file *out, unsigned int len, int fd, int64_t offset);
 int write_skip_chunk(struct output_file *out, int64_t len);
-void output_file_close(struct output_file *out);
+void output_file_discard(struct output_file *out);
+void output_file_stream(struct output_file *out);
+void output_file_stats(struct output_file *out, struct sparse_stats *stats);
+int output_file_close(struct output_file *out);
 
 int read_all(int fd, void *buf, size_t len);
+int copy_range(int in_fd, int64_t in_offset, int out_fd, int64_t out_offset, size_t len);
 
 #endif
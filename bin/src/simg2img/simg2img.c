@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include <sparse/sparse.h>
 
 #include <fcntl.h>
@@ -30,9 +31,62 @@
 #define O_BINARY 0
 #endif
 
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+#define PROGRESS_INTERVAL_MS 500
+
 void usage()
 {
-    fprintf(stderr, "Usage: simg2img <sparse_image_files> <raw_image_file>\n");
+    fprintf(stderr, "Usage: simg2img [-d] [-s] [-w chunks] [--stats] [--progress] <sparse_image_files> <raw_image_file>\n");
+    fprintf(stderr, "  -d          write the raw image with direct I/O, bypassing the page cache\n");
+    fprintf(stderr, "  -s          write the merged image as a sparse image\n");
+    fprintf(stderr, "  -w chunks   write out a single input every chunks chunks as it is read,\n"
+                    "              in memory that doesn't grow with the number of chunks\n");
+    fprintf(stderr, "  --stats     print statistics of the conversion to stderr as JSON\n");
+    fprintf(stderr, "  --progress  print the progress of each read and write to stderr\n");
+}
+
+/* Writes the inputs merged so far, each write starts over at offset 0 */
+static void write_merged(struct sparse_file *s, int out, bool sparse, bool progress)
+{
+    if (progress) {
+        sparse_file_progress(s, PROGRESS_INTERVAL_MS, sparse_progress_print, "write");
+    }
+
+    if (lseek(out, 0, SEEK_SET) == -1) {
+        perror("lseek failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sparse_file_write(s, out, false, sparse, false) < 0) {
+        fprintf(stderr, "Cannot write output file\n");
+        exit(-1);
+    }
+}
+
+/* Converts a single input as it is read, nothing is merged */
+static void convert(const char *file, int out, bool sparse, unsigned int window)
+{
+    int in;
+
+    if (strcmp(file, "-") == 0) {
+        in = STDIN_FILENO;
+    } else {
+        in = open(file, O_RDONLY | O_BINARY);
+        if (in < 0) {
+            fprintf(stderr, "Cannot open input file %s\n", file);
+            exit(-1);
+        }
+    }
+
+    if (sparse_file_convert(in, out, sparse, false, true, window) < 0) {
+        fprintf(stderr, "Failed to convert sparse file\n");
+        exit(-1);
+    }
+
+    close(in);
 }
 
 int main(int argc, char *argv[])
@@ -40,20 +94,71 @@ int main(int argc, char *argv[])
     int in;
     int out;
     int i;
+    int first = 1;
+    int flags = O_WRONLY;
+    int writes = 0;
+    bool sparse = false;
+    bool show_stats = false;
+    bool progress = false;
+    unsigned int window = 0;
+    static struct sparse_stats stats;
     struct sparse_file *s;
+    struct sparse_file *merged = NULL;
 
-    if (argc < 3) {
+    /* The pipeline scripts collect a timeline of the tools in TRACE_DIR */
+    if (sparse_trace_open(getenv("TRACE_DIR"), "simg2img") < 0) {
+        fprintf(stderr, "Cannot write trace to %s\n", getenv("TRACE_DIR"));
+    }
+
+    for (; first < argc - 1; first++) {
+        if (strcmp(argv[first], "-d") == 0) {
+            /* Partial blocks are read back, so the output must be readable */
+            flags = O_RDWR | O_DIRECT;
+        } else if (strcmp(argv[first], "-s") == 0) {
+            sparse = true;
+        } else if (strcmp(argv[first], "-w") == 0 && first < argc - 2) {
+            window = atoi(argv[++first]);
+            if (!window) {
+                usage();
+                exit(-1);
+            }
+        } else if (strcmp(argv[first], "--stats") == 0) {
+            show_stats = true;
+        } else if (strcmp(argv[first], "--progress") == 0) {
+            progress = true;
+        } else {
+            break;
+        }
+    }
+
+    if (argc < first + 2 || (window && argc != first + 2)) {
         usage();
         exit(-1);
     }
 
-    out = open(argv[argc - 1], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (show_stats) {
+        sparse_stats_default(&stats);
+    }
+    if (progress) {
+        sparse_progress_default(PROGRESS_INTERVAL_MS, sparse_progress_print, "read");
+    }
+
+    out = open(argv[argc - 1], flags | O_CREAT | O_TRUNC | O_BINARY, 0664);
     if (out < 0) {
         fprintf(stderr, "Cannot open output file %s\n", argv[argc - 1]);
         exit(-1);
     }
 
-    for (i = 1; i < argc - 1; i++) {
+    if (window) {
+        convert(argv[first], out, sparse, window);
+        close(out);
+        if (show_stats) {
+            sparse_stats_print(stderr, &stats);
+        }
+        exit(0);
+    }
+
+    for (i = first; i < argc - 1; i++) {
         if (strcmp(argv[i], "-") == 0) {
             in = STDIN_FILENO;
         } else {
@@ -70,20 +175,43 @@ int main(int argc, char *argv[])
             exit(-1);
         }
 
-        if (lseek(out, 0, SEEK_SET) == -1) {
-            perror("lseek failed");
-            exit(EXIT_FAILURE);
-        }
-
-        if (sparse_file_write(s, out, false, false, false) < 0) {
-            fprintf(stderr, "Cannot write output file\n");
+        /*
+         * Inputs are laid over each other, later ones winning, and written
+         * once.  The inputs stay open until then, their data is read at
+         * write time.  Only a change of block size forces an early write.
+         */
+        if (!merged) {
+            merged = s;
+        } else if (sparse_file_block_size(s) == sparse_file_block_size(merged)) {
+            if (sparse_file_overlay(merged, s) < 0) {
+                fprintf(stderr, "Failed to merge sparse file\n");
+                exit(-1);
+            }
+            sparse_file_destroy(s);
+        } else if (sparse) {
+            fprintf(stderr, "Cannot merge sparse files of different block sizes\n");
             exit(-1);
+        } else {
+            write_merged(merged, out, false, progress);
+            sparse_file_destroy(merged);
+            merged = s;
+            writes++;
         }
-        sparse_file_destroy(s);
-        close(in);
     }
 
+    /* A write over an earlier one must not discard what that wrote */
+    if (!writes) {
+        sparse_file_discard(merged);
+    }
+
+    write_merged(merged, out, sparse, progress);
+    sparse_file_destroy(merged);
+
     close(out);
 
+    if (show_stats) {
+        sparse_stats_print(stderr, &stats);
+    }
+
     exit(0);
 }
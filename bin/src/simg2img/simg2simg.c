@@ -19,6 +19,7 @@
 #define _GNU_SOURCE
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,22 +35,96 @@
 #define O_BINARY 0
 #endif
 
+#define PROGRESS_INTERVAL_MS 500
+
+/* Output pieces are written by up to MAX_WRITERS threads at once */
+#define MAX_WRITERS 8
+
+struct writer {
+    struct sparse_file **out_s;
+    int *fds;
+    int files;
+    int next;
+    int written;
+    int failed;
+    bool progress;
+    pthread_mutex_t lock;
+};
+
+static void *write_pieces(void *priv)
+{
+    struct writer *w = priv;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        i = w->next++;
+        pthread_mutex_unlock(&w->lock);
+        if (i >= w->files) {
+            break;
+        }
+
+        if (sparse_file_write(w->out_s[i], w->fds[i], false, true, false)) {
+            pthread_mutex_lock(&w->lock);
+            w->failed = 1;
+            pthread_mutex_unlock(&w->lock);
+        }
+
+        /* Pieces are written side by side, only their count is reported */
+        if (w->progress) {
+            pthread_mutex_lock(&w->lock);
+            w->written++;
+            fprintf(stderr, "\rwrite: %d of %d pieces%s", w->written, w->files,
+                    w->written == w->files ? "\n" : "");
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+
+    return NULL;
+}
+
 void usage()
 {
-    fprintf(stderr, "Usage: simg2simg <sparse image file> <sparse_image_file> <max_size>\n");
+    fprintf(stderr, "Usage: simg2simg [--stats] [--progress] <sparse image file> <sparse_image_file> <max_size>\n");
+    fprintf(stderr, "  --stats     print statistics of the conversion to stderr as JSON, with\n");
+    fprintf(stderr, "              the time of the writer threads added up\n");
+    fprintf(stderr, "  --progress  print the progress of the read and of the pieces written\n");
 }
 
 int main(int argc, char *argv[])
 {
     int in;
-    int out;
     int i;
     int ret;
     struct sparse_file *s;
     int64_t max_size;
     struct sparse_file **out_s;
+    int *fds;
     int files;
+    int threads;
+    long cpus;
+    pthread_t tids[MAX_WRITERS];
+    struct writer w;
     char filename[4096];
+    bool show_stats = false;
+    bool progress = false;
+    static struct sparse_stats stats;
+
+    if (sparse_trace_open(getenv("TRACE_DIR"), "simg2simg") < 0) {
+        fprintf(stderr, "Cannot write trace to %s\n", getenv("TRACE_DIR"));
+    }
+
+    for (; argc > 1; argv++, argc--) {
+        if (strcmp(argv[1], "--stats") == 0) {
+            show_stats = true;
+            sparse_stats_default(&stats);
+        } else if (strcmp(argv[1], "--progress") == 0) {
+            progress = true;
+            sparse_progress_default(PROGRESS_INTERVAL_MS, sparse_progress_print, "read");
+        } else {
+            break;
+        }
+    }
 
     if (argc != 4) {
         usage();
@@ -70,21 +145,19 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    files = sparse_file_resparse(s, max_size, NULL, 0);
+    files = sparse_file_resparse_all(s, max_size, &out_s);
     if (files < 0) {
         fprintf(stderr, "Failed to resparse\n");
         exit(-1);
     }
 
-    out_s = calloc(sizeof(struct sparse_file *), files);
-    if (!out_s) {
-        fprintf(stderr, "Failed to allocate sparse file array\n");
-        exit(-1);
+    for (i = 0; i < files; i++) {
+        sparse_file_progress(out_s[i], 0, NULL, NULL);
     }
 
-    files = sparse_file_resparse(s, max_size, out_s, files);
-    if (files < 0) {
-        fprintf(stderr, "Failed to resparse\n");
+    fds = calloc(sizeof(int), files);
+    if (!fds) {
+        fprintf(stderr, "Failed to allocate file descriptor array\n");
         exit(-1);
     }
 
@@ -95,21 +168,61 @@ int main(int argc, char *argv[])
             exit(-1);
         }
 
-        out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
-        if (out < 0) {
-            fprintf(stderr, "Cannot open output file %s\n", argv[2]);
+        fds[i] = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+        if (fds[i] < 0) {
+            fprintf(stderr, "Cannot open output file %s\n", filename);
             exit(-1);
         }
+    }
 
-        ret = sparse_file_write(out_s[i], out, false, true, false);
-        if (ret) {
-            fprintf(stderr, "Failed to write sparse file\n");
-            exit(-1);
+    /* The pieces only share the input, which is read through mmap */
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus < 1 ? 1 : cpus;
+    if (threads > MAX_WRITERS) {
+        threads = MAX_WRITERS;
+    }
+    if (threads > files) {
+        threads = files;
+    }
+
+    w.out_s = out_s;
+    w.fds = fds;
+    w.files = files;
+    w.next = 0;
+    w.written = 0;
+    w.failed = 0;
+    w.progress = progress;
+    pthread_mutex_init(&w.lock, NULL);
+
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, write_pieces, &w)) {
+            threads = i;
+            break;
         }
-        close(out);
+    }
+    write_pieces(&w);
+    for (i = 1; i < threads; i++) {
+        pthread_join(tids[i], NULL);
     }
 
+    if (w.failed) {
+        fprintf(stderr, "Failed to write sparse file\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < files; i++) {
+        close(fds[i]);
+        sparse_file_destroy(out_s[i]);
+    }
+    free(out_s);
+    free(fds);
+    sparse_file_destroy(s);
+
     close(in);
 
+    if (show_stats) {
+        sparse_stats_print(stderr, &stats);
+    }
+
     exit(0);
 }
@@ -0,0 +1,786 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sparse_format.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define lseek64 lseek
+#define pread64 pread
+#define off64_t off_t
+#endif
+
+/* Chunk data is hashed by up to MAX_HASHERS threads, HASH_BUF_SIZE at a time */
+#define MAX_HASHERS 16
+#define HASH_BUF_SIZE (1024 * 1024)
+
+/* Raw chunk sizes are counted in buckets of powers of two blocks */
+#define SIZE_BUCKETS 32
+
+struct chunk {
+    uint16_t type;
+    uint32_t blocks;            /* output blocks */
+    uint32_t data_sz;           /* input bytes following the header */
+    uint32_t value;             /* fill value or crc */
+    int64_t offset;             /* input offset of the data */
+    uint32_t block;             /* output offset in blocks */
+    char hash[41];
+};
+
+struct image {
+    const char *path;
+    int fd;
+    int64_t file_len;
+    sparse_header_t header;
+    struct chunk *chunks;
+    unsigned int nr_chunks;
+    bool bad;
+};
+
+struct type_stats {
+    const char *name;
+    uint16_t type;
+    uint64_t chunks;
+    uint64_t blocks;
+    uint64_t bytes;             /* input bytes, headers included */
+};
+
+/* SHA-1, for hashes that match the ones of simg_dump.py -s */
+struct sha1 {
+    uint32_t h[5];
+    uint64_t len;
+    unsigned char buf[64];
+    unsigned int buf_len;
+};
+
+#define rol32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_init(struct sha1 *c)
+{
+    c->h[0] = 0x67452301;
+    c->h[1] = 0xEFCDAB89;
+    c->h[2] = 0x98BADCFE;
+    c->h[3] = 0x10325476;
+    c->h[4] = 0xC3D2E1F0;
+    c->len = 0;
+    c->buf_len = 0;
+}
+
+/* Rounds are unrolled, with the message schedule kept in 16 rolling words */
+#define SHA1_W(i) \
+	(w[(i) & 15] = rol32(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ \
+			     w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+#define SHA1_R0(v, x, y, z, u, i) \
+	do { u += ((x & (y ^ z)) ^ z) + w[i] + 0x5A827999 + rol32(v, 5); x = rol32(x, 30); } while (0)
+#define SHA1_R1(v, x, y, z, u, i) \
+	do { u += ((x & (y ^ z)) ^ z) + SHA1_W(i) + 0x5A827999 + rol32(v, 5); x = rol32(x, 30); } while (0)
+#define SHA1_R2(v, x, y, z, u, i) \
+	do { u += (x ^ y ^ z) + SHA1_W(i) + 0x6ED9EBA1 + rol32(v, 5); x = rol32(x, 30); } while (0)
+#define SHA1_R3(v, x, y, z, u, i) \
+	do { u += (((x | y) & z) | (x & y)) + SHA1_W(i) + 0x8F1BBCDC + rol32(v, 5); x = rol32(x, 30); } while (0)
+#define SHA1_R4(v, x, y, z, u, i) \
+	do { u += (x ^ y ^ z) + SHA1_W(i) + 0xCA62C1D6 + rol32(v, 5); x = rol32(x, 30); } while (0)
+
+#define SHA1_5(R, i) \
+	do { \
+		R(a, b, c_, d, e, (i)); \
+		R(e, a, b, c_, d, (i) + 1); \
+		R(d, e, a, b, c_, (i) + 2); \
+		R(c_, d, e, a, b, (i) + 3); \
+		R(b, c_, d, e, a, (i) + 4); \
+	} while (0)
+
+static void sha1_block(struct sha1 *c, const unsigned char *p)
+{
+    uint32_t w[16];
+    uint32_t a, b, c_, d, e;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[i * 4] << 24 | (uint32_t) p[i * 4 + 1] << 16 |
+            (uint32_t) p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+
+    a = c->h[0];
+    b = c->h[1];
+    c_ = c->h[2];
+    d = c->h[3];
+    e = c->h[4];
+
+    SHA1_5(SHA1_R0, 0);
+    SHA1_5(SHA1_R0, 5);
+    SHA1_5(SHA1_R0, 10);
+    SHA1_R0(a, b, c_, d, e, 15);
+    SHA1_R1(e, a, b, c_, d, 16);
+    SHA1_R1(d, e, a, b, c_, 17);
+    SHA1_R1(c_, d, e, a, b, 18);
+    SHA1_R1(b, c_, d, e, a, 19);
+    SHA1_5(SHA1_R2, 20);
+    SHA1_5(SHA1_R2, 25);
+    SHA1_5(SHA1_R2, 30);
+    SHA1_5(SHA1_R2, 35);
+    SHA1_5(SHA1_R3, 40);
+    SHA1_5(SHA1_R3, 45);
+    SHA1_5(SHA1_R3, 50);
+    SHA1_5(SHA1_R3, 55);
+    SHA1_5(SHA1_R4, 60);
+    SHA1_5(SHA1_R4, 65);
+    SHA1_5(SHA1_R4, 70);
+    SHA1_5(SHA1_R4, 75);
+
+    c->h[0] += a;
+    c->h[1] += b;
+    c->h[2] += c_;
+    c->h[3] += d;
+    c->h[4] += e;
+}
+
+static void sha1_update(struct sha1 *c, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t n;
+
+    c->len += len;
+
+    if (c->buf_len) {
+        n = 64 - c->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(c->buf + c->buf_len, p, n);
+        c->buf_len += n;
+        p += n;
+        len -= n;
+        if (c->buf_len < 64)
+            return;
+        sha1_block(c, c->buf);
+        c->buf_len = 0;
+    }
+
+    for (; len >= 64; p += 64, len -= 64) {
+        sha1_block(c, p);
+    }
+
+    memcpy(c->buf, p, len);
+    c->buf_len = len;
+}
+
+static void sha1_final(struct sha1 *c, char *hex)
+{
+    uint64_t bits = c->len * 8;
+    unsigned char pad[72];
+    unsigned int n;
+    int i;
+
+    n = c->buf_len < 56 ? 56 - c->buf_len : 120 - c->buf_len;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++) {
+        pad[n + i] = bits >> (56 - 8 * i);
+    }
+    sha1_update(c, pad, n + 8);
+
+    for (i = 0; i < 5; i++) {
+        sprintf(hex + i * 8, "%08x", c->h[i]);
+    }
+}
+
+static const char *chunk_type_name(uint16_t type)
+{
+    switch (type) {
+    case CHUNK_TYPE_RAW:
+        return "raw";
+    case CHUNK_TYPE_FILL:
+        return "fill";
+    case CHUNK_TYPE_DONT_CARE:
+        return "dont_care";
+    case CHUNK_TYPE_CRC32:
+        return "crc32";
+    }
+    return "unknown";
+}
+
+/* Same descriptions as simg_dump.py */
+static void chunk_desc(const struct chunk *c, char *buf, size_t len)
+{
+    switch (c->type) {
+    case CHUNK_TYPE_RAW:
+        snprintf(buf, len, "Raw data");
+        break;
+    case CHUNK_TYPE_FILL:
+        snprintf(buf, len, "Fill with 0x%08X", c->value);
+        break;
+    case CHUNK_TYPE_DONT_CARE:
+        snprintf(buf, len, "Don't care");
+        break;
+    case CHUNK_TYPE_CRC32:
+        snprintf(buf, len, "Unverified CRC32 0x%08X", c->value);
+        break;
+    }
+}
+
+/* Reads the chunk headers of an image, data is skipped */
+static int read_chunks(struct image *img)
+{
+    sparse_header_t *hdr = &img->header;
+    chunk_header_t chunk_header;
+    struct chunk *c;
+    FILE *f;
+    int64_t offset;
+    uint32_t block = 0;
+    unsigned int i;
+
+    f = fdopen(dup(img->fd), "rb");
+    if (!f) {
+        fprintf(stderr, "%s: cannot open (%s)\n", img->path, strerror(errno));
+        return -1;
+    }
+
+    if (fseeko(f, 0, SEEK_SET) < 0 || fread(hdr, sizeof(*hdr), 1, f) != 1 ||
+        hdr->magic != SPARSE_HEADER_MAGIC) {
+        fprintf(stderr, "%s: not a sparse image\n", img->path);
+        fclose(f);
+        return -1;
+    }
+    if (hdr->major_version != 1 || hdr->file_hdr_sz < sizeof(sparse_header_t) ||
+        hdr->chunk_hdr_sz < sizeof(chunk_header_t)) {
+        fprintf(stderr, "%s: unsupported sparse image version %u.%u\n", img->path,
+                hdr->major_version, hdr->minor_version);
+        fclose(f);
+        return -1;
+    }
+
+    img->chunks = calloc(hdr->total_chunks, sizeof(struct chunk));
+    if (!img->chunks && hdr->total_chunks) {
+        fprintf(stderr, "%s: out of memory\n", img->path);
+        fclose(f);
+        return -1;
+    }
+
+    offset = hdr->file_hdr_sz;
+    for (i = 0; i < hdr->total_chunks; i++) {
+        if (fseeko(f, offset, SEEK_SET) < 0 ||
+            fread(&chunk_header, sizeof(chunk_header), 1, f) != 1) {
+            fprintf(stderr, "%s: chunk %u is truncated\n", img->path, i + 1);
+            img->bad = true;
+            break;
+        }
+
+        c = &img->chunks[i];
+        c->type = chunk_header.chunk_type;
+        c->blocks = chunk_header.chunk_sz;
+        c->offset = offset + hdr->chunk_hdr_sz;
+        c->data_sz = chunk_header.total_sz - hdr->chunk_hdr_sz;
+        c->block = block;
+
+        if (chunk_header.total_sz < hdr->chunk_hdr_sz) {
+            fprintf(stderr, "%s: chunk %u is smaller than its header\n", img->path, i + 1);
+            img->bad = true;
+            break;
+        }
+
+        switch (c->type) {
+        case CHUNK_TYPE_RAW:
+            if (c->data_sz != (uint64_t) c->blocks * hdr->blk_sz) {
+                fprintf(stderr, "%s: raw chunk input size (%u) does not match output size (%"
+                        PRIu64 ")\n", img->path, c->data_sz, (uint64_t) c->blocks * hdr->blk_sz);
+                img->bad = true;
+            }
+            break;
+        case CHUNK_TYPE_FILL:
+        case CHUNK_TYPE_CRC32:
+            if (c->data_sz != 4) {
+                fprintf(stderr, "%s: %s chunk should have 4 bytes of data, but this has %u\n",
+                        img->path, chunk_type_name(c->type), c->data_sz);
+                img->bad = true;
+            } else if (fseeko(f, c->offset, SEEK_SET) < 0 ||
+                       fread(&c->value, sizeof(c->value), 1, f) != 1) {
+                fprintf(stderr, "%s: chunk %u is truncated\n", img->path, i + 1);
+                img->bad = true;
+            }
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            if (c->data_sz != 0) {
+                fprintf(stderr, "%s: don't care chunk input size is non-zero (%u)\n",
+                        img->path, c->data_sz);
+                img->bad = true;
+            }
+            break;
+        default:
+            fprintf(stderr, "%s: unknown chunk type 0x%04X\n", img->path, c->type);
+            img->bad = true;
+        }
+        if (img->bad) {
+            break;
+        }
+
+        block += c->blocks;
+        offset += chunk_header.total_sz;
+    }
+    img->nr_chunks = i;
+
+    if (!img->bad && block != hdr->total_blks) {
+        fprintf(stderr, "%s: the header said we should have %u output blocks, but we saw %u\n",
+                img->path, hdr->total_blks, block);
+    }
+    if (!img->bad && offset < img->file_len) {
+        fprintf(stderr, "%s: there were %" PRId64 " bytes of extra data at the end of the file\n",
+                img->path, img->file_len - offset);
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+struct hasher {
+    struct image *img;
+    unsigned int next;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+static int hash_chunk(struct image *img, struct chunk *c, char *buf)
+{
+    struct sha1 ctx;
+    int64_t left;
+    int64_t pos;
+    ssize_t ret;
+    size_t n;
+    unsigned int i;
+
+    sha1_init(&ctx);
+
+    if (c->type == CHUNK_TYPE_RAW) {
+        pos = c->offset;
+        for (left = c->data_sz; left > 0; left -= ret, pos += ret) {
+            n = left < HASH_BUF_SIZE ? left : HASH_BUF_SIZE;
+            ret = pread64(img->fd, buf, n, pos);
+            if (ret <= 0) {
+                return -1;
+            }
+            sha1_update(&ctx, buf, ret);
+        }
+    } else if (c->type == CHUNK_TYPE_FILL) {
+        for (i = 0; i < img->header.blk_sz / 4; i++) {
+            memcpy(buf + i * 4, &c->value, 4);
+        }
+        for (i = 0; i < c->blocks; i++) {
+            sha1_update(&ctx, buf, img->header.blk_sz);
+        }
+    } else {
+        return 0;
+    }
+
+    sha1_final(&ctx, c->hash);
+
+    return 0;
+}
+
+static void *hash_chunks(void *priv)
+{
+    struct hasher *h = priv;
+    char *buf;
+    unsigned int i;
+
+    buf = malloc(HASH_BUF_SIZE > h->img->header.blk_sz ? HASH_BUF_SIZE : h->img->header.blk_sz);
+    if (!buf) {
+        h->failed = 1;
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&h->lock);
+        i = h->next++;
+        pthread_mutex_unlock(&h->lock);
+        if (i >= h->img->nr_chunks) {
+            break;
+        }
+
+        if (hash_chunk(h->img, &h->img->chunks[i], buf) < 0) {
+            pthread_mutex_lock(&h->lock);
+            h->failed = 1;
+            pthread_mutex_unlock(&h->lock);
+        }
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+static int hash_image(struct image *img, int threads)
+{
+    pthread_t tids[MAX_HASHERS];
+    struct hasher h;
+    int started;
+
+    h.img = img;
+    h.next = 0;
+    h.failed = 0;
+    pthread_mutex_init(&h.lock, NULL);
+
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, hash_chunks, &h)) {
+            break;
+        }
+    }
+    /* Without threads, hash in this one */
+    if (!started) {
+        hash_chunks(&h);
+    }
+    while (started > 0) {
+        pthread_join(tids[--started], NULL);
+    }
+
+    pthread_mutex_destroy(&h.lock);
+
+    return h.failed ? -1 : 0;
+}
+
+struct image_stats {
+    struct type_stats types[4];
+    uint64_t extents;           /* runs of chunks other than don't care */
+    uint64_t largest_extent;    /* in blocks */
+    uint64_t largest_hole;      /* in blocks */
+    uint64_t raw_min;
+    uint64_t raw_max;
+    uint64_t sizes[SIZE_BUCKETS];
+};
+
+static void image_stats(struct image *img, struct image_stats *st)
+{
+    static const uint16_t types[4] = {
+        CHUNK_TYPE_RAW, CHUNK_TYPE_FILL, CHUNK_TYPE_DONT_CARE, CHUNK_TYPE_CRC32
+    };
+    struct chunk *c;
+    uint64_t extent = 0;
+    unsigned int i, t, b;
+
+    memset(st, 0, sizeof(*st));
+    for (t = 0; t < 4; t++) {
+        st->types[t].type = types[t];
+        st->types[t].name = chunk_type_name(types[t]);
+    }
+
+    for (i = 0; i < img->nr_chunks; i++) {
+        c = &img->chunks[i];
+        for (t = 0; t < 4 && types[t] != c->type; t++) ;
+        st->types[t].chunks++;
+        st->types[t].blocks += c->blocks;
+        st->types[t].bytes += img->header.chunk_hdr_sz + c->data_sz;
+
+        if (c->type == CHUNK_TYPE_CRC32) {
+            continue;
+        }
+
+        if (c->type == CHUNK_TYPE_DONT_CARE) {
+            if (c->blocks > st->largest_hole) {
+                st->largest_hole = c->blocks;
+            }
+            extent = 0;
+            continue;
+        }
+
+        if (!extent) {
+            st->extents++;
+        }
+        extent += c->blocks;
+        if (extent > st->largest_extent) {
+            st->largest_extent = extent;
+        }
+
+        if (c->type == CHUNK_TYPE_RAW) {
+            if (!st->raw_min || c->blocks < st->raw_min) {
+                st->raw_min = c->blocks;
+            }
+            if (c->blocks > st->raw_max) {
+                st->raw_max = c->blocks;
+            }
+            for (b = 0; b < SIZE_BUCKETS - 1 && (2ULL << b) <= c->blocks; b++) ;
+            st->sizes[b]++;
+        }
+    }
+}
+
+static void print_text(struct image *img, struct image_stats *st, int verbose)
+{
+    sparse_header_t *hdr = &img->header;
+    struct type_stats *ts;
+    struct chunk *c;
+    char desc[64];
+    unsigned int i, b;
+
+    printf("%s: Total of %u %u-byte output blocks in %u input chunks.\n",
+           img->path, hdr->total_blks, hdr->blk_sz, hdr->total_chunks);
+    if (hdr->image_checksum) {
+        printf("checksum=0x%08X\n", hdr->image_checksum);
+    }
+
+    if (verbose) {
+        printf("            input_bytes      output_blocks\n");
+        printf("chunk    offset     number  offset  number\n");
+        for (i = 0; i < img->nr_chunks; i++) {
+            c = &img->chunks[i];
+            chunk_desc(c, desc, sizeof(desc));
+            printf("%4u %10" PRId64 " %10u %7u %7u %-18s %s\n", i + 1, c->offset, c->data_sz,
+                   c->block, c->blocks, desc, c->hash);
+        }
+    }
+
+    printf("type         chunks       blocks          bytes\n");
+    for (i = 0; i < 4; i++) {
+        ts = &st->types[i];
+        printf("%-9s %9" PRIu64 " %12" PRIu64 " %14" PRIu64 "\n", ts->name, ts->chunks,
+               ts->blocks, ts->bytes);
+    }
+    printf("data extents %" PRIu64 ", largest %" PRIu64 " blocks, largest hole %" PRIu64
+           " blocks\n", st->extents, st->largest_extent, st->largest_hole);
+    if (st->types[0].chunks) {
+        printf("raw chunks %" PRIu64 "-%" PRIu64 " blocks, mean %.1f\n", st->raw_min,
+               st->raw_max, (double)st->types[0].blocks / st->types[0].chunks);
+        for (b = 0; b < SIZE_BUCKETS; b++) {
+            if (st->sizes[b]) {
+                printf("  %10llu-%-10llu %9" PRIu64 "\n", 1ULL << b, (2ULL << b) - 1, st->sizes[b]);
+            }
+        }
+    }
+}
+
+static void print_json(struct image *img, struct image_stats *st, bool chunks)
+{
+    sparse_header_t *hdr = &img->header;
+    struct type_stats *ts;
+    struct chunk *c;
+    unsigned int i, b;
+    bool first;
+
+    printf("  {\n");
+    printf("    \"file\": \"");
+    for (i = 0; img->path[i]; i++) {
+        if (img->path[i] == '"' || img->path[i] == '\\') {
+            putchar('\\');
+        }
+        putchar(img->path[i]);
+    }
+    printf("\",\n");
+    printf("    \"valid\": %s,\n", img->bad ? "false" : "true");
+    printf("    \"file_bytes\": %" PRId64 ",\n", img->file_len);
+    printf("    \"block_size\": %u,\n", hdr->blk_sz);
+    printf("    \"total_blocks\": %u,\n", hdr->total_blks);
+    printf("    \"total_chunks\": %u,\n", hdr->total_chunks);
+    printf("    \"image_checksum\": %u,\n", hdr->image_checksum);
+    printf("    \"output_bytes\": %" PRIu64 ",\n", (uint64_t) hdr->total_blks * hdr->blk_sz);
+    printf("    \"types\": {\n");
+    for (i = 0; i < 4; i++) {
+        ts = &st->types[i];
+        printf("      \"%s\": { \"chunks\": %" PRIu64 ", \"blocks\": %" PRIu64
+               ", \"output_bytes\": %" PRIu64 ", \"input_bytes\": %" PRIu64 " }%s\n",
+               ts->name, ts->chunks, ts->blocks, ts->blocks * hdr->blk_sz, ts->bytes,
+               i < 3 ? "," : "");
+    }
+    printf("    },\n");
+    printf("    \"fragmentation\": {\n");
+    printf("      \"data_extents\": %" PRIu64 ",\n", st->extents);
+    printf("      \"largest_extent_blocks\": %" PRIu64 ",\n", st->largest_extent);
+    printf("      \"largest_hole_blocks\": %" PRIu64 ",\n", st->largest_hole);
+    printf("      \"raw_min_blocks\": %" PRIu64 ",\n", st->raw_min);
+    printf("      \"raw_max_blocks\": %" PRIu64 ",\n", st->raw_max);
+    printf("      \"raw_mean_blocks\": %.1f,\n",
+           st->types[0].chunks ? (double)st->types[0].blocks / st->types[0].chunks : 0.0);
+    printf("      \"raw_size_histogram\": [");
+    first = true;
+    for (b = 0; b < SIZE_BUCKETS; b++) {
+        if (st->sizes[b]) {
+            printf("%s\n        { \"min_blocks\": %llu, \"max_blocks\": %llu, \"chunks\": %"
+                   PRIu64 " }", first ? "" : ",", 1ULL << b, (2ULL << b) - 1, st->sizes[b]);
+            first = false;
+        }
+    }
+    printf("%s]\n", first ? "" : "\n      ");
+    printf("    }%s\n", chunks ? "," : "");
+
+    if (chunks) {
+        printf("    \"chunks\": [");
+        for (i = 0; i < img->nr_chunks; i++) {
+            c = &img->chunks[i];
+            printf("%s\n      { \"type\": \"%s\", \"input_offset\": %" PRId64
+                   ", \"input_bytes\": %u, \"output_block\": %u, \"output_blocks\": %u",
+                   i ? "," : "", chunk_type_name(c->type), c->offset, c->data_sz, c->block,
+                   c->blocks);
+            if (c->type == CHUNK_TYPE_FILL || c->type == CHUNK_TYPE_CRC32) {
+                printf(", \"value\": %u", c->value);
+            }
+            if (c->hash[0]) {
+                printf(", \"sha1\": \"%s\"", c->hash);
+            }
+            printf(" }");
+        }
+        printf("%s]\n", img->nr_chunks ? "\n    " : "");
+    }
+
+    printf("  }");
+}
+
+static void print_csv(FILE *csv, struct image *img)
+{
+    struct chunk *c;
+    char desc[64];
+    unsigned int i;
+
+    fprintf(csv, "chunk,input offset,input bytes,output offset,output blocks,type,hash\r\n");
+    for (i = 0; i < img->nr_chunks; i++) {
+        c = &img->chunks[i];
+        chunk_desc(c, desc, sizeof(desc));
+        fprintf(csv, "%u,%" PRId64 ",%u,%u,%u,%s,%s\r\n", i + 1, c->offset, c->data_sz,
+                c->block, c->blocks, desc, c->hash);
+    }
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage: simginfo [-v] [-s] [-j] [-c <csv_file>] [-t <threads>] "
+            "<sparse_image_file> ...\n");
+    fprintf(stderr, "  -v  list every chunk\n");
+    fprintf(stderr, "  -s  show sha1sum of data and fill chunks\n");
+    fprintf(stderr, "  -j  print JSON instead of text\n");
+    fprintf(stderr, "  -c  save .csv file of chunks\n");
+    fprintf(stderr, "  -t  hash with this many threads (default: one per CPU)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct image_stats st;
+    struct image img;
+    FILE *csv = NULL;
+    bool verbose = false;
+    bool hash = false;
+    bool json = false;
+    int threads;
+    int failed = 0;
+    int printed = 0;
+    int opt;
+    int i;
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "vsjc:t:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        case 's':
+            hash = true;
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'c':
+            csv = fopen(optarg, "w");
+            if (!csv) {
+                fprintf(stderr, "Cannot open csv file %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        exit(-1);
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > MAX_HASHERS) {
+        threads = MAX_HASHERS;
+    }
+
+    if (json) {
+        printf("[\n");
+    }
+
+    for (i = optind; i < argc; i++) {
+        memset(&img, 0, sizeof(img));
+        img.path = argv[i];
+        img.fd = open(img.path, O_RDONLY | O_BINARY);
+        if (img.fd < 0) {
+            fprintf(stderr, "Cannot open input file %s\n", img.path);
+            failed = 1;
+            continue;
+        }
+        img.file_len = lseek64(img.fd, 0, SEEK_END);
+
+        if (read_chunks(&img) < 0) {
+            close(img.fd);
+            failed = 1;
+            continue;
+        }
+        if (img.bad) {
+            failed = 1;
+        }
+
+        if (hash && hash_image(&img, threads) < 0) {
+            fprintf(stderr, "%s: failed to read chunk data\n", img.path);
+            failed = 1;
+        }
+
+        image_stats(&img, &st);
+        if (json) {
+            printf("%s", printed++ ? ",\n" : "");
+            print_json(&img, &st, verbose || hash);
+        } else {
+            print_text(&img, &st, verbose);
+        }
+        if (csv) {
+            print_csv(csv, &img);
+        }
+
+        free(img.chunks);
+        close(img.fd);
+    }
+
+    if (json) {
+        printf("%s]\n", printed ? "\n" : "");
+    }
+    if (csv) {
+        fclose(csv);
+    }
+
+    exit(failed ? -1 : 0);
+}
@@ -0,0 +1,1013 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#if defined(__APPLE__) && defined(__MACH__)
+#include <libkern/OSByteOrder.h>
+#define htobe16 OSSwapHostToBigInt16
+#define htobe32 OSSwapHostToBigInt32
+#define htobe64 OSSwapHostToBigInt64
+#define be16toh OSSwapBigToHostInt16
+#define be32toh OSSwapBigToHostInt32
+#define be64toh OSSwapBigToHostInt64
+#define lseek64 lseek
+#define off64_t off_t
+#define pread64 pread
+#define pwrite64 pwrite
+#define fdatasync fsync
+#else
+#include <endian.h>
+#endif
+
+#include <sparse/sparse.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define PROGRESS_INTERVAL_MS 500
+
+/*
+ * Writes to the image go to an overlay file instead, one block at a time.
+ * The overlay starts with a header and a bitmap of the blocks written,
+ * and holds block n at data_offset + n * block_size, so that blocks never
+ * written stay holes.  A partial write of a block copies the rest of the
+ * block from the image first.  The bitmap on disk is only updated on a
+ * flush, a FUA write or a disconnect, once the blocks it marks are synced,
+ * so an overlay cut short by a crash loses the writes since the last flush
+ * and never marks a block whose data didn't reach the disk.
+ */
+#define OVERLAY_MAGIC 0x4f564c31        /* "OVL1" */
+#define OVERLAY_BITMAP_OFFSET 64
+#define OVERLAY_ALIGN 4096
+
+struct overlay_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t len;               /* length of the image */
+    uint64_t data_offset;
+};
+
+struct overlay {
+    int fd;
+    struct overlay_header header;
+    uint8_t *bitmap;
+    unsigned int blocks;
+    bool unsynced;              /* bytes [sync_first, sync_last] of the bitmap are newer than on disk */
+    unsigned int sync_first;
+    unsigned int sync_last;
+};
+
+/* The newstyle NBD protocol, see doc/proto.md in the nbd project */
+#define NBD_MAGIC 0x4e42444d41474943ULL /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC 0x49484156454F5054ULL    /* "IHAVEOPT" */
+#define NBD_REP_MAGIC 0x3e889045565a9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_READ_ONLY (1 << 1)
+#define NBD_FLAG_SEND_FLUSH (1 << 2)
+#define NBD_FLAG_SEND_FUA (1 << 3)
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_ERR_INVALID 0x80000003
+
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+
+#define NBD_CMD_FLAG_FUA (1 << 0)
+
+#define NBD_EPERM 1
+#define NBD_EIO 5
+#define NBD_EINVAL 22
+
+#define NBD_MAX_REQUEST (32 * 1024 * 1024)
+
+struct nbd_request {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t len;
+} __attribute__ ((packed));
+
+struct nbd_reply {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t handle;
+} __attribute__ ((packed));
+
+struct nbd_option_reply {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t type;
+    uint32_t len;
+} __attribute__ ((packed));
+
+struct export {
+    struct sparse_file *s;
+    struct overlay *ov;
+    int64_t len;
+    unsigned int block_size;
+    bool read_only;
+    char *buf;                  /* a request's data */
+    char *block;                /* a block being partially written */
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: simgnbd serve [-r] (-u <socket> | -p <port>) <sparse_image> <overlay>\n");
+    fprintf(stderr, "       simgnbd commit [--progress] <sparse_image> <overlay> <new_sparse_image>\n");
+    fprintf(stderr, "  serve   exports the image over NBD, writes go to the overlay, which is\n"
+                    "          created if needed.  -r exports it read-only, -u listens on a unix\n"
+                    "          socket and -p on a TCP port of localhost\n");
+    fprintf(stderr, "  commit  writes the image with the blocks written to the overlay as a new\n"
+                    "          sparse image\n");
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = read(fd, p, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = write(fd, p, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t len, int64_t offset)
+{
+    char *p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = pread64(fd, p, len, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            /* Past the end of a truncated overlay */
+            memset(p, 0, len);
+            break;
+        }
+        p += ret;
+        offset += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, int64_t offset)
+{
+    const char *p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite64(fd, p, len, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        offset += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static void put16(char *p, uint16_t v)
+{
+    v = htobe16(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put32(char *p, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put64(char *p, uint64_t v)
+{
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get32(const char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static uint16_t get16(const char *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return be16toh(v);
+}
+
+static struct sparse_file *read_image(const char *path, int *fd)
+{
+    struct sparse_file *s;
+
+    *fd = open(path, O_RDONLY | O_BINARY);
+    if (*fd < 0) {
+        fprintf(stderr, "Cannot open sparse image %s\n", path);
+        return NULL;
+    }
+
+    s = sparse_file_import(*fd, true, false);
+    if (!s) {
+        fprintf(stderr, "Failed to read sparse image %s\n", path);
+        close(*fd);
+    }
+
+    return s;
+}
+
+static bool overlay_dirty(struct overlay *ov, unsigned int block)
+{
+    return ov->bitmap[block / 8] & (1 << (block % 8));
+}
+
+/*
+ * Opens an overlay of s, creating it if it is new or empty.  Without a path
+ * the overlay is empty and stays in memory.
+ */
+static struct overlay *overlay_open(const char *path, struct sparse_file *s, bool create)
+{
+    struct overlay *ov;
+    struct stat st;
+    unsigned int block_size = sparse_file_block_size(s);
+    int64_t len = sparse_file_len(s, false, false);
+    size_t bitmap_len;
+
+    ov = calloc(1, sizeof(*ov));
+    if (!ov) {
+        return NULL;
+    }
+
+    ov->blocks = (len + block_size - 1) / block_size;
+    bitmap_len = (ov->blocks + 7) / 8;
+    ov->bitmap = calloc(1, bitmap_len ? bitmap_len : 1);
+    if (!ov->bitmap) {
+        free(ov);
+        return NULL;
+    }
+
+    ov->fd = -1;
+    if (!path) {
+        return ov;
+    }
+
+    ov->fd = open(path, (create ? O_RDWR | O_CREAT : O_RDONLY) | O_BINARY, 0664);
+    if (ov->fd < 0 || fstat(ov->fd, &st) < 0) {
+        fprintf(stderr, "Cannot open overlay %s\n", path);
+        goto err;
+    }
+
+    if (st.st_size == 0 && create) {
+        ov->header.magic = OVERLAY_MAGIC;
+        ov->header.block_size = block_size;
+        ov->header.len = len;
+        ov->header.data_offset = (OVERLAY_BITMAP_OFFSET + bitmap_len + OVERLAY_ALIGN - 1) /
+            OVERLAY_ALIGN * OVERLAY_ALIGN;
+        if (pwrite_full(ov->fd, &ov->header, sizeof(ov->header), 0) < 0 ||
+            ftruncate(ov->fd, ov->header.data_offset + (int64_t) ov->blocks * block_size) < 0) {
+            fprintf(stderr, "Cannot create overlay %s: %s\n", path, strerror(errno));
+            goto err;
+        }
+        return ov;
+    }
+
+    if (pread_full(ov->fd, &ov->header, sizeof(ov->header), 0) < 0 ||
+        ov->header.magic != OVERLAY_MAGIC) {
+        fprintf(stderr, "%s is not an overlay\n", path);
+        goto err;
+    }
+
+    if (ov->header.block_size != block_size || ov->header.len != (uint64_t)len) {
+        fprintf(stderr, "Overlay %s was made for another image\n", path);
+        goto err;
+    }
+
+    if (pread_full(ov->fd, ov->bitmap, bitmap_len, OVERLAY_BITMAP_OFFSET) < 0) {
+        fprintf(stderr, "Cannot read overlay %s\n", path);
+        goto err;
+    }
+
+    return ov;
+
+  err:
+    if (ov->fd >= 0) {
+        close(ov->fd);
+    }
+    free(ov->bitmap);
+    free(ov);
+    return NULL;
+}
+
+static void overlay_close(struct overlay *ov)
+{
+    if (ov->fd >= 0) {
+        close(ov->fd);
+    }
+    free(ov->bitmap);
+    free(ov);
+}
+
+/* Marks blocks [first, last] as written, on disk at the next sync */
+static void overlay_mark(struct overlay *ov, unsigned int first, unsigned int last)
+{
+    unsigned int i;
+
+    for (i = first; i <= last; i++) {
+        ov->bitmap[i / 8] |= 1 << (i % 8);
+    }
+
+    if (!ov->unsynced || first / 8 < ov->sync_first) {
+        ov->sync_first = first / 8;
+    }
+    if (!ov->unsynced || last / 8 > ov->sync_last) {
+        ov->sync_last = last / 8;
+    }
+    ov->unsynced = true;
+}
+
+/* Syncs the written blocks, then the part of the bitmap marking them */
+static int overlay_sync(struct overlay *ov)
+{
+    if (fdatasync(ov->fd) < 0) {
+        return -1;
+    }
+
+    if (!ov->unsynced) {
+        return 0;
+    }
+
+    if (pwrite_full(ov->fd, ov->bitmap + ov->sync_first, ov->sync_last - ov->sync_first + 1,
+                    OVERLAY_BITMAP_OFFSET + ov->sync_first) < 0 || fdatasync(ov->fd) < 0) {
+        return -1;
+    }
+    ov->unsynced = false;
+
+    return 0;
+}
+
+static int export_read(struct export *e, char *buf, uint32_t len, uint64_t offset)
+{
+    struct overlay *ov = e->ov;
+    unsigned int block;
+    bool dirty;
+    uint32_t n;
+    uint64_t end;
+    int ret;
+
+    /* Runs of blocks in the overlay or in the image are read in one go */
+    while (len) {
+        block = offset / e->block_size;
+        dirty = overlay_dirty(ov, block);
+        end = (uint64_t) (block + 1) * e->block_size;
+        while (end < offset + len && overlay_dirty(ov, end / e->block_size) == dirty) {
+            end += e->block_size;
+        }
+        n = (end < offset + len ? end : offset + len) - offset;
+
+        if (dirty) {
+            ret = pread_full(ov->fd, buf, n, ov->header.data_offset + offset);
+        } else {
+            ret = sparse_file_pread(e->s, buf, n, offset);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int export_write(struct export *e, const char *buf, uint32_t len, uint64_t offset)
+{
+    struct overlay *ov = e->ov;
+    unsigned int first = offset / e->block_size;
+    unsigned int last = (offset + len - 1) / e->block_size;
+    unsigned int block;
+    uint64_t start;
+    uint32_t n;
+
+    while (len) {
+        block = offset / e->block_size;
+        start = (uint64_t) block *e->block_size;
+        n = start + e->block_size - offset;
+        if (n > len) {
+            n = len;
+        }
+
+        if (n < e->block_size && !overlay_dirty(ov, block)) {
+            /* The rest of the block comes from the image */
+            if (export_read(e, e->block, e->block_size, start) < 0) {
+                return -1;
+            }
+            memcpy(e->block + (offset - start), buf, n);
+            if (pwrite_full(ov->fd, e->block, e->block_size, ov->header.data_offset + start) < 0) {
+                return -1;
+            }
+        } else if (n < e->block_size) {
+            if (pwrite_full(ov->fd, buf, n, ov->header.data_offset + offset) < 0) {
+                return -1;
+            }
+        } else {
+            /* Whole blocks in the middle go out together */
+            n = (len / e->block_size) * e->block_size;
+            if (pwrite_full(ov->fd, buf, n, ov->header.data_offset + offset) < 0) {
+                return -1;
+            }
+        }
+
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+
+    overlay_mark(ov, first, last);
+
+    return 0;
+}
+
+static int send_option_reply(int sock, uint32_t option, uint32_t type, const void *data,
+                             uint32_t len)
+{
+    struct nbd_option_reply reply = {
+        .magic = htobe64(NBD_REP_MAGIC),
+        .option = htobe32(option),
+        .type = htobe32(type),
+        .len = htobe32(len),
+    };
+
+    if (write_full(sock, &reply, sizeof(reply)) < 0) {
+        return -1;
+    }
+
+    return len ? write_full(sock, data, len) : 0;
+}
+
+static uint16_t transmission_flags(struct export *e)
+{
+    return NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | (e->read_only ? NBD_FLAG_READ_ONLY : 0);
+}
+
+/*
+ * Answers NBD_OPT_INFO and NBD_OPT_GO, whose data is a name and a list of
+ * info requests.  Returns 1 if the export was described, 0 if the option
+ * was refused, or -1 if the client is gone.
+ */
+static int send_info(int sock, struct export *e, uint32_t option, const char *data, uint32_t len)
+{
+    char info[14];
+    uint32_t name_len;
+    uint16_t requests;
+    bool block_size = false;
+    unsigned int i;
+
+    name_len = len >= 6 ? get32(data) : 0;
+    if (len < 6 || name_len > len - 6 || 6 + name_len + 2 * get16(data + 4 + name_len) != len) {
+        return send_option_reply(sock, option, NBD_REP_ERR_INVALID, NULL, 0) < 0 ? -1 : 0;
+    }
+
+    requests = get16(data + 4 + name_len);
+    for (i = 0; i < requests; i++) {
+        if (get16(data + 6 + name_len + 2 * i) == NBD_INFO_BLOCK_SIZE) {
+            block_size = true;
+        }
+    }
+
+    /* There is a single export, whatever its name */
+    put16(info, NBD_INFO_EXPORT);
+    put64(info + 2, e->len);
+    put16(info + 10, transmission_flags(e));
+    if (send_option_reply(sock, option, NBD_REP_INFO, info, 12) < 0) {
+        return -1;
+    }
+
+    if (block_size) {
+        put16(info, NBD_INFO_BLOCK_SIZE);
+        put32(info + 2, 1);
+        put32(info + 6, e->block_size);
+        put32(info + 10, NBD_MAX_REQUEST);
+        if (send_option_reply(sock, option, NBD_REP_INFO, info, 14) < 0) {
+            return -1;
+        }
+    }
+
+    return send_option_reply(sock, option, NBD_REP_ACK, NULL, 0) < 0 ? -1 : 1;
+}
+
+/* Returns 1 when the client is ready for transmission, 0 or -1 when it is done */
+static int negotiate(int sock, struct export *e)
+{
+    struct {
+        uint64_t magic;
+        uint64_t opts_magic;
+        uint16_t flags;
+    } __attribute__ ((packed)) hello = {
+        .magic = htobe64(NBD_MAGIC),
+        .opts_magic = htobe64(NBD_OPTS_MAGIC),
+        .flags = htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES),
+    };
+    struct {
+        uint64_t magic;
+        uint32_t option;
+        uint32_t len;
+    } __attribute__ ((packed)) opt;
+    struct {
+        uint64_t len;
+        uint16_t flags;
+        char zeroes[124];
+    } __attribute__ ((packed)) export_reply;
+    uint32_t client_flags;
+    uint32_t len;
+    char *data;
+    int ret;
+
+    if (write_full(sock, &hello, sizeof(hello)) < 0 ||
+        read_full(sock, &client_flags, sizeof(client_flags)) < 0) {
+        return -1;
+    }
+    client_flags = be32toh(client_flags);
+
+    for (;;) {
+        if (read_full(sock, &opt, sizeof(opt)) < 0 || be64toh(opt.magic) != NBD_OPTS_MAGIC) {
+            return -1;
+        }
+
+        len = be32toh(opt.len);
+        if (len > 4096) {
+            return -1;
+        }
+        data = malloc(len + 1);
+        if (!data || read_full(sock, data, len) < 0) {
+            free(data);
+            return -1;
+        }
+
+        switch (be32toh(opt.option)) {
+        case NBD_OPT_EXPORT_NAME:
+            free(data);
+            memset(&export_reply, 0, sizeof(export_reply));
+            export_reply.len = htobe64(e->len);
+            export_reply.flags = htobe16(transmission_flags(e));
+            if (write_full(sock, &export_reply, (client_flags & NBD_FLAG_NO_ZEROES) ?
+                           10 : sizeof(export_reply)) < 0) {
+                return -1;
+            }
+            return 1;
+        case NBD_OPT_ABORT:
+            free(data);
+            send_option_reply(sock, NBD_OPT_ABORT, NBD_REP_ACK, NULL, 0);
+            return 0;
+        case NBD_OPT_LIST:
+            free(data);
+            len = 0;
+            ret = send_option_reply(sock, NBD_OPT_LIST, NBD_REP_SERVER, &len, sizeof(len));
+            if (ret == 0) {
+                ret = send_option_reply(sock, NBD_OPT_LIST, NBD_REP_ACK, NULL, 0);
+            }
+            break;
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            ret = send_info(sock, e, be32toh(opt.option), data, len);
+            free(data);
+            if (ret > 0 && be32toh(opt.option) == NBD_OPT_GO) {
+                return 1;
+            }
+            break;
+        default:
+            free(data);
+            ret = send_option_reply(sock, be32toh(opt.option), NBD_REP_ERR_UNSUP, NULL, 0);
+            break;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+    }
+}
+
+static int send_reply(int sock, uint64_t handle, uint32_t error, const void *data, uint32_t len)
+{
+    struct nbd_reply reply = {
+        .magic = htobe32(NBD_SIMPLE_REPLY_MAGIC),
+        .error = htobe32(error),
+        .handle = handle,
+    };
+
+    if (write_full(sock, &reply, sizeof(reply)) < 0) {
+        return -1;
+    }
+
+    return len ? write_full(sock, data, len) : 0;
+}
+
+/* Serves the requests of a client until it disconnects */
+static void transmit(int sock, struct export *e)
+{
+    struct nbd_request req;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t error;
+
+    while (read_full(sock, &req, sizeof(req)) == 0 && be32toh(req.magic) == NBD_REQUEST_MAGIC) {
+        offset = be64toh(req.offset);
+        len = be32toh(req.len);
+        error = 0;
+
+        if ((be16toh(req.type) == NBD_CMD_READ || be16toh(req.type) == NBD_CMD_WRITE) &&
+            (len > NBD_MAX_REQUEST || offset > (uint64_t) e->len || len > e->len - offset)) {
+            /* The data of a write can't be skipped safely, drop the client */
+            if (be16toh(req.type) == NBD_CMD_WRITE) {
+                return;
+            }
+            send_reply(sock, req.handle, NBD_EINVAL, NULL, 0);
+            continue;
+        }
+
+        switch (be16toh(req.type)) {
+        case NBD_CMD_READ:
+            if (export_read(e, e->buf, len, offset) < 0) {
+                error = NBD_EIO;
+            }
+            if (send_reply(sock, req.handle, error, e->buf, error ? 0 : len) < 0) {
+                return;
+            }
+            break;
+        case NBD_CMD_WRITE:
+            if (read_full(sock, e->buf, len) < 0) {
+                return;
+            }
+            if (e->read_only) {
+                error = NBD_EPERM;
+            } else if ((len && export_write(e, e->buf, len, offset) < 0) ||
+                       ((be16toh(req.flags) & NBD_CMD_FLAG_FUA) && overlay_sync(e->ov) < 0)) {
+                error = NBD_EIO;
+            }
+            if (send_reply(sock, req.handle, error, NULL, 0) < 0) {
+                return;
+            }
+            break;
+        case NBD_CMD_FLUSH:
+            if (!e->read_only && overlay_sync(e->ov) < 0) {
+                error = NBD_EIO;
+            }
+            if (send_reply(sock, req.handle, error, NULL, 0) < 0) {
+                return;
+            }
+            break;
+        case NBD_CMD_DISC:
+            return;
+        default:
+            if (send_reply(sock, req.handle, NBD_EINVAL, NULL, 0) < 0) {
+                return;
+            }
+            break;
+        }
+    }
+}
+
+static int listen_on(const char *socket_path, int port)
+{
+    struct sockaddr_un sun;
+    struct sockaddr_in sin;
+    int one = 1;
+    int sock;
+
+    if (socket_path) {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(socket_path) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, socket_path);
+        unlink(socket_path);
+
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0 || bind(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            return -1;
+        }
+    } else {
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            return -1;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            return -1;
+        }
+    }
+
+    if (listen(sock, 1) < 0) {
+        return -1;
+    }
+
+    return sock;
+}
+
+static int nbd_serve(int argc, char *argv[])
+{
+    struct export e = { 0 };
+    const char *socket_path = NULL;
+    const char *overlay;
+    int port = 0;
+    int image;
+    int sock;
+    int client;
+    int i;
+
+    for (i = 2; i < argc - 2; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            e.read_only = true;
+        } else if (strcmp(argv[i], "-u") == 0 && i < argc - 3) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i < argc - 3) {
+            port = atoi(argv[++i]);
+        } else {
+            break;
+        }
+    }
+
+    if (i != argc - 2 || !socket_path == !port || port < 0 || port > 65535) {
+        usage();
+        return -1;
+    }
+
+    e.s = read_image(argv[argc - 2], &image);
+    if (!e.s) {
+        return -1;
+    }
+
+    /* A read-only export doesn't need the overlay to exist */
+    overlay = argv[argc - 1];
+    if (e.read_only && access(overlay, F_OK) < 0 && errno == ENOENT) {
+        overlay = NULL;
+    }
+
+    e.ov = overlay_open(overlay, e.s, !e.read_only);
+    if (!e.ov) {
+        return -1;
+    }
+
+    e.len = sparse_file_len(e.s, false, false);
+    e.block_size = sparse_file_block_size(e.s);
+    e.buf = malloc(NBD_MAX_REQUEST);
+    e.block = malloc(e.block_size);
+    if (!e.buf || !e.block) {
+        fprintf(stderr, "Cannot allocate buffers\n");
+        return -1;
+    }
+
+    sock = listen_on(socket_path, port);
+    if (sock < 0) {
+        if (socket_path) {
+            fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        } else {
+            fprintf(stderr, "Cannot listen on port %d: %s\n", port, strerror(errno));
+        }
+        return -1;
+    }
+
+    /* A client that goes away mid-reply must not take the server with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Serving %s, %" PRId64 " bytes, writes to %s\n", argv[argc - 2], e.len,
+            e.read_only ? "nowhere" : argv[argc - 1]);
+
+    /* Clients are served one at a time, for as long as the server runs */
+    for (;;) {
+        client = accept(sock, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Cannot accept clients: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (negotiate(client, &e) > 0) {
+            transmit(client, &e);
+        }
+        if (!e.read_only && overlay_sync(e.ov) < 0) {
+            fprintf(stderr, "Cannot sync overlay: %s\n", strerror(errno));
+        }
+        close(client);
+    }
+}
+
+static int nbd_commit(int argc, char *argv[])
+{
+    struct sparse_file *s;
+    struct sparse_file *patch;
+    struct overlay *ov;
+    unsigned int block_size;
+    unsigned int max_blocks;
+    unsigned int block;
+    unsigned int end;
+    unsigned int dirty = 0;
+    bool progress = false;
+    int64_t len;
+    int image;
+    int out;
+    int ret;
+
+    if (argc == 6 && strcmp(argv[2], "--progress") == 0) {
+        progress = true;
+        argv++;
+    } else if (argc != 5) {
+        usage();
+        return -1;
+    }
+
+    s = read_image(argv[2], &image);
+    if (!s) {
+        return -1;
+    }
+
+    ov = overlay_open(argv[3], s, false);
+    if (!ov) {
+        return -1;
+    }
+
+    block_size = sparse_file_block_size(s);
+    len = sparse_file_len(s, false, false);
+    patch = sparse_file_new(block_size, len);
+    if (!patch) {
+        fprintf(stderr, "Failed to create sparse file\n");
+        return -1;
+    }
+
+    /* Only the written blocks are read from the overlay, the rest from the image */
+    max_blocks = (1U << 30) / block_size;
+    for (block = 0; block < ov->blocks; block = end) {
+        if (!overlay_dirty(ov, block)) {
+            end = block + 1;
+            continue;
+        }
+        end = block + 1;
+        while (end < ov->blocks && end - block < max_blocks && overlay_dirty(ov, end)) {
+            end++;
+        }
+
+        ret = sparse_file_add_fd(patch, ov->fd,
+                                 ov->header.data_offset + (int64_t) block * block_size,
+                                 end < ov->blocks ? (end - block) * block_size :
+                                 len - (int64_t) block * block_size, block);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to add blocks %u to %u\n", block, end - 1);
+            return -1;
+        }
+        dirty += end - block;
+    }
+
+    if (sparse_file_overlay(s, patch) < 0) {
+        fprintf(stderr, "Failed to lay the overlay over the image\n");
+        return -1;
+    }
+
+    if (progress) {
+        sparse_file_progress(s, PROGRESS_INTERVAL_MS, sparse_progress_print, "write");
+    }
+
+    out = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (out < 0) {
+        fprintf(stderr, "Cannot open output file %s\n", argv[4]);
+        return -1;
+    }
+
+    if (sparse_file_write(s, out, false, true, false) < 0) {
+        fprintf(stderr, "Cannot write output file\n");
+        return -1;
+    }
+
+    printf("%u of %u blocks from the overlay\n", dirty, ov->blocks);
+
+    sparse_file_destroy(patch);
+    sparse_file_destroy(s);
+    overlay_close(ov);
+    close(image);
+
+    if (close(out) < 0) {
+        fprintf(stderr, "Failed to write output file\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        exit(nbd_serve(argc, argv));
+    }
+
+    if (argc > 1 && strcmp(argv[1], "commit") == 0) {
+        exit(nbd_commit(argc, argv));
+    }
+
+    usage();
+    exit(-1);
+}
@@ -0,0 +1,171 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+#include "sparse_format.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define lseek64 lseek
+#define off64_t off_t
+#endif
+
+void usage()
+{
+    fprintf(stderr, "Usage: simgpatch <sparse_image> <block> <file> [<block> <file> ...]\n");
+}
+
+/* Writes a copy of the image with the chunks holding the patch split around it */
+static void patch_rewrite(int image, const char *image_path, struct sparse_file *patch)
+{
+    char *tmp_path;
+    int tmp_fd;
+    int ret;
+
+    ret = asprintf(&tmp_path, "%s.simgpatch", image_path);
+    if (ret < 0) {
+        fprintf(stderr, "Couldn't allocate filename\n");
+        exit(-1);
+    }
+
+    tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (tmp_fd < 0) {
+        fprintf(stderr, "Couldn't open temporary file (%s)\n", strerror(errno));
+        exit(-1);
+    }
+
+    ret = sparse_file_patch_copy(image, tmp_fd, patch);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to patch sparse image (%s)\n", strerror(-ret));
+        unlink(tmp_path);
+        exit(-1);
+    }
+
+    close(tmp_fd);
+
+    ret = rename(tmp_path, image_path);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to rename temporary file (%s)\n", strerror(errno));
+        exit(-1);
+    }
+
+    free(tmp_path);
+}
+
+int main(int argc, char *argv[])
+{
+    int image;
+    char *image_path;
+    sparse_header_t sparse_header;
+    struct sparse_file *patch;
+    int64_t len;
+    unsigned int block;
+    char *end;
+    int input;
+    off64_t input_len;
+    int ret;
+    int i;
+
+    if (argc < 4 || argc % 2) {
+        usage();
+        exit(-1);
+    }
+
+    image_path = argv[1];
+    image = open(image_path, O_RDWR | O_BINARY);
+    if (image < 0) {
+        fprintf(stderr, "Couldn't open sparse image (%s)\n", strerror(errno));
+        exit(-1);
+    }
+
+    if (read(image, &sparse_header, sizeof(sparse_header)) != sizeof(sparse_header) ||
+        sparse_header.magic != SPARSE_HEADER_MAGIC) {
+        fprintf(stderr, "%s is not a sparse image\n", image_path);
+        exit(-1);
+    }
+
+    len = (int64_t) sparse_header.blk_sz * sparse_header.total_blks;
+    patch = sparse_file_new(sparse_header.blk_sz, len);
+    if (!patch) {
+        fprintf(stderr, "Couldn't allocate sparse file\n");
+        exit(-1);
+    }
+
+    for (i = 2; i < argc; i += 2) {
+        block = strtoul(argv[i], &end, 0);
+        if (*end != '\0') {
+            fprintf(stderr, "Invalid block number %s\n", argv[i]);
+            exit(-1);
+        }
+
+        input = open(argv[i + 1], O_RDONLY | O_BINARY);
+        if (input < 0) {
+            fprintf(stderr, "Couldn't open input file %s (%s)\n", argv[i + 1], strerror(errno));
+            exit(-1);
+        }
+
+        input_len = lseek64(input, 0, SEEK_END);
+        if (input_len < 0) {
+            fprintf(stderr, "Couldn't get input file length (%s)\n", strerror(errno));
+            exit(-1);
+        }
+
+        if (input_len % sparse_header.blk_sz ||
+            block + input_len / sparse_header.blk_sz > sparse_header.total_blks) {
+            fprintf(stderr, "%s doesn't fit whole blocks of the image at block %u\n",
+                    argv[i + 1], block);
+            exit(-1);
+        }
+
+        /* Later patches win over earlier ones */
+        if (input_len > 0) {
+            struct sparse_file *s = sparse_file_new(sparse_header.blk_sz, len);
+
+            if (!s || sparse_file_add_fd(s, input, 0, input_len, block) < 0 ||
+                sparse_file_overlay(patch, s) < 0) {
+                fprintf(stderr, "Couldn't add input file %s\n", argv[i + 1]);
+                exit(-1);
+            }
+            sparse_file_destroy(s);
+        }
+    }
+
+    /* Blocks held in raw chunks are overwritten, anything else splits chunks in a copy */
+    ret = sparse_file_patch(image, patch);
+    if (ret == -EAGAIN) {
+        patch_rewrite(image, image_path, patch);
+    } else if (ret < 0) {
+        fprintf(stderr, "Failed to patch sparse image (%s)\n", strerror(-ret));
+        exit(-1);
+    }
+
+    sparse_file_destroy(patch);
+    close(image);
+
+    exit(0);
+}
@@ -0,0 +1,208 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+#include "block_store.h"
+#include "sparse_format.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define lseek64 lseek
+#define off64_t off_t
+#endif
+
+void usage()
+{
+    fprintf(stderr, "Usage: simgstore add [-b <block_size>] <store_dir> <image_file> <manifest>\n");
+    fprintf(stderr, "       simgstore get [-s] <store_dir> <manifest> <output_file>\n");
+    fprintf(stderr, "  add  adds the blocks of a raw or sparse image to the store\n");
+    fprintf(stderr, "  get  writes the image of a manifest, raw or with -s sparse\n");
+}
+
+/* Reads a sparse image, or a raw one in blocks of the store */
+static struct sparse_file *read_image(int in, unsigned int block_size)
+{
+    sparse_header_t sparse_header;
+    struct sparse_file *s;
+    off64_t len;
+
+    if (read(in, &sparse_header, sizeof(sparse_header)) == sizeof(sparse_header) &&
+        sparse_header.magic == SPARSE_HEADER_MAGIC) {
+        lseek64(in, 0, SEEK_SET);
+        return sparse_file_import(in, true, false);
+    }
+
+    len = lseek64(in, 0, SEEK_END);
+    lseek64(in, 0, SEEK_SET);
+
+    s = sparse_file_new(block_size, len);
+    if (!s) {
+        return NULL;
+    }
+
+    if (sparse_file_read(s, in, false, false) < 0) {
+        sparse_file_destroy(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+static int store_add(int argc, char *argv[])
+{
+    struct block_store_stats stats;
+    struct block_store *bs;
+    struct sparse_file *s;
+    unsigned int block_size = 0;
+    int in;
+    int out;
+    int ret;
+
+    if (argc == 6 && strcmp(argv[2], "-b") == 0) {
+        block_size = atoi(argv[3]);
+        if (block_size < 1024 || block_size % 4 != 0) {
+            usage();
+            return -1;
+        }
+        argv += 2;
+    } else if (argc != 5) {
+        usage();
+        return -1;
+    }
+
+    bs = block_store_open(argv[2], block_size);
+    if (!bs) {
+        fprintf(stderr, "Cannot open block store %s\n", argv[2]);
+        return -1;
+    }
+
+    in = open(argv[3], O_RDONLY | O_BINARY);
+    if (in < 0) {
+        fprintf(stderr, "Cannot open input file %s\n", argv[3]);
+        return -1;
+    }
+
+    s = read_image(in, block_store_block_size(bs));
+    if (!s) {
+        fprintf(stderr, "Failed to read image %s\n", argv[3]);
+        return -1;
+    }
+
+    out = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (out < 0) {
+        fprintf(stderr, "Cannot open manifest %s\n", argv[4]);
+        return -1;
+    }
+
+    ret = block_store_add(bs, s, out, &stats);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to add image to block store (%s)\n", strerror(-ret));
+        return -1;
+    }
+
+    printf("%" PRIu64 " blocks, %" PRIu64 " fill, %" PRIu64 " new in store\n",
+           stats.blocks, stats.fill_blocks, stats.new_blocks);
+
+    sparse_file_destroy(s);
+    close(in);
+
+    if (close(out) < 0 || block_store_close(bs) < 0) {
+        fprintf(stderr, "Failed to write block store\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int store_get(int argc, char *argv[])
+{
+    struct block_store *bs;
+    struct sparse_file *s;
+    bool sparse = false;
+    int in;
+    int out;
+
+    if (argc == 6 && strcmp(argv[2], "-s") == 0) {
+        sparse = true;
+        argv++;
+    } else if (argc != 5) {
+        usage();
+        return -1;
+    }
+
+    bs = block_store_open(argv[2], 0);
+    if (!bs) {
+        fprintf(stderr, "Cannot open block store %s\n", argv[2]);
+        return -1;
+    }
+
+    in = open(argv[3], O_RDONLY | O_BINARY);
+    if (in < 0) {
+        fprintf(stderr, "Cannot open manifest %s\n", argv[3]);
+        return -1;
+    }
+
+    s = block_store_get(bs, in);
+    if (!s) {
+        fprintf(stderr, "Failed to read manifest %s\n", argv[3]);
+        return -1;
+    }
+    close(in);
+
+    out = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (out < 0) {
+        fprintf(stderr, "Cannot open output file %s\n", argv[4]);
+        return -1;
+    }
+
+    sparse_file_discard(s);
+    if (sparse_file_write(s, out, false, sparse, false) < 0) {
+        fprintf(stderr, "Cannot write output file\n");
+        return -1;
+    }
+
+    sparse_file_destroy(s);
+    close(out);
+    block_store_close(bs);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "add") == 0) {
+        exit(store_add(argc, argv));
+    }
+
+    if (argc > 1 && strcmp(argv[1], "get") == 0) {
+        exit(store_get(argc, argv));
+    }
+
+    usage();
+    exit(-1);
+}
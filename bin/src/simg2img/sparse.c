@@ -14,8 +14,16 @@
  * limitations under the License.
  */
 
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <sparse/sparse.h>
 
@@ -26,6 +34,26 @@
 #include "backed_block.h"
 #include "sparse_defs.h"
 #include "sparse_format.h"
+#include "sparse_stats.h"
+#include "sparse_trace.h"
+
+#ifdef USE_MINGW
+#define ftruncate64 ftruncate
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define lseek64 lseek
+#define ftruncate64 ftruncate
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define SPARSE_HEADER_MAJOR_VER 1
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
 
 struct sparse_file *sparse_file_new(unsigned int block_size, int64_t len)
 {
@@ -42,6 +70,8 @@ struct sparse_file *sparse_file_new(unsigned int block_size, int64_t len)
 
     s->block_size = block_size;
     s->len = len;
+    s->stats = sparse_default_stats;
+    sparse_file_progress_init(s);
 
     return s;
 }
@@ -100,10 +130,17 @@ unsigned int sparse_count_chunks(struct sparse_file *s)
 static int sparse_file_write_block(struct output_file *out, struct backed_block *bb)
 {
     int ret = -EINVAL;
+    const struct iovec *iov;
+    unsigned int iovcnt;
 
     switch (backed_block_type(bb)) {
     case BACKED_BLOCK_DATA:
-        ret = write_data_chunk(out, backed_block_len(bb), backed_block_data(bb));
+        iovcnt = backed_block_data_iov(bb, &iov);
+        if (iovcnt) {
+            ret = write_data_iov_chunk(out, backed_block_len(bb), iov, iovcnt);
+        } else {
+            ret = write_data_chunk(out, backed_block_len(bb), backed_block_data(bb));
+        }
         break;
     case BACKED_BLOCK_FILE:
         ret = write_file_chunk(out, backed_block_len(bb),
@@ -125,9 +162,13 @@ static int write_all_blocks(struct sparse_file *s, struct output_file *out)
 {
     struct backed_block *bb;
     unsigned int last_block = 0;
+    uint64_t start = trace_start();
+    uint64_t counted = 0;
     int64_t pad;
     int ret = 0;
 
+    sparse_file_progress_begin(s);
+
     for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
         if (backed_block_block(bb) > last_block) {
             unsigned int blocks = backed_block_block(bb) - last_block;
@@ -137,14 +178,20 @@ static int write_all_blocks(struct sparse_file *s, struct output_file *out)
         if (ret)
             return ret;
         last_block = backed_block_block(bb) + DIV_ROUND_UP(backed_block_len(bb), s->block_size);
+        sparse_file_progress_update(s, (int64_t) last_block * s->block_size);
+        trace_counter("written", (int64_t) last_block * s->block_size, &counted);
     }
 
+    /* Negative when the last block is partial, the write pads it */
     pad = s->len - (int64_t) last_block *s->block_size;
-    assert(pad >= 0);
     if (pad > 0) {
         write_skip_chunk(out, pad);
     }
 
+    sparse_file_progress_end(s);
+    trace_counter("written", s->len, NULL);
+    trace_span("write", start, s->len);
+
     return 0;
 }
 
@@ -160,9 +207,801 @@ int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse, bool
     if (!out)
         return -ENOMEM;
 
+    output_file_stats(out, s->stats);
+    if (s->discard)
+        output_file_discard(out);
+
     ret = write_all_blocks(s, out);
 
-    output_file_close(out);
+    if (output_file_close(out) < 0 && !ret) {
+        ret = -EIO;
+    }
+
+    return ret;
+}
+
+static int write_header(int fd, sparse_header_t *sparse_header)
+{
+    int ret;
+
+    if (lseek64(fd, 0, SEEK_SET) < 0)
+        return -errno;
+
+    ret = write(fd, sparse_header, sizeof(*sparse_header));
+    if (ret < 0)
+        return -errno;
+    if (ret != sizeof(*sparse_header))
+        return -EIO;
+
+    return 0;
+}
+
+/*
+ * A windowed read writes out the blocks read so far every window chunks,
+ * and then drops them.  The output stays open from the first window to the
+ * last, and a sparse output starts with chunks in its header, which is
+ * corrected at the end if merges or windows changed the count.
+ */
+int sparse_file_window_open(struct sparse_file *s, int fd, bool sparse, unsigned int chunks,
+                            unsigned int window)
+{
+    if (!window)
+        return -EINVAL;
+
+    s->out = output_file_open_fd(fd, s->block_size, s->len, false, sparse, chunks, false);
+    if (!s->out)
+        return -ENOMEM;
+
+    output_file_stats(s->out, s->stats);
+    output_file_stream(s->out);
+    /* The output is written from scratch, what it held before doesn't matter */
+    if (!sparse)
+        output_file_discard(s->out);
+
+    s->window = window;
+    s->out_block = 0;
+    s->out_chunks = 0;
+
+    return 0;
+}
+
+int sparse_file_window_flush(struct sparse_file *s)
+{
+    struct backed_block *bb;
+    unsigned int blocks;
+    int ret;
+
+    for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        if (backed_block_block(bb) > s->out_block) {
+            blocks = backed_block_block(bb) - s->out_block;
+            ret = write_skip_chunk(s->out, (int64_t) blocks * s->block_size);
+            if (ret)
+                return ret;
+            s->out_chunks++;
+        }
+        ret = sparse_file_write_block(s->out, bb);
+        if (ret)
+            return ret;
+        s->out_chunks++;
+        s->out_block = backed_block_block(bb) +
+            DIV_ROUND_UP(backed_block_len(bb), s->block_size);
+    }
+
+    return backed_block_clear(s->backed_block_list, 0, s->out_block);
+}
+
+/*
+ * Writes the last window and closes the output.  ret is the result of the
+ * read, after an error the output is only closed.
+ */
+int sparse_file_window_close(struct sparse_file *s, int fd, bool sparse, unsigned int chunks,
+                             int ret)
+{
+    int64_t pad;
+
+    if (!ret)
+        ret = sparse_file_window_flush(s);
+
+    pad = s->len - (int64_t) s->out_block * s->block_size;
+    if (!ret && pad > 0) {
+        ret = write_skip_chunk(s->out, pad);
+        s->out_chunks++;
+    }
+
+    if (output_file_close(s->out) < 0 && !ret)
+        ret = -EIO;
+    s->out = NULL;
+    if (ret)
+        return ret;
+
+    if (!sparse || s->out_chunks == chunks)
+        return 0;
+
+    /* Only the chunk count changes, the output may not be readable */
+    if (lseek64(fd, offsetof(sparse_header_t, total_chunks), SEEK_SET) < 0)
+        return -errno;
+
+    ret = write(fd, &s->out_chunks, sizeof(s->out_chunks));
+    if (ret < 0)
+        return -errno;
+    if (ret != sizeof(s->out_chunks))
+        return -EIO;
+
+    return 0;
+}
+
+int sparse_file_append(struct sparse_file *s, int fd)
+{
+    sparse_header_t sparse_header;
+    chunk_header_t chunk_header;
+    struct output_file *out;
+    uint32_t crc32 = 0;
+    bool crc = false;
+    int64_t end;
+    unsigned int i;
+    int chunks;
+    int ret;
+
+    if (lseek64(fd, 0, SEEK_SET) < 0)
+        return -errno;
+
+    ret = read_all(fd, &sparse_header, sizeof(sparse_header));
+    if (ret < 0)
+        return ret;
+
+    if (sparse_header.magic != SPARSE_HEADER_MAGIC ||
+        sparse_header.major_version != SPARSE_HEADER_MAJOR_VER ||
+        sparse_header.file_hdr_sz < sizeof(sparse_header_t) ||
+        sparse_header.chunk_hdr_sz < sizeof(chunk_header_t) ||
+        sparse_header.blk_sz != s->block_size || s->len % s->block_size)
+        return -EINVAL;
+
+    /* Only the chunk headers are read to find where the last chunk ends */
+    end = sparse_header.file_hdr_sz;
+    for (i = 0; i < sparse_header.total_chunks; i++) {
+        if (lseek64(fd, end, SEEK_SET) < 0)
+            return -errno;
+
+        ret = read_all(fd, &chunk_header, sizeof(chunk_header));
+        if (ret < 0)
+            return ret;
+
+        stats_call(s->stats, SPARSE_STATS_SYS_LSEEK, 0);
+        stats_call(s->stats, SPARSE_STATS_SYS_READ, sizeof(chunk_header));
+
+        if (chunk_header.total_sz < sparse_header.chunk_hdr_sz)
+            return -EINVAL;
+
+        /*
+         * A crc chunk at the end stays where it is, as it still holds for the
+         * chunks before it, and a new one covering the new chunks follows them
+         */
+        if (chunk_header.chunk_type == CHUNK_TYPE_CRC32 && i == sparse_header.total_chunks - 1) {
+            if (lseek64(fd, end + sparse_header.chunk_hdr_sz, SEEK_SET) < 0)
+                return -errno;
+
+            ret = read_all(fd, &crc32, sizeof(crc32));
+            if (ret < 0)
+                return ret;
+
+            crc = true;
+        }
+
+        end += chunk_header.total_sz;
+    }
+
+    if (lseek64(fd, end, SEEK_SET) < 0)
+        return -errno;
+
+    chunks = sparse_count_chunks(s);
+    out = output_file_append_fd(fd, s->block_size, s->len, crc, crc32);
+    if (!out)
+        return -ENOMEM;
+
+    output_file_stats(out, s->stats);
+
+    ret = write_all_blocks(s, out);
+
+    if (output_file_close(out) < 0 && !ret)
+        ret = -EIO;
+    if (ret < 0)
+        return ret;
+
+    /* Drop whatever followed the old last chunk */
+    end = lseek64(fd, 0, SEEK_CUR);
+    if (end < 0 || ftruncate64(fd, end) < 0)
+        return -errno;
+
+    /*
+     * The header goes last.  Until then it describes the old image, whose
+     * chunks, crc included, the new chunks are written after.
+     */
+    sparse_header.total_blks += s->len / s->block_size;
+    sparse_header.total_chunks += chunks + (crc ? 1 : 0);
+
+    return write_header(fd, &sparse_header);
+}
+
+int sparse_file_overlay(struct sparse_file *s, struct sparse_file *patch)
+{
+    struct backed_block *bb;
+    int ret;
+
+    if (patch->block_size != s->block_size)
+        return -EINVAL;
+
+    /* Blocks move one at a time, they can fall between blocks of s */
+    while ((bb = backed_block_iter_new(patch->backed_block_list))) {
+        ret = backed_block_clear(s->backed_block_list, backed_block_block(bb),
+                                 DIV_ROUND_UP(backed_block_len(bb), s->block_size));
+        if (ret < 0)
+            return ret;
+
+        backed_block_list_move(patch->backed_block_list, s->backed_block_list, bb, bb);
+    }
+
+    if (patch->len > s->len)
+        s->len = patch->len;
+
+    return 0;
+}
+
+/* A raw chunk of a sparse image, for patching its data in place */
+struct raw_chunk {
+    unsigned int block;
+    unsigned int blocks;
+    int64_t offset;
+};
+
+struct patch_writer {
+    int fd;
+    unsigned int block_size;
+    struct raw_chunk *chunks;
+    unsigned int count;
+    unsigned int cur;
+    int64_t pos;
+};
+
+static int write_at(int fd, int64_t offset, const void *data, size_t len)
+{
+    const char *ptr = data;
+    ssize_t ret;
+
+    if (lseek64(fd, offset, SEEK_SET) < 0)
+        return -errno;
+
+    while (len > 0) {
+        ret = write(fd, ptr, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int pread_all(int fd, void *buf, size_t len, int64_t offset)
+{
+    char *p = buf;
+    ssize_t ret;
+
+#ifdef USE_MINGW
+    if (lseek64(fd, offset, SEEK_SET) < 0)
+        return -errno;
+    return read_all(fd, buf, len);
+#else
+    while (len) {
+        ret = pread64(fd, p, len, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -errno;
+        if (ret == 0)
+            return -EINVAL;
+        p += ret;
+        offset += ret;
+        len -= ret;
+    }
+
+    return 0;
+#endif
+}
+
+/* Writes the expanded patch over the chunk data it falls in */
+static int patch_write(void *priv, const void *data, int len)
+{
+    struct patch_writer *pw = priv;
+    struct raw_chunk *c;
+    int64_t start;
+    int64_t n;
+    int ret;
+
+    if (!data) {
+        pw->pos += len;
+        return 0;
+    }
+
+    while (len > 0) {
+        c = &pw->chunks[pw->cur];
+        start = (int64_t) c->block * pw->block_size;
+        while (pw->pos >= start + (int64_t) c->blocks * pw->block_size) {
+            c = &pw->chunks[++pw->cur];
+            start = (int64_t) c->block * pw->block_size;
+        }
+
+        n = start + (int64_t) c->blocks * pw->block_size - pw->pos;
+        if (n > len)
+            n = len;
+        ret = write_at(pw->fd, c->offset + pw->pos - start, data, n);
+        if (ret < 0)
+            return ret;
+
+        data = (const char *)data + n;
+        len -= n;
+        pw->pos += n;
+    }
+
+    return 0;
+}
+
+/* Returns the raw chunk holding block, or NULL if it isn't in one */
+static struct raw_chunk *find_raw_chunk(struct raw_chunk *chunks, unsigned int count,
+                                        unsigned int block)
+{
+    unsigned int lo = 0;
+    unsigned int hi = count;
+    unsigned int mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (chunks[mid].block + chunks[mid].blocks <= block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == count || chunks[lo].block > block)
+        return NULL;
+
+    return &chunks[lo];
+}
+
+/* Reads the header of a sparse image to patch, which must use block_size */
+static int patch_read_header(int fd, sparse_header_t *sparse_header, unsigned int block_size)
+{
+    int ret;
+
+    if (lseek64(fd, 0, SEEK_SET) < 0)
+        return -errno;
+
+    ret = read_all(fd, sparse_header, sizeof(*sparse_header));
+    if (ret < 0)
+        return ret;
+
+    if (sparse_header->magic != SPARSE_HEADER_MAGIC ||
+        sparse_header->major_version != SPARSE_HEADER_MAJOR_VER ||
+        sparse_header->file_hdr_sz < sizeof(sparse_header_t) ||
+        sparse_header->chunk_hdr_sz < sizeof(chunk_header_t) ||
+        sparse_header->blk_sz != block_size)
+        return -EINVAL;
+
+    return 0;
+}
+
+int sparse_file_patch(int fd, struct sparse_file *patch)
+{
+    sparse_header_t sparse_header;
+    chunk_header_t chunk_header;
+    struct patch_writer pw;
+    struct raw_chunk *chunks = NULL;
+    struct raw_chunk *c;
+    struct raw_chunk *tmp;
+    struct backed_block *bb;
+    unsigned int size = 0;
+    unsigned int count = 0;
+    unsigned int block = 0;
+    unsigned int b, end;
+    int64_t offset;
+    int64_t crc_offset = -1;
+    unsigned int i;
+    int ret;
+
+    ret = patch_read_header(fd, &sparse_header, patch->block_size);
+    if (ret < 0)
+        return ret;
+
+    /* Collect the raw chunks from the chunk headers */
+    offset = sparse_header.file_hdr_sz;
+    for (i = 0; i < sparse_header.total_chunks; i++) {
+        if (lseek64(fd, offset, SEEK_SET) < 0) {
+            ret = -errno;
+            goto out;
+        }
+
+        ret = read_all(fd, &chunk_header, sizeof(chunk_header));
+        if (ret < 0)
+            goto out;
+
+        if (chunk_header.total_sz < sparse_header.chunk_hdr_sz) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        if (chunk_header.chunk_type == CHUNK_TYPE_RAW) {
+            if (count == size) {
+                size = size ? size * 2 : 64;
+                tmp = realloc(chunks, size * sizeof(*chunks));
+                if (!tmp) {
+                    ret = -ENOMEM;
+                    goto out;
+                }
+                chunks = tmp;
+            }
+            chunks[count].block = block;
+            chunks[count].blocks = chunk_header.chunk_sz;
+            chunks[count].offset = offset + sparse_header.chunk_hdr_sz;
+            count++;
+        } else if (chunk_header.chunk_type == CHUNK_TYPE_CRC32) {
+            /* Only a trailing crc can be cut off, anything else needs a rewrite */
+            if (i != sparse_header.total_chunks - 1) {
+                ret = -EAGAIN;
+                goto out;
+            }
+            crc_offset = offset;
+        }
+
+        block += chunk_header.chunk_sz;
+        offset += chunk_header.total_sz;
+    }
+
+    /* Nothing is written unless every patched block is already stored raw */
+    for (bb = backed_block_iter_new(patch->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        if (backed_block_len(bb) % patch->block_size) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        end = backed_block_block(bb) + backed_block_len(bb) / patch->block_size;
+        if (end > sparse_header.total_blks) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        for (b = backed_block_block(bb); b < end; b = c->block + c->blocks) {
+            c = find_raw_chunk(chunks, count, b);
+            if (!c) {
+                ret = -EAGAIN;
+                goto out;
+            }
+        }
+    }
+
+    pw.fd = fd;
+    pw.block_size = patch->block_size;
+    pw.chunks = chunks;
+    pw.count = count;
+    pw.cur = 0;
+    pw.pos = 0;
+
+    /* Anything past the last patched block is skipped, so the length doesn't matter */
+    ret = sparse_file_callback(patch, false, false, patch_write, &pw);
+    if (ret < 0)
+        goto out;
+
+    /* The crc of the image no longer holds, drop the chunk */
+    if (crc_offset >= 0) {
+        if (ftruncate64(fd, crc_offset) < 0) {
+            ret = -errno;
+            goto out;
+        }
+        sparse_header.total_chunks--;
+        sparse_header.image_checksum = 0;
+        ret = write_header(fd, &sparse_header);
+    }
+
+ out:
+    free(chunks);
+
+    return ret;
+}
+
+/* Patched data is copied through a buffer this big, and split into raw chunks of up to 1 GiB */
+#define PATCH_COPY_BUF (1024 * 1024)
+#define PATCH_CHUNK_MAX (1024 * 1024 * 1024)
+
+/* A run of patched blocks */
+struct patch_range {
+    unsigned int block;
+    unsigned int end;
+};
+
+/* The output of sparse_file_patch_copy so far */
+struct patch_copy {
+    int in;
+    int out;
+    unsigned int block_size;
+    struct sparse_file *patch;
+    int64_t pos;
+    unsigned int chunks;
+    char *buf;
+};
+
+/* Collects the blocks of patch into runs, merging the adjacent ones */
+static int patch_ranges(struct sparse_file *patch, unsigned int total_blks,
+                        struct patch_range **ranges, unsigned int *count)
+{
+    struct patch_range *r = NULL;
+    struct patch_range *tmp;
+    struct backed_block *bb;
+    unsigned int size = 0;
+    unsigned int n = 0;
+    unsigned int block, end;
+
+    for (bb = backed_block_iter_new(patch->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        block = backed_block_block(bb);
+        end = block + backed_block_len(bb) / patch->block_size;
+        if (backed_block_len(bb) % patch->block_size || end > total_blks) {
+            free(r);
+            return -EINVAL;
+        }
+
+        if (n && r[n - 1].end == block) {
+            r[n - 1].end = end;
+            continue;
+        }
+
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            tmp = realloc(r, size * sizeof(*r));
+            if (!tmp) {
+                free(r);
+                return -ENOMEM;
+            }
+            r = tmp;
+        }
+        r[n].block = block;
+        r[n].end = end;
+        n++;
+    }
+
+    *ranges = r;
+    *count = n;
+
+    return 0;
+}
+
+static int patch_copy_header(struct patch_copy *pc, uint16_t type, unsigned int blocks,
+                             unsigned int data_len)
+{
+    chunk_header_t chunk_header = {
+        .chunk_type = type,
+        .chunk_sz = blocks,
+        .total_sz = sizeof(chunk_header_t) + data_len,
+    };
+    int ret;
+
+    ret = write_at(pc->out, pc->pos, &chunk_header, sizeof(chunk_header));
+    if (ret < 0)
+        return ret;
+
+    pc->pos += sizeof(chunk_header);
+    pc->chunks++;
+
+    return 0;
+}
+
+/* Copies len bytes at offset of the image to the end of the output */
+static int patch_copy_data(struct patch_copy *pc, int64_t offset, int64_t len)
+{
+    size_t n;
+    int ret;
+
+    ret = copy_range(pc->in, offset, pc->out, pc->pos, len);
+    if (ret != -EOPNOTSUPP) {
+        if (!ret)
+            pc->pos += len;
+        return ret;
+    }
+
+    while (len > 0) {
+        n = min(len, (int64_t) PATCH_COPY_BUF);
+        ret = pread_all(pc->in, pc->buf, n, offset);
+        if (ret < 0)
+            return ret;
+        ret = write_at(pc->out, pc->pos, pc->buf, n);
+        if (ret < 0)
+            return ret;
+        offset += n;
+        pc->pos += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Writes blocks of an unpatched chunk of the image, whose data starts at data */
+static int patch_copy_chunk(struct patch_copy *pc, uint16_t type, int64_t data,
+                            uint32_t fill_val, unsigned int blocks)
+{
+    int64_t len = (int64_t) blocks * pc->block_size;
+    int ret;
+
+    switch (type) {
+    case CHUNK_TYPE_RAW:
+        ret = patch_copy_header(pc, type, blocks, len);
+        if (ret < 0)
+            return ret;
+        return patch_copy_data(pc, data, len);
+    case CHUNK_TYPE_FILL:
+        ret = patch_copy_header(pc, type, blocks, sizeof(fill_val));
+        if (ret < 0)
+            return ret;
+        ret = write_at(pc->out, pc->pos, &fill_val, sizeof(fill_val));
+        if (ret < 0)
+            return ret;
+        pc->pos += sizeof(fill_val);
+        return 0;
+    default:
+        return patch_copy_header(pc, type, blocks, 0);
+    }
+}
+
+/* Writes patched blocks as raw chunks */
+static int patch_copy_patched(struct patch_copy *pc, unsigned int block, unsigned int blocks)
+{
+    unsigned int max = PATCH_CHUNK_MAX / pc->block_size;
+    int64_t offset = (int64_t) block * pc->block_size;
+    int64_t len;
+    unsigned int n;
+    size_t m;
+    int ret;
+
+    while (blocks > 0) {
+        n = min(blocks, max);
+        len = (int64_t) n * pc->block_size;
+        ret = patch_copy_header(pc, CHUNK_TYPE_RAW, n, len);
+        if (ret < 0)
+            return ret;
+
+        while (len > 0) {
+            m = min(len, (int64_t) PATCH_COPY_BUF);
+            ret = sparse_file_pread(pc->patch, pc->buf, m, offset);
+            if (ret < 0)
+                return ret;
+            ret = write_at(pc->out, pc->pos, pc->buf, m);
+            if (ret < 0)
+                return ret;
+            offset += m;
+            pc->pos += m;
+            len -= m;
+        }
+
+        blocks -= n;
+    }
+
+    return 0;
+}
+
+int sparse_file_patch_copy(int in, int out, struct sparse_file *patch)
+{
+    sparse_header_t sparse_header;
+    chunk_header_t chunk_header;
+    struct patch_copy pc = {
+        .in = in,
+        .out = out,
+        .block_size = patch->block_size,
+        .patch = patch,
+        .pos = sizeof(sparse_header_t),
+    };
+    struct patch_range *ranges = NULL;
+    unsigned int count = 0;
+    unsigned int r = 0;
+    unsigned int block = 0;
+    unsigned int pos, end, next;
+    int64_t offset;
+    int64_t data;
+    uint32_t fill_val = 0;
+    unsigned int i;
+    int ret;
+
+    ret = patch_read_header(in, &sparse_header, patch->block_size);
+    if (ret < 0)
+        return ret;
+
+    ret = patch_ranges(patch, sparse_header.total_blks, &ranges, &count);
+    if (ret < 0)
+        return ret;
+
+    pc.buf = malloc(PATCH_COPY_BUF);
+    if (!pc.buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    offset = sparse_header.file_hdr_sz;
+    for (i = 0; i < sparse_header.total_chunks; i++) {
+        ret = pread_all(in, &chunk_header, sizeof(chunk_header), offset);
+        if (ret < 0)
+            goto out;
+
+        if (chunk_header.total_sz < sparse_header.chunk_hdr_sz ||
+            chunk_header.chunk_sz > sparse_header.total_blks - block) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        data = offset + sparse_header.chunk_hdr_sz;
+        end = block + chunk_header.chunk_sz;
+
+        switch (chunk_header.chunk_type) {
+        case CHUNK_TYPE_RAW:
+            if (chunk_header.total_sz - sparse_header.chunk_hdr_sz !=
+                (int64_t) chunk_header.chunk_sz * sparse_header.blk_sz) {
+                ret = -EINVAL;
+                goto out;
+            }
+            break;
+        case CHUNK_TYPE_FILL:
+            if (chunk_header.total_sz - sparse_header.chunk_hdr_sz < sizeof(fill_val)) {
+                ret = -EINVAL;
+                goto out;
+            }
+            ret = pread_all(in, &fill_val, sizeof(fill_val), data);
+            if (ret < 0)
+                goto out;
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            break;
+        case CHUNK_TYPE_CRC32:
+            /* The crc of the image no longer holds, drop the chunk */
+            offset += chunk_header.total_sz;
+            continue;
+        default:
+            ret = -EINVAL;
+            goto out;
+        }
+
+        /* Untouched chunks go through whole, others are split around the patched runs */
+        while (r < count && ranges[r].end <= block)
+            r++;
+        for (pos = block; pos < end; pos = next) {
+            if (r < count && ranges[r].block <= pos) {
+                next = min(ranges[r].end, end);
+                ret = patch_copy_patched(&pc, pos, next - pos);
+                if (next == ranges[r].end)
+                    r++;
+            } else {
+                next = r < count ? min(ranges[r].block, end) : end;
+                ret = patch_copy_chunk(&pc, chunk_header.chunk_type,
+                                       data + (int64_t) (pos - block) * sparse_header.blk_sz,
+                                       fill_val, next - pos);
+            }
+            if (ret < 0)
+                goto out;
+        }
+
+        block = end;
+        offset += chunk_header.total_sz;
+    }
+
+    if (block != sparse_header.total_blks) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    sparse_header.file_hdr_sz = sizeof(sparse_header_t);
+    sparse_header.chunk_hdr_sz = sizeof(chunk_header_t);
+    sparse_header.total_chunks = pc.chunks;
+    sparse_header.image_checksum = 0;
+    ret = write_at(out, 0, &sparse_header, sizeof(sparse_header));
+
+ out:
+    free(pc.buf);
+    free(ranges);
 
     return ret;
 }
@@ -180,9 +1019,12 @@ int sparse_file_callback(struct sparse_file *s, bool sparse, bool crc,
     if (!out)
         return -ENOMEM;
 
+    output_file_stats(out, s->stats);
+
     ret = write_all_blocks(s, out);
 
-    output_file_close(out);
+    if (output_file_close(out) < 0 && !ret)
+        ret = -EIO;
 
     return ret;
 }
@@ -207,7 +1049,7 @@ int sparse_file_foreach_chunk(struct sparse_file *s, bool sparse, bool crc,
              unsigned int nr_blocks),
     void *priv)
 {
-    int ret;
+    int ret = 0;
     int chunks;
     struct chunk_data chk;
     struct output_file *out;
@@ -224,6 +1066,9 @@ int sparse_file_foreach_chunk(struct sparse_file *s, bool sparse, bool crc,
     if (!out)
         return -ENOMEM;
 
+    output_file_stats(out, s->stats);
+    sparse_file_progress_begin(s);
+
     for (bb = backed_block_iter_new(s->backed_block_list); bb;
             bb = backed_block_iter_next(bb)) {
         chk.block = backed_block_block(bb);
@@ -231,39 +1076,158 @@ int sparse_file_foreach_chunk(struct sparse_file *s, bool sparse, bool crc,
         ret = sparse_file_write_block(out, bb);
         if (ret)
             return ret;
+        sparse_file_progress_update(s, (int64_t) (chk.block + chk.nr_blocks) * s->block_size);
     }
 
-    output_file_close(out);
+    if (output_file_close(out) < 0)
+        ret = -EIO;
+    sparse_file_progress_end(s);
 
     return ret;
 }
 
-static int out_counter_write(void *priv, const void *data __unused, int len)
+/* Returns the bytes the chunk for bb takes up in a sparse or raw file */
+static int64_t chunk_len(struct sparse_file *s, struct backed_block *bb, bool sparse)
 {
-    int64_t *count = priv;
-    *count += len;
-    return 0;
+    unsigned int len = backed_block_len(bb);
+
+    if (backed_block_type(bb) == BACKED_BLOCK_FILL) {
+        return sparse ? sizeof(chunk_header_t) + sizeof(uint32_t) : len;
+    }
+
+    return (sparse ? sizeof(chunk_header_t) : 0) + ALIGN(len, s->block_size);
 }
 
-int64_t sparse_file_len(struct sparse_file * s, bool sparse, bool crc)
+/* Copies len bytes from offset into the data of bb to buf */
+static int backed_block_pread(struct backed_block *bb, char *buf, unsigned int len,
+                              unsigned int offset)
 {
+    const struct iovec *iov;
+    unsigned int iovcnt;
+    unsigned int i, n;
+    uint32_t fill_val;
+    int fd;
     int ret;
-    int chunks = sparse_count_chunks(s);
-    int64_t count = 0;
-    struct output_file *out;
 
-    out = output_file_open_callback(out_counter_write, &count,
-                                    s->block_size, s->len, false, sparse, chunks, crc);
-    if (!out) {
-        return -1;
+    switch (backed_block_type(bb)) {
+    case BACKED_BLOCK_DATA:
+        iovcnt = backed_block_data_iov(bb, &iov);
+        if (!iovcnt) {
+            memcpy(buf, (char *)backed_block_data(bb) + offset, len);
+            return 0;
+        }
+        for (i = 0; i < iovcnt && len; i++) {
+            if (offset >= iov[i].iov_len) {
+                offset -= iov[i].iov_len;
+                continue;
+            }
+            n = min(len, iov[i].iov_len - offset);
+            memcpy(buf, (char *)iov[i].iov_base + offset, n);
+            buf += n;
+            len -= n;
+            offset = 0;
+        }
+        return 0;
+    case BACKED_BLOCK_FILL:
+        /* Fill blocks start on a block boundary, the value repeats from there */
+        fill_val = backed_block_fill_val(bb);
+        for (i = 0; i < len; i++)
+            buf[i] = ((char *)&fill_val)[(offset + i) % sizeof(fill_val)];
+        return 0;
+    case BACKED_BLOCK_FD:
+        return pread_all(backed_block_fd(bb), buf, len, backed_block_file_offset(bb) + offset);
+    case BACKED_BLOCK_FILE:
+        fd = open(backed_block_filename(bb), O_RDONLY | O_BINARY);
+        if (fd < 0)
+            return -errno;
+        ret = pread_all(fd, buf, len, backed_block_file_offset(bb) + offset);
+        close(fd);
+        return ret;
     }
 
-    ret = write_all_blocks(s, out);
+    return -EINVAL;
+}
 
-    output_file_close(out);
+int sparse_file_pread(struct sparse_file *s, void *buf, size_t len, int64_t offset)
+{
+    struct backed_block *bb;
+    char *p = buf;
+    int64_t start;
+    int64_t end;
+    size_t n;
+    int ret;
+
+    if (offset < 0 || offset > s->len || len > (uint64_t)(s->len - offset))
+        return -EINVAL;
+
+    bb = backed_block_find(s->backed_block_list, offset / s->block_size);
+    while (len) {
+        if (!bb) {
+            memset(p, 0, len);
+            break;
+        }
 
-    if (ret < 0) {
-        return -1;
+        start = (int64_t) backed_block_block(bb) * s->block_size;
+        end = start + backed_block_len(bb);
+        if (offset < start) {
+            /* Not covered by any block */
+            n = min((int64_t) len, start - offset);
+            memset(p, 0, n);
+        } else if (offset < end) {
+            n = min((int64_t) len, end - offset);
+            ret = backed_block_pread(bb, p, n, offset - start);
+            if (ret < 0)
+                return ret;
+        } else {
+            /* The padding of a partial last block */
+            n = min((int64_t) len, start + ALIGN(backed_block_len(bb), s->block_size) - offset);
+            memset(p, 0, n);
+        }
+
+        p += n;
+        offset += n;
+        len -= n;
+        if (offset >= start + ALIGN(backed_block_len(bb), s->block_size))
+            bb = backed_block_iter_next(bb);
+    }
+
+    return 0;
+}
+
+/* Adds up what write_all_blocks would write, without reading any data */
+int64_t sparse_file_len(struct sparse_file * s, bool sparse, bool crc)
+{
+    struct backed_block *bb;
+    unsigned int last_block = 0;
+    int64_t count = sparse ? sizeof(sparse_header_t) : 0;
+    int64_t pad;
+
+    for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+        if (backed_block_block(bb) > last_block) {
+            unsigned int blocks = backed_block_block(bb) - last_block;
+            count += sparse ? sizeof(chunk_header_t) : (int64_t) blocks * s->block_size;
+        }
+        count += chunk_len(s, bb, sparse);
+        last_block = backed_block_block(bb) + DIV_ROUND_UP(backed_block_len(bb), s->block_size);
+    }
+
+    pad = s->len - (int64_t) last_block * s->block_size;
+    if (pad < 0) {
+        /* A raw file is cut back to the end of a partial last block */
+        if (!sparse) {
+            count += pad;
+        }
+    } else if (pad > 0) {
+        /* A trailing skip that isn't a whole number of blocks can't be a chunk */
+        if (!sparse) {
+            count += pad;
+        } else if (pad % s->block_size == 0) {
+            count += sizeof(chunk_header_t);
+        }
+    }
+
+    if (sparse && crc) {
+        count += sizeof(chunk_header_t) + sizeof(uint32_t);
     }
 
     return count;
@@ -278,13 +1242,11 @@ static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
                                                   struct sparse_file *to, unsigned int len)
 {
     int64_t count = 0;
-    struct output_file *out_counter;
     struct backed_block *last_bb = NULL;
     struct backed_block *bb;
     struct backed_block *start;
     unsigned int last_block = 0;
     int64_t file_len = 0;
-    int ret;
 
     /*
      * overhead is sparse file header, the potential end skip
@@ -294,11 +1256,6 @@ static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
     len -= overhead;
 
     start = backed_block_iter_new(from->backed_block_list);
-    out_counter = output_file_open_callback(out_counter_write, &count,
-                                            to->block_size, to->len, false, true, 0, false);
-    if (!out_counter) {
-        return NULL;
-    }
 
     for (bb = start; bb; bb = backed_block_iter_next(bb)) {
         count = 0;
@@ -306,12 +1263,7 @@ static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
             count += sizeof(chunk_header_t);
         last_block = backed_block_block(bb) + DIV_ROUND_UP(backed_block_len(bb), to->block_size);
 
-        /* will call out_counter_write to update count */
-        ret = sparse_file_write_block(out_counter, bb);
-        if (ret) {
-            bb = NULL;
-            goto out;
-        }
+        count += chunk_len(to, bb, true);
         if (file_len + count > len) {
             /*
              * If the remaining available size is more than 1/8th of the
@@ -332,9 +1284,6 @@ static struct backed_block *move_chunks_up_to_len(struct sparse_file *from,
  move:
     backed_block_list_move(from->backed_block_list, to->backed_block_list, start, last_bb);
 
- out:
-    output_file_close(out_counter);
-
     return bb;
 }
 
@@ -353,6 +1302,9 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 
     do {
         s = sparse_file_new(in_s->block_size, in_s->len);
+        s->stats = in_s->stats;
+        sparse_file_progress(s, in_s->progress_interval / 1000000, in_s->progress,
+                             in_s->progress_priv);
 
         bb = move_chunks_up_to_len(in_s, s, max_len);
 
@@ -372,7 +1324,58 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
     return c;
 }
 
+int sparse_file_resparse_all(struct sparse_file *in_s, unsigned int max_len,
+                             struct sparse_file ***out_s)
+{
+    struct backed_block *bb;
+    struct sparse_file **files = NULL;
+    struct sparse_file **tmp;
+    int size = 0;
+    int c = 0;
+
+    do {
+        if (c == size) {
+            size = size ? size * 2 : 8;
+            tmp = realloc(files, size * sizeof(struct sparse_file *));
+            if (!tmp) {
+                goto err;
+            }
+            files = tmp;
+        }
+
+        files[c] = sparse_file_new(in_s->block_size, in_s->len);
+        if (!files[c]) {
+            goto err;
+        }
+        files[c]->stats = in_s->stats;
+        sparse_file_progress(files[c], in_s->progress_interval / 1000000, in_s->progress,
+                             in_s->progress_priv);
+
+        bb = move_chunks_up_to_len(in_s, files[c], max_len);
+        c++;
+    } while (bb);
+
+    *out_s = files;
+
+    return c;
+
+ err:
+    /* Give back the blocks already moved out */
+    while (c--) {
+        backed_block_list_move(files[c]->backed_block_list, in_s->backed_block_list, NULL, NULL);
+        sparse_file_destroy(files[c]);
+    }
+    free(files);
+
+    return -ENOMEM;
+}
+
 void sparse_file_verbose(struct sparse_file *s)
 {
     s->verbose = true;
 }
+
+void sparse_file_discard(struct sparse_file *s)
+{
+    s->discard = true;
+}
@@ -0,0 +1,605 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+#include "sparse_crc32.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define lseek64 lseek
+#define off64_t off_t
+#endif
+
+/*
+ * Benchmarks the main libsparse paths on a synthetic image.  The raw image
+ * is made of runs of blocks, each run random data or a fill pattern, with a
+ * mean run length that sets how fragmented it is.  Every benchmark runs in
+ * its own child process, so that the peak RSS reported is its own.
+ */
+
+#define GEN_BUF_SIZE (1024 * 1024)
+#define CRC_BUF_SIZE (64 * 1024 * 1024)
+
+struct config {
+    const char *dir;
+    uint64_t size;              /* bytes of the raw image */
+    unsigned int block_size;
+    double fill_ratio;          /* share of blocks that are fill */
+    unsigned int run_blocks;    /* mean run length in blocks */
+    unsigned int iterations;
+    uint64_t seed;
+    char raw_path[4096];
+    char sparse_path[4096];
+    char out_path[4096];
+};
+
+struct result {
+    double seconds;             /* fastest iteration */
+    uint64_t bytes;             /* bytes processed per iteration */
+    int failed;
+};
+
+struct bench {
+    const char *name;
+    int (*run) (struct config *cfg, uint64_t *bytes);
+};
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *ptr = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, ptr, len);
+        if (ret < 0) {
+            return -1;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/* Writes the synthetic raw image, run by run */
+static int gen_raw(struct config *cfg)
+{
+    uint64_t blocks = cfg->size / cfg->block_size;
+    uint64_t block = 0;
+    uint64_t run;
+    uint32_t fill;
+    uint64_t *words;
+    char *buf;
+    unsigned int per_buf = GEN_BUF_SIZE / cfg->block_size;
+    unsigned int n, i;
+    bool is_fill;
+    int fd;
+
+    fd = open(cfg->raw_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (fd < 0) {
+        return -1;
+    }
+
+    buf = malloc(GEN_BUF_SIZE);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+    words = (uint64_t *) buf;
+
+    rng_state = cfg->seed ? cfg->seed : 1;
+    while (block < blocks) {
+        /* Run lengths are uniform in [1, 2 * run_blocks - 1] */
+        run = 1 + rng_next() % (2 * cfg->run_blocks - 1);
+        if (run > blocks - block) {
+            run = blocks - block;
+        }
+        is_fill = (rng_next() >> 11) * (1.0 / (1ULL << 53)) < cfg->fill_ratio;
+        /* Most fills in real images are zeros */
+        fill = rng_next() % 4 ? 0 : (uint32_t) rng_next();
+
+        block += run;
+        while (run > 0) {
+            n = run < per_buf ? run : per_buf;
+            if (is_fill) {
+                for (i = 0; i < n * cfg->block_size / 4; i++) {
+                    memcpy(buf + i * 4, &fill, 4);
+                }
+            } else {
+                for (i = 0; i < n * cfg->block_size / 8; i++) {
+                    words[i] = rng_next();
+                }
+            }
+            if (write_all(fd, buf, n * cfg->block_size) < 0) {
+                free(buf);
+                close(fd);
+                return -1;
+            }
+            run -= n;
+        }
+    }
+
+    free(buf);
+
+    return close(fd);
+}
+
+static struct sparse_file *read_raw(struct config *cfg, int fd)
+{
+    struct sparse_file *s;
+
+    s = sparse_file_new(cfg->block_size, lseek64(fd, 0, SEEK_END));
+    if (!s) {
+        return NULL;
+    }
+    lseek64(fd, 0, SEEK_SET);
+
+    if (sparse_file_read(s, fd, false, false) < 0) {
+        sparse_file_destroy(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+static int gen_sparse(struct config *cfg)
+{
+    struct sparse_file *s;
+    int in, out;
+    int ret;
+
+    in = open(cfg->raw_path, O_RDONLY | O_BINARY);
+    out = open(cfg->sparse_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (in < 0 || out < 0) {
+        return -1;
+    }
+
+    s = read_raw(cfg, in);
+    if (!s) {
+        return -1;
+    }
+
+    ret = sparse_file_write(s, out, false, true, false);
+
+    sparse_file_destroy(s);
+    close(in);
+    close(out);
+
+    return ret;
+}
+
+static int bench_read_normal(struct config *cfg, uint64_t *bytes)
+{
+    struct sparse_file *s;
+    int fd;
+
+    fd = open(cfg->raw_path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    s = read_raw(cfg, fd);
+    if (!s) {
+        close(fd);
+        return -1;
+    }
+    *bytes = cfg->size;
+
+    sparse_file_destroy(s);
+    close(fd);
+
+    return 0;
+}
+
+static int bench_import(struct config *cfg, uint64_t *bytes)
+{
+    struct sparse_file *s;
+    int fd;
+
+    fd = open(cfg->sparse_path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    s = sparse_file_import(fd, false, false);
+    if (!s) {
+        close(fd);
+        return -1;
+    }
+    *bytes = lseek64(fd, 0, SEEK_END);
+
+    sparse_file_destroy(s);
+    close(fd);
+
+    return 0;
+}
+
+/* Imports the sparse image and writes it out in the given mode */
+static int bench_write(struct config *cfg, uint64_t *bytes, bool gz, bool sparse, bool crc)
+{
+    struct sparse_file *s;
+    int in, out;
+    int ret;
+
+    in = open(cfg->sparse_path, O_RDONLY | O_BINARY);
+    out = open(cfg->out_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+    if (in < 0 || out < 0) {
+        return -1;
+    }
+
+    s = sparse_file_import(in, false, false);
+    if (!s) {
+        return -1;
+    }
+
+    ret = sparse_file_write(s, out, gz, sparse, crc);
+    *bytes = cfg->size;
+
+    sparse_file_destroy(s);
+    close(in);
+    close(out);
+    unlink(cfg->out_path);
+
+    return ret;
+}
+
+static int bench_write_raw(struct config *cfg, uint64_t *bytes)
+{
+    return bench_write(cfg, bytes, false, false, false);
+}
+
+static int bench_write_sparse(struct config *cfg, uint64_t *bytes)
+{
+    return bench_write(cfg, bytes, false, true, false);
+}
+
+static int bench_write_sparse_crc(struct config *cfg, uint64_t *bytes)
+{
+    return bench_write(cfg, bytes, false, true, true);
+}
+
+static int bench_write_gz(struct config *cfg, uint64_t *bytes)
+{
+    return bench_write(cfg, bytes, true, true, false);
+}
+
+/* Plans a split into eight pieces, which leaves the input as it was */
+static int bench_resparse(struct config *cfg, uint64_t *bytes)
+{
+    struct sparse_file *s;
+    int64_t len;
+    int fd;
+    int ret;
+
+    fd = open(cfg->sparse_path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    s = sparse_file_import(fd, false, false);
+    if (!s) {
+        close(fd);
+        return -1;
+    }
+
+    len = lseek64(fd, 0, SEEK_END);
+    ret = sparse_file_resparse(s, len / 8 > 1024 * 1024 ? len / 8 : 1024 * 1024, NULL, 0);
+    *bytes = cfg->size;
+
+    sparse_file_destroy(s);
+    close(fd);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int bench_crc32(struct config *cfg, uint64_t *bytes)
+{
+    uint64_t *buf;
+    uint32_t crc = 0;
+    size_t i;
+    int n;
+
+    buf = malloc(CRC_BUF_SIZE);
+    if (!buf) {
+        return -1;
+    }
+    for (i = 0; i < CRC_BUF_SIZE / 8; i++) {
+        buf[i] = rng_next();
+    }
+
+    /* At least as many bytes as the image, in whole buffers */
+    for (n = 0; (uint64_t) n * CRC_BUF_SIZE < cfg->size || n == 0; n++) {
+        crc = sparse_crc32(crc, buf, CRC_BUF_SIZE);
+    }
+    *bytes = (uint64_t) n *CRC_BUF_SIZE;
+
+    free(buf);
+
+    /* Keeps the loop from being optimized away */
+    return crc == 0x12345678 ? 1 : 0;
+}
+
+static struct bench benches[] = {
+    { "read_normal", bench_read_normal },
+    { "import", bench_import },
+    { "write_raw", bench_write_raw },
+    { "write_sparse", bench_write_sparse },
+    { "write_sparse_crc", bench_write_sparse_crc },
+    { "write_gz", bench_write_gz },
+    { "resparse", bench_resparse },
+    { "crc32", bench_crc32 },
+};
+
+#define NR_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/* Runs a benchmark in a child, which reports back through a pipe */
+static int run_bench(struct config *cfg, struct bench *b, struct result *res, long *rss_kb)
+{
+    struct rusage ru;
+    double start, t;
+    uint64_t bytes = 0;
+    unsigned int i;
+    int status;
+    int fds[2];
+    pid_t pid;
+
+    memset(res, 0, sizeof(*res));
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        res->seconds = -1;
+        for (i = 0; i < cfg->iterations; i++) {
+            start = now();
+            if (b->run(cfg, &bytes) < 0) {
+                res->failed = 1;
+                break;
+            }
+            t = now() - start;
+            if (res->seconds < 0 || t < res->seconds) {
+                res->seconds = t;
+            }
+        }
+        res->bytes = bytes;
+        write_all(fds[1], res, sizeof(*res));
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], res, sizeof(*res)) != sizeof(*res)) {
+        res->failed = 1;
+    }
+    close(fds[0]);
+
+    if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status)) {
+        res->failed = 1;
+    }
+    /* ru_maxrss is in bytes on Mac OS, kilobytes elsewhere */
+#if defined(__APPLE__) && defined(__MACH__)
+    *rss_kb = ru.ru_maxrss / 1024;
+#else
+    *rss_kb = ru.ru_maxrss;
+#endif
+
+    return 0;
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage: sparse_bench [-s <size_mb>] [-b <block_size>] [-f <fill_ratio>] "
+            "[-r <run_blocks>]\n"
+            "                    [-n <iterations>] [-S <seed>] [-d <dir>] [-c] [<benchmark> ...]\n");
+    fprintf(stderr, "  -s  size of the raw image in MiB (default 256)\n");
+    fprintf(stderr, "  -b  block size (default 4096)\n");
+    fprintf(stderr, "  -f  share of fill blocks, 0 to 1 (default 0.5)\n");
+    fprintf(stderr, "  -r  mean run length in blocks, lower is more fragmented (default 16)\n");
+    fprintf(stderr, "  -n  iterations per benchmark, the fastest counts (default 3)\n");
+    fprintf(stderr, "  -d  directory for the images, kept afterwards (default: temporary)\n");
+    fprintf(stderr, "  -c  print CSV instead of JSON\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct config cfg;
+    struct result res[NR_BENCHES];
+    long rss[NR_BENCHES];
+    bool selected[NR_BENCHES];
+    bool csv = false;
+    bool tmp_dir = false;
+    char tmp_template[4096];
+    struct stat st;
+    int64_t sparse_size;
+    unsigned int i;
+    bool first;
+    int opt;
+    int j;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.size = 256ULL * 1024 * 1024;
+    cfg.block_size = 4096;
+    cfg.fill_ratio = 0.5;
+    cfg.run_blocks = 16;
+    cfg.iterations = 3;
+    cfg.seed = 1;
+
+    while ((opt = getopt(argc, argv, "s:b:f:r:n:S:d:c")) != -1) {
+        switch (opt) {
+        case 's':
+            cfg.size = strtoull(optarg, NULL, 0) * 1024 * 1024;
+            break;
+        case 'b':
+            cfg.block_size = atoi(optarg);
+            break;
+        case 'f':
+            cfg.fill_ratio = atof(optarg);
+            break;
+        case 'r':
+            cfg.run_blocks = atoi(optarg);
+            break;
+        case 'n':
+            cfg.iterations = atoi(optarg);
+            break;
+        case 'S':
+            cfg.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            cfg.dir = optarg;
+            break;
+        case 'c':
+            csv = true;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (cfg.block_size < 1024 || cfg.block_size % 8 || cfg.block_size > GEN_BUF_SIZE ||
+        cfg.run_blocks < 1 || cfg.iterations < 1 || cfg.size < cfg.block_size ||
+        cfg.fill_ratio < 0 || cfg.fill_ratio > 1) {
+        usage();
+        exit(-1);
+    }
+    cfg.size -= cfg.size % cfg.block_size;
+
+    memset(selected, optind == argc, sizeof(selected));
+    for (j = optind; j < argc; j++) {
+        for (i = 0; i < NR_BENCHES && strcmp(benches[i].name, argv[j]); i++) ;
+        if (i == NR_BENCHES) {
+            fprintf(stderr, "Unknown benchmark %s\n", argv[j]);
+            exit(-1);
+        }
+        selected[i] = true;
+    }
+
+    if (!cfg.dir) {
+        snprintf(tmp_template, sizeof(tmp_template), "%s/sparse_bench.XXXXXX",
+                 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+        cfg.dir = mkdtemp(tmp_template);
+        if (!cfg.dir) {
+            fprintf(stderr, "Cannot create temporary directory\n");
+            exit(-1);
+        }
+        tmp_dir = true;
+    }
+    snprintf(cfg.raw_path, sizeof(cfg.raw_path), "%s/bench.raw", cfg.dir);
+    snprintf(cfg.sparse_path, sizeof(cfg.sparse_path), "%s/bench.simg", cfg.dir);
+    snprintf(cfg.out_path, sizeof(cfg.out_path), "%s/bench.out", cfg.dir);
+
+    if (gen_raw(&cfg) < 0 || gen_sparse(&cfg) < 0) {
+        fprintf(stderr, "Cannot generate images in %s\n", cfg.dir);
+        exit(-1);
+    }
+    sparse_size = stat(cfg.sparse_path, &st) == 0 ? st.st_size : -1;
+
+    for (i = 0; i < NR_BENCHES; i++) {
+        if (selected[i] && run_bench(&cfg, &benches[i], &res[i], &rss[i]) < 0) {
+            fprintf(stderr, "Cannot run benchmark %s\n", benches[i].name);
+            exit(-1);
+        }
+    }
+
+    if (csv) {
+        printf("benchmark,bytes,seconds,mb_per_s,peak_rss_kb,failed\n");
+    } else {
+        printf("{\n");
+        printf("  \"raw_bytes\": %" PRIu64 ",\n", cfg.size);
+        printf("  \"sparse_bytes\": %" PRId64 ",\n", sparse_size);
+        printf("  \"block_size\": %u,\n", cfg.block_size);
+        printf("  \"fill_ratio\": %g,\n", cfg.fill_ratio);
+        printf("  \"run_blocks\": %u,\n", cfg.run_blocks);
+        printf("  \"iterations\": %u,\n", cfg.iterations);
+        printf("  \"seed\": %" PRIu64 ",\n", cfg.seed);
+        printf("  \"results\": [");
+    }
+
+    first = true;
+    for (i = 0; i < NR_BENCHES; i++) {
+        double mbps;
+
+        if (!selected[i]) {
+            continue;
+        }
+        mbps = res[i].seconds > 0 ? res[i].bytes / res[i].seconds / (1024 * 1024) : 0;
+        if (csv) {
+            printf("%s,%" PRIu64 ",%.6f,%.1f,%ld,%d\n", benches[i].name, res[i].bytes,
+                   res[i].seconds, mbps, rss[i], res[i].failed);
+        } else {
+            printf("%s\n    { \"benchmark\": \"%s\", \"bytes\": %" PRIu64 ", \"seconds\": %.6f"
+                   ", \"mb_per_s\": %.1f, \"peak_rss_kb\": %ld, \"failed\": %s }",
+                   first ? "" : ",", benches[i].name, res[i].bytes, res[i].seconds, mbps,
+                   rss[i], res[i].failed ? "true" : "false");
+        }
+        first = false;
+    }
+
+    if (!csv) {
+        printf("\n  ]\n}\n");
+    }
+
+    if (tmp_dir) {
+        unlink(cfg.raw_path);
+        unlink(cfg.sparse_path);
+        rmdir(cfg.dir);
+    }
+
+    exit(0);
+}
@@ -23,9 +23,33 @@ struct sparse_file {
     unsigned int block_size;
     int64_t len;
     bool verbose;
+    bool discard;
 
     struct backed_block_list *backed_block_list;
-    struct output_file *out;
+    struct output_file *out;    /* output of a windowed read */
+    unsigned int window;        /* chunks read before they are written out */
+    unsigned int out_block;     /* end of the blocks written out so far */
+    unsigned int out_chunks;    /* chunks written out so far */
+    struct sparse_stats *stats;
+    uint64_t crc_ns;            /* checksum time of the read in progress */
+
+    void (*progress) (void *priv, int64_t done, int64_t total, double rate);
+    void *progress_priv;
+    uint64_t progress_interval; /* in ns */
+    uint64_t progress_start;    /* start of the read or write in progress */
+    uint64_t progress_last;     /* time of the last report */
+    int64_t progress_done;      /* bytes done at the last report */
 };
 
+int sparse_file_window_open(struct sparse_file *s, int fd, bool sparse, unsigned int chunks,
+                            unsigned int window);
+int sparse_file_window_flush(struct sparse_file *s);
+int sparse_file_window_close(struct sparse_file *s, int fd, bool sparse, unsigned int chunks,
+                             int ret);
+
+void sparse_file_progress_init(struct sparse_file *s);
+void sparse_file_progress_begin(struct sparse_file *s);
+void sparse_file_progress_update(struct sparse_file *s, int64_t done);
+void sparse_file_progress_end(struct sparse_file *s);
+
 #endif                          /* _LIBSPARSE_SPARSE_FILE_H_ */
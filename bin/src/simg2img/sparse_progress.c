@@ -0,0 +1,115 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <sparse/sparse.h>
+
+#include "sparse_file.h"
+#include "sparse_stats.h"
+
+#define MiB (1024.0 * 1024.0)
+
+static unsigned int default_interval_ms;
+static void (*default_progress) (void *priv, int64_t done, int64_t total, double rate);
+static void *default_priv;
+
+void sparse_file_progress(struct sparse_file *s, unsigned int interval_ms,
+                          void (*progress) (void *priv, int64_t done, int64_t total, double rate),
+                          void *priv)
+{
+    s->progress = progress;
+    s->progress_priv = priv;
+    s->progress_interval = (uint64_t)interval_ms * 1000000;
+}
+
+void sparse_progress_default(unsigned int interval_ms,
+                             void (*progress) (void *priv, int64_t done, int64_t total,
+                                               double rate), void *priv)
+{
+    default_interval_ms = interval_ms;
+    default_progress = progress;
+    default_priv = priv;
+}
+
+/* Sets up a new sparse file with the defaults */
+void sparse_file_progress_init(struct sparse_file *s)
+{
+    sparse_file_progress(s, default_interval_ms, default_progress, default_priv);
+}
+
+void sparse_file_progress_begin(struct sparse_file *s)
+{
+    if (!s->progress) {
+        return;
+    }
+
+    s->progress_start = s->progress_last = stats_now();
+    s->progress_done = 0;
+}
+
+void sparse_file_progress_update(struct sparse_file *s, int64_t done)
+{
+    uint64_t now;
+
+    if (!s->progress) {
+        return;
+    }
+
+    /* The end of the read or write is reported once it is over */
+    if (done >= s->len) {
+        return;
+    }
+
+    now = stats_now();
+    if (now - s->progress_last < s->progress_interval || now == s->progress_last) {
+        return;
+    }
+
+    s->progress(s->progress_priv, done, s->len,
+                (done - s->progress_done) * 1e9 / (now - s->progress_last));
+    s->progress_last = now;
+    s->progress_done = done;
+}
+
+void sparse_file_progress_end(struct sparse_file *s)
+{
+    uint64_t ns;
+
+    if (!s->progress) {
+        return;
+    }
+
+    ns = stats_now() - s->progress_start;
+    s->progress(s->progress_priv, s->len, s->len, ns ? s->len * 1e9 / ns : 0);
+}
+
+void sparse_progress_print(void *priv, int64_t done, int64_t total, double rate)
+{
+    const char *label = priv;
+    int percent = total > 0 ? done * 100 / total : 100;
+    int64_t left = rate > 0 ? (total - done) / rate : 0;
+
+    if (done < total) {
+        fprintf(stderr, "\r%s%s%3d%% %8.1f of %.1f MiB %8.1f MiB/s %3" PRId64 ":%02" PRId64
+                " left ", label ? label : "", label ? ": " : "", percent, done / MiB,
+                total / MiB, rate / MiB, left / 60, left % 60);
+    } else {
+        fprintf(stderr, "\r%s%s%3d%% %8.1f of %.1f MiB %8.1f MiB/s          \n",
+                label ? label : "", label ? ": " : "", percent, done / MiB, total / MiB,
+                rate / MiB);
+    }
+    fflush(stderr);
+}
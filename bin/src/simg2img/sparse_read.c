@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <sparse/sparse.h>
@@ -35,6 +36,9 @@
 #include "sparse_crc32.h"
 #include "sparse_file.h"
 #include "sparse_format.h"
+#include "sparse_stats.h"
+#include "sparse_trace.h"
+#include "uring.h"
 
 #if defined(__APPLE__) && defined(__MACH__)
 #define lseek64 lseek
@@ -97,10 +101,30 @@ static void verbose_error(bool verbose, int err, const char *fmt, ...)
     }
 }
 
+/* read_all() on the input of s, counted as a single read */
+static int read_input(struct sparse_file *s, int fd, void *buf, size_t len)
+{
+    int ret = read_all(fd, buf, len);
+
+    if (ret == 0) {
+        stats_call(s->stats, SPARSE_STATS_SYS_READ, len);
+    }
+
+    return ret;
+}
+
+static off64_t seek_input(struct sparse_file *s, int fd, off64_t offset, int whence)
+{
+    stats_call(s->stats, SPARSE_STATS_SYS_LSEEK, 0);
+
+    return lseek64(fd, offset, whence);
+}
+
 static int process_raw_chunk(struct sparse_file *s, unsigned int chunk_size,
                              int fd, int64_t offset, unsigned int blocks, unsigned int block,
                              uint32_t * crc32)
 {
+    uint64_t start;
     int ret;
     int chunk;
     unsigned int len = blocks * s->block_size;
@@ -118,18 +142,22 @@ static int process_raw_chunk(struct sparse_file *s, unsigned int chunk_size,
         return ret;
     }
 
+    stats_chunk_in(s->stats, SPARSE_STATS_RAW, len);
+
     if (crc32) {
         while (len) {
             chunk = min(len, COPY_BUF_SIZE);
-            ret = read_all(fd, copybuf, chunk);
+            ret = read_input(s, fd, copybuf, chunk);
             if (ret < 0) {
                 return ret;
             }
+            start = stats_start(s->stats);
             *crc32 = sparse_crc32(*crc32, copybuf, chunk);
+            stats_crc_end(s->stats, &s->crc_ns, start);
             len -= chunk;
         }
     } else {
-        lseek64(fd, len, SEEK_CUR);
+        seek_input(s, fd, len, SEEK_CUR);
     }
 
     return 0;
@@ -144,12 +172,13 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
     uint32_t fill_val;
     uint32_t *fillbuf;
     unsigned int i;
+    uint64_t start;
 
     if (chunk_size != sizeof(fill_val)) {
         return -EINVAL;
     }
 
-    ret = read_all(fd, &fill_val, sizeof(fill_val));
+    ret = read_input(s, fd, &fill_val, sizeof(fill_val));
     if (ret < 0) {
         return ret;
     }
@@ -159,7 +188,11 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
         return ret;
     }
 
+    stats_chunk_in(s->stats, SPARSE_STATS_FILL, len);
+
     if (crc32) {
+        start = stats_start(s->stats);
+
         /* Fill copy_buf with the fill value */
         fillbuf = (uint32_t *) copybuf;
         for (i = 0; i < (COPY_BUF_SIZE / sizeof(fill_val)); i++) {
@@ -171,6 +204,7 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
             *crc32 = sparse_crc32(*crc32, copybuf, chunk);
             len -= chunk;
         }
+        stats_crc_end(s->stats, &s->crc_ns, start);
     }
 
     return 0;
@@ -184,8 +218,11 @@ static int process_skip_chunk(struct sparse_file *s, unsigned int chunk_size,
         return -EINVAL;
     }
 
+    stats_chunk_in(s->stats, SPARSE_STATS_DONT_CARE, (int64_t) blocks * s->block_size);
+
     if (crc32) {
         int64_t len = (int64_t) blocks * s->block_size;
+        uint64_t start = stats_start(s->stats);
         memset(copybuf, 0, COPY_BUF_SIZE);
 
         while (len) {
@@ -193,12 +230,14 @@ static int process_skip_chunk(struct sparse_file *s, unsigned int chunk_size,
             *crc32 = sparse_crc32(*crc32, copybuf, chunk);
             len -= chunk;
         }
+        stats_crc_end(s->stats, &s->crc_ns, start);
     }
 
     return 0;
 }
 
-static int process_crc32_chunk(int fd, unsigned int chunk_size, uint32_t * crc32)
+static int process_crc32_chunk(struct sparse_file *s, int fd, unsigned int chunk_size,
+                               uint32_t * crc32)
 {
     uint32_t file_crc32;
     int ret;
@@ -207,11 +246,13 @@ static int process_crc32_chunk(int fd, unsigned int chunk_size, uint32_t * crc32
         return -EINVAL;
     }
 
-    ret = read_all(fd, &file_crc32, sizeof(file_crc32));
+    ret = read_input(s, fd, &file_crc32, sizeof(file_crc32));
     if (ret < 0) {
         return ret;
     }
 
+    stats_chunk_in(s->stats, SPARSE_STATS_CRC32, 0);
+
     if (crc32 != NULL && file_crc32 != *crc32) {
         return -EINVAL;
     }
@@ -256,7 +297,7 @@ static int process_chunk(struct sparse_file *s, int fd, off64_t offset,
         }
         return chunk_header->chunk_sz;
     case CHUNK_TYPE_CRC32:
-        ret = process_crc32_chunk(fd, chunk_data_size, crc_ptr);
+        ret = process_crc32_chunk(s, fd, chunk_data_size, crc_ptr);
         if (ret < 0) {
             verbose_error(s->verbose, -EINVAL, "crc block at %" PRId64, offset);
             return ret;
@@ -279,6 +320,8 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
     uint32_t crc32 = 0;
     uint32_t *crc_ptr = 0;
     unsigned int cur_block = 0;
+    unsigned int pending = 0;
+    uint64_t counted = 0;
     off64_t offset;
 
     if (!copybuf) {
@@ -293,7 +336,9 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
         crc_ptr = &crc32;
     }
 
-    ret = read_all(fd, &sparse_header, sizeof(sparse_header));
+    sparse_file_progress_begin(s);
+
+    ret = read_input(s, fd, &sparse_header, sizeof(sparse_header));
     if (ret < 0) {
         return ret;
     }
@@ -318,11 +363,11 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
         /* Skip the remaining bytes in a header that is longer than
          * we expected.
          */
-        lseek64(fd, sparse_header.file_hdr_sz - SPARSE_HEADER_LEN, SEEK_CUR);
+        seek_input(s, fd, sparse_header.file_hdr_sz - SPARSE_HEADER_LEN, SEEK_CUR);
     }
 
     for (i = 0; i < sparse_header.total_chunks; i++) {
-        ret = read_all(fd, &chunk_header, sizeof(chunk_header));
+        ret = read_input(s, fd, &chunk_header, sizeof(chunk_header));
         if (ret < 0) {
             return ret;
         }
@@ -331,10 +376,10 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
             /* Skip the remaining bytes in a header that is longer than
              * we expected.
              */
-            lseek64(fd, sparse_header.chunk_hdr_sz - CHUNK_HEADER_LEN, SEEK_CUR);
+            seek_input(s, fd, sparse_header.chunk_hdr_sz - CHUNK_HEADER_LEN, SEEK_CUR);
         }
 
-        offset = lseek64(fd, 0, SEEK_CUR);
+        offset = seek_input(s, fd, 0, SEEK_CUR);
 
         ret = process_chunk(s, fd, offset, sparse_header.chunk_hdr_sz, &chunk_header,
                             cur_block, crc_ptr);
@@ -343,75 +388,514 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
         }
 
         cur_block += ret;
+
+        if (s->out && ++pending >= s->window) {
+            ret = sparse_file_window_flush(s);
+            if (ret < 0) {
+                return ret;
+            }
+#ifdef USE_MINGW
+            /* Raw chunks were read back through the same fd */
+            seek_input(s, fd, offset + chunk_header.total_sz - sparse_header.chunk_hdr_sz,
+                       SEEK_SET);
+#endif
+            pending = 0;
+        }
+
+        sparse_file_progress_update(s, (int64_t) cur_block * s->block_size);
+        trace_counter("read", (int64_t) cur_block * s->block_size, &counted);
     }
 
     if (sparse_header.total_blks != cur_block) {
         return -EINVAL;
     }
 
+    sparse_file_progress_end(s);
+
     return 0;
 }
 
+/*
+ * Raw input is scanned in buffers of up to READ_BUF_SIZE bytes.  Regular
+ * files are read through io_uring when available, with up to READ_BUFS
+ * buffers being read ahead while an earlier one is scanned.  Otherwise a
+ * single buffer is filled with read().
+ */
+#define READ_BUFS 4
+#define READ_BUF_SIZE (1024U*1024U)
+
+struct input_reader {
+    int fd;
+    int64_t len;
+    int64_t queued;             /* end of the data requested so far */
+    int64_t consumed;           /* end of the data handed out so far */
+    unsigned int buf_size;
+    char *bufs;
+    struct uring *ring;
+    int done[READ_BUFS];        /* bytes read into each buffer, or -1 */
+    int cur;                    /* buffer handed out last, or -1 */
+    struct sparse_stats *stats;
+};
+
+#ifdef HAVE_IO_URING
+static int input_reader_queue(struct input_reader *r, int buf)
+{
+    unsigned int len = min(r->len - r->queued, (int64_t) r->buf_size);
+    int ret;
+
+    ret = uring_read(r->ring, r->fd, buf, r->bufs + buf * r->buf_size, len, r->queued, buf);
+    if (ret < 0) {
+        return ret;
+    }
+    stats_call(r->stats, SPARSE_STATS_SYS_READ, len);
+    r->done[buf] = -1;
+    r->queued += len;
+
+    return 0;
+}
+#endif
+
+static int input_reader_init(struct input_reader *r, int fd, int64_t len, unsigned int block_size,
+                             struct sparse_stats *stats)
+{
+    memset(r, 0, sizeof(*r));
+    r->stats = stats;
+    r->fd = fd;
+    r->len = len;
+    r->cur = -1;
+    r->buf_size = ALIGN_DOWN(READ_BUF_SIZE, block_size);
+    if (r->buf_size == 0) {
+        r->buf_size = block_size;
+    }
+
+#ifdef HAVE_IO_URING
+    struct iovec iov[READ_BUFS];
+    struct stat st;
+    int i;
+
+    /* Blocks are added at offsets from the start of the file, read from there */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && lseek64(fd, 0, SEEK_CUR) == 0 &&
+        posix_memalign((void **)&r->bufs, 4096, READ_BUFS * r->buf_size) == 0) {
+        for (i = 0; i < READ_BUFS; i++) {
+            iov[i].iov_base = r->bufs + i * r->buf_size;
+            iov[i].iov_len = r->buf_size;
+        }
+        r->ring = uring_new(READ_BUFS, iov, READ_BUFS);
+        for (i = 0; r->ring && i < READ_BUFS && r->queued < r->len; i++) {
+            if (input_reader_queue(r, i) < 0) {
+                uring_free(r->ring);
+                r->ring = NULL;
+                r->queued = 0;
+            }
+        }
+        if (r->ring) {
+            return 0;
+        }
+        free(r->bufs);
+    }
+#endif
+
+    r->bufs = malloc(r->buf_size);
+    if (!r->bufs) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+ * Points buf at the next part of the input and returns its length, 0 at
+ * the end of the input, or negative errno.  The previous buffer is no
+ * longer valid after the call.
+ */
+static int input_reader_next(struct input_reader *r, char **buf)
+{
+    unsigned int len = min(r->len - r->consumed, (int64_t) r->buf_size);
+    int ret;
+
+    if (len == 0) {
+        return 0;
+    }
+
+#ifdef HAVE_IO_URING
+    if (r->ring) {
+        uint64_t tag;
+        int res;
+        int next = r->cur < 0 ? 0 : (r->cur + 1) % READ_BUFS;
+
+        /* The previous buffer is free again, read ahead into it */
+        if (r->cur >= 0 && r->queued < r->len) {
+            ret = input_reader_queue(r, r->cur);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        while (r->done[next] < 0) {
+            ret = uring_wait(r->ring, &tag, &res);
+            if (ret < 0) {
+                return ret;
+            }
+            if (res < 0) {
+                return res;
+            }
+            r->done[tag] = res;
+        }
+
+        /* Finish a short read synchronously */
+        while ((unsigned int)r->done[next] < len) {
+            ret = pread64(r->fd, r->bufs + next * r->buf_size + r->done[next],
+                          len - r->done[next], r->consumed + r->done[next]);
+            if (ret < 0 && errno != EINTR) {
+                return -errno;
+            }
+            if (ret == 0) {
+                return -EINVAL;
+            }
+            if (ret > 0) {
+                stats_call(r->stats, SPARSE_STATS_SYS_READ, ret);
+                r->done[next] += ret;
+            }
+        }
+
+        r->cur = next;
+        r->consumed += len;
+        *buf = r->bufs + next * r->buf_size;
+
+        return len;
+    }
+#endif
+
+    ret = read_all(r->fd, r->bufs, len);
+    if (ret < 0) {
+        return ret;
+    }
+    stats_call(r->stats, SPARSE_STATS_SYS_READ, len);
+
+    r->consumed += len;
+    *buf = r->bufs;
+
+    return len;
+}
+
+static void input_reader_destroy(struct input_reader *r)
+{
+#ifdef HAVE_IO_URING
+    if (r->ring) {
+        uring_free(r->ring);
+        /* Leave the file offset where read() would have left it */
+        lseek64(r->fd, r->consumed, SEEK_SET);
+        stats_call(r->stats, SPARSE_STATS_SYS_LSEEK, 0);
+    }
+#endif
+    free(r->bufs);
+}
+
+/* A run of data blocks, or of fill blocks with the same value, counted as one chunk */
+struct input_run {
+    int type;
+    uint32_t fill_val;
+    uint64_t len;
+};
+
+static void input_run_add(struct sparse_stats *stats, struct input_run *run,
+                          int type, uint32_t fill_val, unsigned int len)
+{
+    if (run->len && (type != run->type ||
+                     (type == SPARSE_STATS_FILL && fill_val != run->fill_val))) {
+        stats_chunk_in(stats, run->type, run->len);
+        run->len = 0;
+    }
+
+    run->type = type;
+    run->fill_val = fill_val;
+    run->len += len;
+}
+
 static int sparse_file_read_normal(struct sparse_file *s, int fd)
 {
     int ret;
-    uint32_t *buf = malloc(s->block_size);
+    struct input_reader reader;
+    struct input_run run = { 0 };
+    uint64_t start;
+    uint64_t trace;
+    uint64_t read_start = trace_start();
+    uint32_t *buf;
+    char *data = NULL;
     unsigned int block = 0;
-    int64_t remain = s->len;
     int64_t offset = 0;
+    int len;
+    int pos;
     unsigned int to_read;
     unsigned int i;
     bool sparse_block;
 
-    if (!buf) {
-        return -ENOMEM;
+    ret = input_reader_init(&reader, fd, s->len, s->block_size, s->stats);
+    if (ret < 0) {
+        return ret;
     }
 
-    while (remain > 0) {
-        to_read = min(remain, s->block_size);
-        ret = read_all(fd, buf, to_read);
-        if (ret < 0) {
-            error("failed to read sparse file");
-            free(buf);
-            return ret;
+    sparse_file_progress_begin(s);
+
+    for (;;) {
+        start = stats_start(s->stats);
+        trace = trace_start();
+        len = input_reader_next(&reader, &data);
+        stats_end(s->stats, SPARSE_STATS_INPUT, start, 0);
+        trace_span("input", trace, len);
+        if (len <= 0) {
+            break;
         }
 
-        if (to_read == s->block_size) {
-            sparse_block = true;
-            for (i = 1; i < s->block_size / sizeof(uint32_t); i++) {
-                if (buf[0] != buf[i]) {
-                    sparse_block = false;
-                    break;
+        start = stats_start(s->stats);
+        trace = trace_start();
+        for (pos = 0; pos < len; pos += to_read) {
+            buf = (uint32_t *) (data + pos);
+            to_read = min(len - pos, (int)s->block_size);
+
+            if (to_read == s->block_size) {
+                sparse_block = true;
+                for (i = 1; i < s->block_size / sizeof(uint32_t); i++) {
+                    if (buf[0] != buf[i]) {
+                        sparse_block = false;
+                        break;
+                    }
                 }
+            } else {
+                sparse_block = false;
             }
-        } else {
-            sparse_block = false;
-        }
 
-        if (sparse_block) {
-            /* TODO: add flag to use skip instead of fill for buf[0] == 0 */
-            sparse_file_add_fill(s, buf[0], to_read, block);
-        } else {
-            sparse_file_add_fd(s, fd, offset, to_read, block);
+            if (sparse_block) {
+                /* TODO: add flag to use skip instead of fill for buf[0] == 0 */
+                sparse_file_add_fill(s, buf[0], to_read, block);
+            } else {
+                sparse_file_add_fd(s, fd, offset, to_read, block);
+            }
+            if (s->stats) {
+                input_run_add(s->stats, &run, sparse_block ? SPARSE_STATS_FILL : SPARSE_STATS_RAW,
+                              buf[0], to_read);
+            }
+
+            offset += to_read;
+            block++;
         }
+        stats_end(s->stats, SPARSE_STATS_CLASSIFY, start, 0);
+        trace_span("classify", trace, len);
+        trace_counter("read", offset, NULL);
+        sparse_file_progress_update(s, offset);
+    }
+
+    if (run.len) {
+        stats_chunk_in(s->stats, run.type, run.len);
+    }
+
+    input_reader_destroy(&reader);
 
-        remain -= to_read;
-        offset += to_read;
-        block++;
+    if (len < 0) {
+        error("failed to read sparse file");
+        return len;
     }
 
-    free(buf);
+    sparse_file_progress_end(s);
+    trace_span("read", read_start, s->len);
+
     return 0;
 }
 
+/*
+ * Each candidate block size is made of blocks of the smallest one, and is a
+ * fill block if all of those are fill blocks of the same value.  The input
+ * is classified once in blocks of the smallest size, and the results are
+ * gathered into the blocks and then the runs of each candidate.
+ */
+struct estimate_state {
+    unsigned int parts;         /* smallest blocks in a block */
+    unsigned int seen;          /* smallest blocks of the current block seen */
+    bool fill;                  /* the current block is a fill block so far */
+    uint32_t fill_val;
+    struct input_run run;
+};
+
+static void estimate_run_end(struct sparse_estimate *est, struct input_run *run)
+{
+    if (!run->len) {
+        return;
+    }
+
+    est->chunks++;
+    est->len += CHUNK_HEADER_LEN;
+    if (run->type == SPARSE_STATS_FILL) {
+        est->len += sizeof(uint32_t);
+    } else {
+        est->len += ALIGN(run->len, est->block_size);
+    }
+    run->len = 0;
+}
+
+static void estimate_block(struct sparse_estimate *est, struct estimate_state *st,
+                           int type, uint32_t fill_val, unsigned int len)
+{
+    struct input_run *run = &st->run;
+
+    if (run->len && (type != run->type ||
+                     (type == SPARSE_STATS_FILL && fill_val != run->fill_val))) {
+        estimate_run_end(est, run);
+    }
+
+    run->type = type;
+    run->fill_val = fill_val;
+    run->len += len;
+}
+
+/* Adds a block of the smallest size, a partial one can only be the last */
+static void estimate_part(struct sparse_estimate *est, struct estimate_state *st,
+                          bool fill, uint32_t fill_val, unsigned int len, unsigned int part_len)
+{
+    if (st->seen == 0) {
+        st->fill = fill;
+        st->fill_val = fill_val;
+    } else if (!fill || fill_val != st->fill_val) {
+        st->fill = false;
+    }
+    st->seen++;
+
+    if (len < part_len) {
+        estimate_block(est, st, SPARSE_STATS_RAW, 0, (st->seen - 1) * part_len + len);
+        st->seen = 0;
+    } else if (st->seen == st->parts) {
+        estimate_block(est, st, st->fill ? SPARSE_STATS_FILL : SPARSE_STATS_RAW,
+                       st->fill_val, est->block_size);
+        st->seen = 0;
+    }
+}
+
+int sparse_estimate_block_sizes(int fd, int64_t len, struct sparse_estimate *est,
+                                unsigned int count)
+{
+    struct sparse_file *s;
+    struct estimate_state *states;
+    struct input_reader reader;
+    uint64_t trace = trace_start();
+    uint64_t start;
+    uint32_t *buf;
+    char *data = NULL;
+    unsigned int part_len = 0;
+    unsigned int to_read;
+    unsigned int i, j;
+    int64_t offset = 0;
+    int ret;
+    int pos;
+    bool fill;
+
+    for (i = 0; i < count; i++) {
+        if (est[i].block_size == 0 || est[i].block_size % sizeof(uint32_t)) {
+            return -EINVAL;
+        }
+        if (part_len == 0 || est[i].block_size < part_len) {
+            part_len = est[i].block_size;
+        }
+    }
+
+    states = calloc(count, sizeof(*states));
+    if (!states) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (est[i].block_size % part_len) {
+            free(states);
+            return -EINVAL;
+        }
+        states[i].parts = est[i].block_size / part_len;
+        est[i].len = SPARSE_HEADER_LEN;
+        est[i].chunks = 0;
+    }
+
+    /* Only for the stats and progress of the read, no blocks are added */
+    s = sparse_file_new(part_len, len);
+    if (!s) {
+        free(states);
+        return -ENOMEM;
+    }
+
+    ret = input_reader_init(&reader, fd, len, part_len, s->stats);
+    if (ret < 0) {
+        sparse_file_destroy(s);
+        free(states);
+        return ret;
+    }
+
+    sparse_file_progress_begin(s);
+
+    for (;;) {
+        start = stats_start(s->stats);
+        ret = input_reader_next(&reader, &data);
+        stats_end(s->stats, SPARSE_STATS_INPUT, start, 0);
+        if (ret <= 0) {
+            break;
+        }
+
+        start = stats_start(s->stats);
+        for (pos = 0; pos < ret; pos += to_read) {
+            buf = (uint32_t *) (data + pos);
+            to_read = min(ret - pos, (int)part_len);
+
+            fill = to_read == part_len;
+            for (j = 1; fill && j < part_len / sizeof(uint32_t); j++) {
+                if (buf[0] != buf[j]) {
+                    fill = false;
+                }
+            }
+
+            for (i = 0; i < count; i++) {
+                estimate_part(&est[i], &states[i], fill, buf[0], to_read, part_len);
+            }
+        }
+        offset += ret;
+        stats_end(s->stats, SPARSE_STATS_CLASSIFY, start, 0);
+        sparse_file_progress_update(s, offset);
+    }
+
+    input_reader_destroy(&reader);
+
+    if (ret == 0) {
+        /* A partial last block is written as data */
+        for (i = 0; i < count; i++) {
+            if (states[i].seen) {
+                estimate_block(&est[i], &states[i], SPARSE_STATS_RAW, 0,
+                               states[i].seen * part_len);
+            }
+            estimate_run_end(&est[i], &states[i].run);
+        }
+        sparse_file_progress_end(s);
+        trace_span("estimate", trace, len);
+    }
+
+    sparse_file_destroy(s);
+    free(states);
+
+    return ret;
+}
+
 int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc)
 {
+    uint64_t start;
+    uint64_t trace;
+    int ret;
+
     if (crc && !sparse) {
         return -EINVAL;
     }
 
     if (sparse) {
-        return sparse_file_read_sparse(s, fd, crc);
+        /* The checksums computed while parsing are timed on their own */
+        start = stats_start(s->stats);
+        trace = trace_start();
+        s->crc_ns = 0;
+        ret = sparse_file_read_sparse(s, fd, crc);
+        stats_end(s->stats, SPARSE_STATS_PARSE, start, s->crc_ns);
+        trace_span("parse", trace, s->len);
+        return ret;
     } else {
         return sparse_file_read_normal(s, fd);
     }
@@ -473,6 +957,58 @@ struct sparse_file *sparse_file_import(int fd, bool verbose, bool crc)
     return s;
 }
 
+int sparse_file_convert(int in, int out, bool sparse, bool crc, bool verbose,
+                        unsigned int window)
+{
+    int ret;
+    sparse_header_t sparse_header;
+    struct sparse_file *s;
+
+    ret = read_all(in, &sparse_header, sizeof(sparse_header));
+    if (ret < 0) {
+        verbose_error(verbose, ret, "header");
+        return ret;
+    }
+
+    if (sparse_header.magic != SPARSE_HEADER_MAGIC ||
+        sparse_header.major_version != SPARSE_HEADER_MAJOR_VER ||
+        sparse_header.file_hdr_sz < SPARSE_HEADER_LEN ||
+        sparse_header.chunk_hdr_sz < sizeof(chunk_header_t)) {
+        verbose_error(verbose, -EINVAL, "header");
+        return -EINVAL;
+    }
+
+    s = sparse_file_new(sparse_header.blk_sz,
+                        (int64_t) sparse_header.total_blks * sparse_header.blk_sz);
+    if (!s) {
+        verbose_error(verbose, -EINVAL, NULL);
+        return -EINVAL;
+    }
+
+    s->verbose = verbose;
+
+    if (lseek64(in, 0, SEEK_SET) < 0) {
+        ret = -errno;
+        verbose_error(verbose, ret, "seeking");
+        sparse_file_destroy(s);
+        return ret;
+    }
+
+    /* The input's chunk count is right unless chunks merge or hold a crc */
+    ret = sparse_file_window_open(s, out, sparse, sparse_header.total_chunks, window);
+    if (ret < 0) {
+        sparse_file_destroy(s);
+        return ret;
+    }
+
+    ret = sparse_file_read(s, in, true, crc);
+    ret = sparse_file_window_close(s, out, sparse, sparse_header.total_chunks, ret);
+
+    sparse_file_destroy(s);
+
+    return ret;
+}
+
 struct sparse_file *sparse_file_import_auto(int fd, bool crc, bool verbose)
 {
     struct sparse_file *s;
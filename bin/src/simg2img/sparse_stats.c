@@ -0,0 +1,146 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sparse/sparse.h>
+
+#include "sparse_file.h"
+#include "sparse_stats.h"
+
+struct sparse_stats *sparse_default_stats;
+
+static const char *type_names[SPARSE_STATS_TYPES] = {
+    [SPARSE_STATS_RAW] = "raw",
+    [SPARSE_STATS_FILL] = "fill",
+    [SPARSE_STATS_DONT_CARE] = "dont_care",
+    [SPARSE_STATS_CRC32] = "crc32",
+};
+
+static const char *call_names[SPARSE_STATS_SYSCALLS] = {
+    [SPARSE_STATS_SYS_READ] = "read",
+    [SPARSE_STATS_SYS_WRITE] = "write",
+    [SPARSE_STATS_SYS_LSEEK] = "lseek",
+    [SPARSE_STATS_SYS_MMAP] = "mmap",
+    [SPARSE_STATS_SYS_COPY] = "copy_file_range",
+};
+
+static const char *phase_names[SPARSE_STATS_PHASES] = {
+    [SPARSE_STATS_PARSE] = "parse",
+    [SPARSE_STATS_INPUT] = "input",
+    [SPARSE_STATS_CLASSIFY] = "classify",
+    [SPARSE_STATS_CRC] = "crc",
+    [SPARSE_STATS_OUTPUT] = "output",
+};
+
+struct json_buf {
+    char *buf;
+    size_t len;
+    size_t pos;                 /* length of the whole output so far */
+};
+
+static void json_printf(struct json_buf *j, const char *fmt, ...)
+{
+    va_list argp;
+    int ret;
+
+    va_start(argp, fmt);
+    ret = vsnprintf(j->pos < j->len ? j->buf + j->pos : NULL,
+                    j->pos < j->len ? j->len - j->pos : 0, fmt, argp);
+    va_end(argp);
+
+    if (ret > 0) {
+        j->pos += ret;
+    }
+}
+
+static void json_chunks(struct json_buf *j, const char *name,
+                        const uint64_t *chunks, const uint64_t *bytes)
+{
+    int i;
+
+    json_printf(j, "\"%s\":{", name);
+    for (i = 0; i < SPARSE_STATS_TYPES; i++) {
+        json_printf(j, "%s\"%s\":{\"chunks\":%" PRIu64 ",\"bytes\":%" PRIu64 "}",
+                    i ? "," : "", type_names[i], chunks[i], bytes[i]);
+    }
+    json_printf(j, "}");
+}
+
+void sparse_file_stats(struct sparse_file *s, struct sparse_stats *stats)
+{
+    s->stats = stats;
+}
+
+void sparse_stats_default(struct sparse_stats *stats)
+{
+    sparse_default_stats = stats;
+}
+
+int sparse_stats_json(const struct sparse_stats *stats, char *buf, size_t len)
+{
+    struct json_buf j = {
+        .buf = buf,
+        .len = len,
+    };
+    int i;
+
+    if (len) {
+        buf[0] = '\0';
+    }
+
+    json_printf(&j, "{");
+    json_chunks(&j, "chunks_in", stats->in_chunks, stats->in_bytes);
+    json_printf(&j, ",");
+    json_chunks(&j, "chunks_out", stats->out_chunks, stats->out_bytes);
+
+    json_printf(&j, ",\"syscalls\":{");
+    for (i = 0; i < SPARSE_STATS_SYSCALLS; i++) {
+        json_printf(&j, "%s\"%s\":{\"calls\":%" PRIu64 ",\"bytes\":%" PRIu64 "}",
+                    i ? "," : "", call_names[i], stats->calls[i], stats->call_bytes[i]);
+    }
+
+    json_printf(&j, "},\"seconds\":{");
+    for (i = 0; i < SPARSE_STATS_PHASES; i++) {
+        json_printf(&j, "%s\"%s\":%.6f", i ? "," : "", phase_names[i], stats->ns[i] / 1e9);
+    }
+    json_printf(&j, "}}\n");
+
+    return j.pos;
+}
+
+int sparse_stats_print(FILE *f, const struct sparse_stats *stats)
+{
+    char *buf;
+    int len;
+    int ret = 0;
+
+    len = sparse_stats_json(stats, NULL, 0);
+    buf = malloc(len + 1);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    sparse_stats_json(stats, buf, len + 1);
+    if (fputs(buf, f) == EOF) {
+        ret = -EIO;
+    }
+    free(buf);
+
+    return ret;
+}
@@ -0,0 +1,95 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_STATS_H_
+#define _LIBSPARSE_SPARSE_STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sparse/sparse.h>
+
+/*
+ * Every helper takes the stats of a sparse file or output, which are NULL
+ * unless counting was asked for, and does nothing but test them then.
+ * Timings are taken with stats_start() and stats_end(), time spent on
+ * checksums in between is added up separately and left out of the span.
+ */
+
+extern struct sparse_stats *sparse_default_stats;
+
+static inline uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_call(struct sparse_stats *stats, int call, uint64_t bytes)
+{
+    if (stats) {
+        stats_add(&stats->calls[call], 1);
+        stats_add(&stats->call_bytes[call], bytes);
+    }
+}
+
+static inline void stats_chunk_in(struct sparse_stats *stats, int type, uint64_t bytes)
+{
+    if (stats) {
+        stats_add(&stats->in_chunks[type], 1);
+        stats_add(&stats->in_bytes[type], bytes);
+    }
+}
+
+static inline void stats_chunk_out(struct sparse_stats *stats, int type, uint64_t bytes)
+{
+    if (stats) {
+        stats_add(&stats->out_chunks[type], 1);
+        stats_add(&stats->out_bytes[type], bytes);
+    }
+}
+
+static inline uint64_t stats_start(struct sparse_stats *stats)
+{
+    return stats ? stats_now() : 0;
+}
+
+/* Adds the time since start to phase, less excluded_ns counted elsewhere */
+static inline void stats_end(struct sparse_stats *stats, int phase, uint64_t start,
+                             uint64_t excluded_ns)
+{
+    if (stats) {
+        stats_add(&stats->ns[phase], stats_now() - start - excluded_ns);
+    }
+}
+
+/* Ends a checksum started at start, adding its time to *crc_ns as well */
+static inline void stats_crc_end(struct sparse_stats *stats, uint64_t *crc_ns, uint64_t start)
+{
+    uint64_t ns;
+
+    if (stats) {
+        ns = stats_now() - start;
+        *crc_ns += ns;
+        stats_add(&stats->ns[SPARSE_STATS_CRC], ns);
+    }
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <sparse/sparse.h>
+
+#include "sparse_trace.h"
+
+/*
+ * The trace is a JSON array of Chrome trace events, one per line, so that
+ * traces of several processes can be merged by joining their lines.  Times
+ * are CLOCK_MONOTONIC microseconds, which all processes of the machine
+ * share.
+ */
+
+FILE *sparse_trace_file;
+static int trace_pid;
+static bool trace_started;      /* an event was written, the next needs a comma */
+
+static int trace_tid(void)
+{
+#if defined(__linux__) && defined(SYS_gettid)
+    return syscall(SYS_gettid);
+#else
+    return trace_pid;
+#endif
+}
+
+static void trace_event(const char *fmt, ...)
+{
+    va_list argp;
+
+    flockfile(sparse_trace_file);
+    if (trace_started) {
+        fputc(',', sparse_trace_file);
+    }
+    trace_started = true;
+
+    va_start(argp, fmt);
+    vfprintf(sparse_trace_file, fmt, argp);
+    va_end(argp);
+
+    fputc('\n', sparse_trace_file);
+    funlockfile(sparse_trace_file);
+}
+
+void trace_write_span(const char *name, uint64_t start, int64_t bytes)
+{
+    uint64_t end = stats_now();
+
+    trace_event("{\"name\":\"%s\",\"cat\":\"libsparse\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"bytes\":%" PRId64 "}}",
+                name, start / 1e3, (end - start) / 1e3, trace_pid, trace_tid(), bytes);
+}
+
+void trace_write_counter(const char *name, int64_t value)
+{
+    trace_event("{\"name\":\"%s\",\"cat\":\"libsparse\",\"ph\":\"C\",\"ts\":%.3f,"
+                "\"pid\":%d,\"args\":{\"bytes\":%" PRId64 "}}",
+                name, stats_now() / 1e3, trace_pid, value);
+}
+
+int sparse_trace_open(const char *dir, const char *name)
+{
+    static bool registered;
+    char path[4096];
+    FILE *f;
+
+    if (!dir || !*dir || sparse_trace_file) {
+        return 0;
+    }
+
+    trace_pid = getpid();
+    if (snprintf(path, sizeof(path), "%s/%s.%d.json", dir, name, trace_pid) >= (int)sizeof(path)) {
+        return -ENAMETOOLONG;
+    }
+
+    f = fopen(path, "w");
+    if (!f) {
+        return -errno;
+    }
+    fputs("[\n", f);
+
+    sparse_trace_file = f;
+    trace_started = false;
+    trace_event("{\"name\":\"process_labels\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"labels\":\"%s\"}}",
+                trace_pid, name);
+
+    /* Tools exit from anywhere, the array is closed on the way out */
+    if (!registered) {
+        atexit(sparse_trace_close);
+        registered = true;
+    }
+
+    return 0;
+}
+
+void sparse_trace_close(void)
+{
+    if (!sparse_trace_file) {
+        return;
+    }
+
+    fputs("]\n", sparse_trace_file);
+    fclose(sparse_trace_file);
+    sparse_trace_file = NULL;
+}
@@ -0,0 +1,66 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_TRACE_H_
+#define _LIBSPARSE_SPARSE_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sparse_stats.h"
+
+/*
+ * Trace events are only written once sparse_trace_open() has opened
+ * sparse_trace_file, until then trace_start() returns 0 and the other
+ * helpers return right away.
+ */
+
+extern FILE *sparse_trace_file;
+
+/* Counters are written at most once per TRACE_COUNTER_INTERVAL ns */
+#define TRACE_COUNTER_INTERVAL 10000000
+
+static inline uint64_t trace_start(void)
+{
+    return sparse_trace_file ? stats_now() : 0;
+}
+
+void trace_write_span(const char *name, uint64_t start, int64_t bytes);
+void trace_write_counter(const char *name, int64_t value);
+
+/* Records a span of the calling thread from start to now */
+static inline void trace_span(const char *name, uint64_t start, int64_t bytes)
+{
+    if (sparse_trace_file) {
+        trace_write_span(name, start, bytes);
+    }
+}
+
+/* Records a counter of the process, unless *last is less than an interval ago */
+static inline void trace_counter(const char *name, int64_t value, uint64_t *last)
+{
+    uint64_t now;
+
+    if (sparse_trace_file) {
+        now = stats_now();
+        if (!last || now - *last >= TRACE_COUNTER_INTERVAL) {
+            trace_write_counter(name, value);
+            if (last) {
+                *last = now;
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Minimal io_uring wrapper used to keep several reads or writes in flight.
+ * It talks to the kernel directly so that libsparse doesn't depend on
+ * liburing.  It is only built when HAVE_IO_URING is defined, and uring_new
+ * returns NULL whenever the running kernel refuses io_uring, in which case
+ * callers fall back to plain read/write.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct uring {
+    int fd;
+    unsigned int depth;
+    unsigned int pending;       /* submitted but not completed */
+    unsigned int queued;        /* queued but not submitted */
+
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static int uring_enter(struct uring *r, unsigned int submit, unsigned int wait)
+{
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+struct uring *uring_new(unsigned int depth, const struct iovec *bufs, int nbufs)
+{
+    struct io_uring_params p;
+    struct uring *r;
+
+    r = calloc(1, sizeof(struct uring));
+    if (!r) {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->depth = p.sq_entries;
+
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len) {
+            r->sq_ring_len = r->cq_ring_len;
+        }
+        r->cq_ring_len = 0;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        goto err_sq;
+    }
+
+    if (r->cq_ring_len) {
+        r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            goto err_cq;
+        }
+    } else {
+        r->cq_ring = r->sq_ring;
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        goto err_sqes;
+    }
+
+    r->sq_tail = (unsigned int *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned int *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned int *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+    if (nbufs && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                         bufs, nbufs) < 0) {
+        goto err_register;
+    }
+
+    return r;
+
+ err_register:
+    munmap(r->sqes, r->sqes_len);
+ err_sqes:
+    if (r->cq_ring_len) {
+        munmap(r->cq_ring, r->cq_ring_len);
+    }
+ err_cq:
+    munmap(r->sq_ring, r->sq_ring_len);
+ err_sq:
+    close(r->fd);
+    free(r);
+    return NULL;
+}
+
+/*
+ * Queues one request, submitting everything queued so far if the ring is
+ * full.  buf is the index of a registered buffer holding data, or -1.
+ */
+static int uring_queue(struct uring *r, int op, int fd, int buf, const void *data,
+                       unsigned int len, int64_t offset, uint64_t tag)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+    int ret;
+
+    if (r->pending + r->queued >= r->depth) {
+        return -EBUSY;
+    }
+
+    tail = *r->sq_tail;
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    if (buf >= 0) {
+        sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = buf;
+    }
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+
+    ret = uring_enter(r, r->queued, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    r->queued -= ret;
+    r->pending += ret;
+
+    return 0;
+}
+
+int uring_read(struct uring *r, int fd, int buf, void *data, unsigned int len,
+               int64_t offset, uint64_t tag)
+{
+    return uring_queue(r, IORING_OP_READ, fd, buf, data, len, offset, tag);
+}
+
+int uring_write(struct uring *r, int fd, int buf, const void *data, unsigned int len,
+                int64_t offset, uint64_t tag)
+{
+    return uring_queue(r, IORING_OP_WRITE, fd, buf, data, len, offset, tag);
+}
+
+/*
+ * Waits for one request to complete and returns its tag and result, which
+ * is a byte count or a negative errno.  Returns -ENOENT if nothing is in
+ * flight.
+ */
+int uring_wait(struct uring *r, uint64_t *tag, int *res)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    int ret;
+
+    if (r->pending + r->queued == 0) {
+        return -ENOENT;
+    }
+
+    for (;;) {
+        head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        ret = uring_enter(r, r->queued, 1);
+        if (ret < 0) {
+            return ret;
+        }
+        r->queued -= ret;
+        r->pending += ret;
+    }
+
+    cqe = &r->cqes[head & *r->cq_mask];
+    *tag = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    r->pending--;
+
+    return 0;
+}
+
+void uring_free(struct uring *r)
+{
+    uint64_t tag;
+    int res;
+
+    while (uring_wait(r, &tag, &res) == 0) ;
+
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring_len) {
+        munmap(r->cq_ring, r->cq_ring_len);
+    }
+    munmap(r->sq_ring, r->sq_ring_len);
+    close(r->fd);
+    free(r);
+}
+
+#endif
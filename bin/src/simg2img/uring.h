@@ -0,0 +1,32 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_URING_H_
+#define _LIBSPARSE_URING_H_
+
+#include <stdint.h>
+
+#include "defs.h"
+
+struct uring;
+
+struct uring *uring_new(unsigned int depth, const struct iovec *bufs, int nbufs);
+int uring_read(struct uring *r, int fd, int buf, void *data, unsigned int len,
+               int64_t offset, uint64_t tag);
+int uring_write(struct uring *r, int fd, int buf, const void *data, unsigned int len,
+                int64_t offset, uint64_t tag);
+int uring_wait(struct uring *r, uint64_t *tag, int *res);
+void uring_free(struct uring *r);
+
+#endif
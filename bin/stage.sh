@@ -0,0 +1,49 @@
+# Sourced by the unpack, recreate and repack scripts.
+#
+# stage <name> <command> [args...] runs one step of the pipeline.  When
+# PIPELINE_STATS names a stats file, the step runs through stagerun, which
+# appends its wall time, bytes read and written and peak RSS to the file.
+#
+# When PIPELINE_TRACE names a trace file, the steps and the tools that
+# trace themselves write Chrome trace events to TRACE_DIR, next to it, and
+# trace_merge joins them into the trace file.  Events of earlier runs stay
+# in TRACE_DIR until it is removed.
+
+STAGERUN=$(pwd)/bin/stagerun
+
+# The scripts cd into output directories, paths are kept to where they started
+if [ -n "$PIPELINE_STATS" ]
+then
+    case $PIPELINE_STATS in /*) ;; *) PIPELINE_STATS=$(pwd)/$PIPELINE_STATS ;; esac
+    export PIPELINE_STATS
+fi
+
+if [ -n "$PIPELINE_TRACE" ]
+then
+    case $PIPELINE_TRACE in /*) ;; *) PIPELINE_TRACE=$(pwd)/$PIPELINE_TRACE ;; esac
+    TRACE_DIR=$PIPELINE_TRACE.d
+    mkdir -p "$TRACE_DIR"
+    export PIPELINE_TRACE TRACE_DIR
+fi
+
+stage() {
+    name=$1
+    shift
+    if [ -n "$PIPELINE_STATS" ] || [ -n "$PIPELINE_TRACE" ]
+    then
+        "$STAGERUN" "${PIPELINE_STATS:--}" "$name" "$@"
+    else
+        "$@"
+    fi
+}
+
+# Each event is on a line of its own, after a comma but for the first one
+trace_merge() {
+    [ -n "$PIPELINE_TRACE" ] || return 0
+    {
+        echo '{"traceEvents":['
+        cat "$TRACE_DIR"/*.json 2>/dev/null |
+            awk '$0 == "[" || $0 == "]" { next } { sub(/^,/, ""); printf "%s%s\n", n++ ? "," : "", $0 }'
+        echo ']}'
+    } > "$PIPELINE_TRACE"
+}